@@ -15,28 +15,186 @@
  *  To speed up, (K)Flat can use linear buffer as simple
  *  memory allocator.
  *  It's also useful in kernel, as it supports atomic context
+ *
+ *  The pool is a list of chunks. The first one is small
+ *  and each next chunk doubles in size (up to
+ *  FLAT_LINEAR_MEMORY_MAX_CHUNK_SIZE), so small dumps start
+ *  quickly and large dumps don't hit a fixed ceiling.
+ *  When flat->mkeep is set, flatten_fini clears only the
+ *  used part of each chunk and keeps it for the next capture.
+ *  Atomic allocations are limited to KMALLOC_MAX_SIZE and
+ *  often fail, so callers about to enter stop_machine should
+ *  fill the spare list with flatten_reserve_pool first.
  ******************************************************/
+#if LINEAR_MEMORY_ALLOCATOR > 0
+static struct flat_mem_chunk* flat_mem_chunk_take_spare(struct flat* flat, size_t min_size) {
+    struct flat_mem_chunk** pchunk = &flat->mspare;
+
+    while(*pchunk != NULL) {
+        struct flat_mem_chunk* chunk = *pchunk;
+        if(chunk->size >= min_size) {
+            *pchunk = chunk->next;
+            return chunk;
+        }
+        pchunk = &chunk->next;
+    }
+    return NULL;
+}
+
+static struct flat_mem_chunk* flat_mem_chunk_alloc(struct flat* flat, size_t min_size) {
+    struct flat_mem_chunk* chunk;
+    size_t size = flat->mchunk_size;
+    size_t max_size = FLATTEN_BSP_ZALLOC_CHUNK_MAX;
+    size_t floor_size = min_size > FLAT_LINEAR_MEMORY_MIN_CHUNK_SIZE ? min_size : FLAT_LINEAR_MEMORY_MIN_CHUNK_SIZE;
+
+    chunk = flat_mem_chunk_take_spare(flat, min_size);
+    if(chunk != NULL) {
+        size = chunk->size;
+        goto chunk_ready;
+    }
+
+    if(size > max_size)
+        size = max_size;
+    if(size < min_size)
+        size = min_size;
+
+    chunk = FLATTEN_BSP_ZALLOC_CHUNK(sizeof(struct flat_mem_chunk) + size);
+    while(chunk == NULL && size > floor_size) {
+        /* Retry with smaller chunks, but keep them large enough for many requests */
+        size = size / 2 > floor_size ? size / 2 : floor_size;
+        chunk = FLATTEN_BSP_ZALLOC_CHUNK(sizeof(struct flat_mem_chunk) + size);
+    }
+    if(chunk == NULL)
+        return NULL;
+
+chunk_ready:
+    chunk->next = flat->mchunk;
+    chunk->size = size;
+    chunk->used = 0;
+    flat->mchunk = chunk;
+    flat->msize += size;
+
+    if(flat->mchunk_size < FLAT_LINEAR_MEMORY_MAX_CHUNK_SIZE) {
+        flat->mchunk_size *= 2;
+        if(flat->mchunk_size > FLAT_LINEAR_MEMORY_MAX_CHUNK_SIZE)
+            flat->mchunk_size = FLAT_LINEAR_MEMORY_MAX_CHUNK_SIZE;
+    }
+    return chunk;
+}
+
+static void flat_mem_chunk_list_free(struct flat_mem_chunk* chunk) {
+    while(chunk != NULL) {
+        struct flat_mem_chunk* next = chunk->next;
+        FLATTEN_BSP_FREE(chunk);
+        chunk = next;
+    }
+}
+
+static void flat_mem_chunks_destroy(struct flat* flat) {
+    struct flat_mem_chunk* chunk = flat->mchunk;
+
+    if(flat->mkeep) {
+        /* Zero only what was handed out - the rest is still clean */
+        while(chunk != NULL) {
+            struct flat_mem_chunk* next = chunk->next;
+            memset(chunk + 1, 0, chunk->used);
+            chunk->used = 0;
+            chunk->next = flat->mspare;
+            flat->mspare = chunk;
+            chunk = next;
+        }
+    } else {
+        flat_mem_chunk_list_free(chunk);
+        flat_mem_chunk_list_free(flat->mspare);
+        flat->mspare = NULL;
+    }
+
+    flat->mchunk = NULL;
+    flat->mchunk_size = 0;
+    flat->mused = 0;
+    flat->msize = 0;
+}
+#endif
+
+void flatten_release_pool(struct flat* flat) {
+#if LINEAR_MEMORY_ALLOCATOR > 0
+    flat_mem_chunk_list_free(flat->mspare);
+    flat->mspare = NULL;
+#endif
+}
+
+/*
+ * Make sure that at least size bytes can be handed out by flat_zalloc without
+ *  allocating new chunks. Must be called from process context
+ */
+int flatten_reserve_pool(struct flat* flat, size_t size) {
+#if LINEAR_MEMORY_ALLOCATOR > 0
+    struct flat_mem_chunk* chunk;
+    size_t avail = 0;
+
+    if(flat->mchunk != NULL)
+        avail = flat->mchunk->size - flat->mchunk->used;
+    for(chunk = flat->mspare; chunk != NULL; chunk = chunk->next)
+        avail += chunk->size;
+
+    while(avail < size) {
+        size_t chunk_size = size - avail;
+        if(chunk_size > FLAT_LINEAR_MEMORY_MAX_CHUNK_SIZE)
+            chunk_size = FLAT_LINEAR_MEMORY_MAX_CHUNK_SIZE;
+
+        chunk = FLATTEN_BSP_ZALLOC_CHUNK(sizeof(struct flat_mem_chunk) + chunk_size);
+        if(chunk == NULL) {
+            flat_errs("Failed to reserve %zu bytes for flatten linear memory allocator (available: %zu)\n",
+                      size, avail);
+            return -ENOMEM;
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = flat->mspare;
+        flat->mspare = chunk;
+        avail += chunk_size;
+    }
+#endif
+    return 0;
+}
+
+/* Free the image area allocated by flatten_write */
+void flatten_release_area(struct flat* flat) {
+    if(!flat->area_owned)
+        return;
+    FLATTEN_BSP_AREA_FREE(flat->area);
+    flat->area = NULL;
+    flat->size = 0;
+    flat->area_owned = 0;
+}
+EXPORT_FUNC(flatten_release_area);
+
 void* flat_zalloc(struct flat* flat, size_t size, size_t n) {
 #if LINEAR_MEMORY_ALLOCATOR > 0
     void* ptr = NULL;
     static int diag_issued;
+    struct flat_mem_chunk* chunk = flat->mchunk;
     size_t alloc_size = ALIGN(size * n, __alignof__(unsigned long long));
 
-    if(unlikely(flat->mptrindex + alloc_size > flat->msize)) {
-        if(!diag_issued) {
-            flat_errs("Maximum capacity of flatten linear memory allocator (%zu) has been reached at %zu\n",
-                      flat->msize, flat->mptrindex);
-            diag_issued = 1;
+    if(unlikely(chunk == NULL || chunk->used + alloc_size > chunk->size)) {
+        chunk = flat_mem_chunk_alloc(flat, alloc_size);
+        if(chunk == NULL) {
+            if(!diag_issued) {
+                flat_errs("Failed to grow flatten linear memory allocator by %zu bytes (memory used: %zu, memory avail: %zu)\n",
+                          alloc_size, flat->mused, flat->msize);
+                diag_issued = 1;
+            }
+            return NULL;
         }
-        return NULL;
     }
 
-    ptr = (unsigned char*)flat->mpool + flat->mptrindex;
-    flat->mptrindex += alloc_size;
+    ptr = (unsigned char*)(chunk + 1) + chunk->used;
+    chunk->used += alloc_size;
+    flat->mused += alloc_size;
     return ptr;
 #else
     /* Let's see how much memory was allocated */
-    flat->mptrindex += size * n;
+    flat->mused += size * n;
     return FLATTEN_BSP_ZALLOC(size * n);
 #endif
 }
@@ -52,10 +210,43 @@ EXPORT_FUNC(flat_free);
 
 /*******************************************************
  * BINARY STREAM
- *  List based implementation of expandable vector
+ *  Elements are kept in a list ordered by address, while
+ *  copied memory is packed in large chunks, so objects
+ *  inserted in address order end up adjacent there too
  ******************************************************/
-static struct blstream* create_binary_stream_element(struct flat* flat, size_t size) {
-    void* memory = NULL;
+#define BINARY_STREAM_CHUNK_SIZE (1024 * 1024)
+
+static void* binary_stream_data_alloc(struct flat* flat, size_t size) {
+    struct blstream_chunk* chunk;
+    void* data;
+
+    /* Large objects get their own chunk, not to waste the tail of the current one */
+    if(size > BINARY_STREAM_CHUNK_SIZE / 16) {
+        chunk = (struct blstream_chunk*)flat_zalloc(flat, sizeof(struct blstream_chunk) + size, 1);
+        if(chunk == NULL)
+            return NULL;
+        chunk->next = flat->FLCTRL.storage_chunks;
+        flat->FLCTRL.storage_chunks = chunk;
+        return chunk->data;
+    }
+
+    if(size > flat->FLCTRL.storage_chunk_left) {
+        chunk = (struct blstream_chunk*)flat_zalloc(flat, sizeof(struct blstream_chunk) + BINARY_STREAM_CHUNK_SIZE, 1);
+        if(chunk == NULL)
+            return NULL;
+        chunk->next = flat->FLCTRL.storage_chunks;
+        flat->FLCTRL.storage_chunks = chunk;
+        flat->FLCTRL.storage_chunk_free = chunk->data;
+        flat->FLCTRL.storage_chunk_left = BINARY_STREAM_CHUNK_SIZE;
+    }
+
+    data = flat->FLCTRL.storage_chunk_free;
+    flat->FLCTRL.storage_chunk_free += size;
+    flat->FLCTRL.storage_chunk_left -= size;
+    return data;
+}
+
+static struct blstream* create_binary_stream_element(struct flat* flat, const void* source, size_t size) {
     struct blstream* node;
 
     node = (struct blstream*)flat_zalloc(flat, sizeof(struct blstream), 1);
@@ -63,107 +254,109 @@ static struct blstream* create_binary_stream_element(struct flat* flat, size_t s
         return 0;
 
     if(!flat->FLCTRL.mem_copy_skip) {
-        memory = flat_zalloc(flat, size, 1);
-        if(memory == NULL) {
+        node->data = binary_stream_data_alloc(flat, size);
+        if(node->data == NULL) {
             flat_free(node);
             return 0;
         }
+        hwasan_safe_memcpy(node->data, source, size);
     }
 
-    node->data = memory;
+    node->source = source;
     node->size = size;
     INIT_LIST_HEAD(&node->head);
+    flat->FLCTRL.storage_count++;
     return node;
 }
 
 static struct blstream* binary_stream_append(struct flat* flat, const void* data, size_t size) {
-    struct blstream* v = create_binary_stream_element(flat, size);
+    struct blstream* v = create_binary_stream_element(flat, data, size);
     if(v == NULL)
         return 0;
 
-    v->source = data;
-    if(!flat->FLCTRL.mem_copy_skip)
-        hwasan_safe_memcpy(v->data, data, size);
     list_add_tail(&v->head, &flat->FLCTRL.storage_head);
     return v;
 }
 
 static struct blstream* binary_stream_insert_front(struct flat* flat, const void* data, size_t size, struct blstream* where) {
-    struct blstream* v = create_binary_stream_element(flat, size);
+    struct blstream* v = create_binary_stream_element(flat, data, size);
     if(v == NULL)
         return 0;
 
-    v->source = data;
-    if(!flat->FLCTRL.mem_copy_skip)
-        hwasan_safe_memcpy(v->data, data, size);
     list_add_tail(&v->head, &where->head);
     return v;
 }
 
 static struct blstream* binary_stream_insert_back(struct flat* flat, const void* data, size_t size, struct blstream* where) {
-    struct blstream* v = create_binary_stream_element(flat, size);
+    struct blstream* v = create_binary_stream_element(flat, data, size);
     if(v == NULL)
         return 0;
 
-    v->source = data;
-    if(!flat->FLCTRL.mem_copy_skip)
-        hwasan_safe_memcpy(v->data, data, size);
     list_add(&v->head, &where->head);
     return v;
 }
 
+/*
+ * Assign image offsets to all elements in a single pass. Alignment padding
+ *  is only accounted for here and zero-filled when the memory is written.
+ *  Elements are also gathered into an array for the write stage.
+ */
 int binary_stream_calculate_index(struct flat* flat) {
-    struct blstream *ptr = NULL, *v;
-    size_t index = 0;
-    static unsigned char padding[128] = {0};
+    struct blstream *ptr = NULL, *prev = NULL;
+    struct blstream** elements;
+    size_t index = 0, count = 0;
+
+    elements = (struct blstream**)flat_zalloc(flat, sizeof(struct blstream*), flat->FLCTRL.storage_count ? flat->FLCTRL.storage_count : 1);
+    if(elements == NULL)
+        return ENOMEM;
 
     list_for_each_entry(ptr, &flat->FLCTRL.storage_head, head) {
-        size_t align = 0;
-        struct blstream* prev = list_prev_entry(ptr, head);
         if(ptr->alignment && index != 0) {
             if(ptr->alignment > 128) {
-                flat_errs("Invalid ptr->alignment(%zu) in blstream node", ptr->alignment);
+                flat_errs("Invalid ptr->alignment(%u) in blstream node", ptr->alignment);
+                flat_free(elements);
                 return EINVAL;
             }
 
             // Don't pad memory chunks that will be merged into one memory fragment
-            if((uintptr_t)prev->source + prev->size < (uintptr_t)ptr->source) {
-                align = -index & (ptr->alignment - 1);
-                if(align != 0) {
-                    v = binary_stream_insert_front(flat, padding, align, ptr);
-                    if(!v)
-                        return ENOMEM;
-                    v->index = index;
-                    index += v->size;
-                }
-            }
+            if((uintptr_t)prev->source + prev->size < (uintptr_t)ptr->source)
+                index += -index & (ptr->alignment - 1);
         }
 
         ptr->index = index;
         index += ptr->size;
+        elements[count++] = ptr;
+        prev = ptr;
     }
 
+    flat_free(flat->FLCTRL.storage_elements);
+    flat->FLCTRL.storage_elements = elements;
+    flat->FLCTRL.storage_count = count;
     return 0;
 }
 
 static void binary_stream_destroy(struct flat* flat) {
     struct blstream* entry = NULL;
     struct blstream* temp = NULL;
+    struct blstream_chunk* chunk = flat->FLCTRL.storage_chunks;
 
     list_for_each_entry_safe(entry, temp, &flat->FLCTRL.storage_head, head) {
         list_del(&entry->head);
-        flat_free(entry->data);
         flat_free(entry);
     }
-}
 
-static int binary_stream_element_write(struct flat* flat, struct blstream* p, size_t* wcounter_p) {
-    if(p->data)
-        FLATTEN_WRITE_ONCE((unsigned char*)(p->data), p->size, wcounter_p);
-    else
-        /* flat->FLCTRL.mem_copy_skip is set - copy memory directly from source*/
-        FLATTEN_WRITE_ONCE((unsigned char*)(p->source), p->size, wcounter_p);
-    return 0;
+    while(chunk != NULL) {
+        struct blstream_chunk* next = chunk->next;
+        flat_free(chunk);
+        chunk = next;
+    }
+
+    flat_free(flat->FLCTRL.storage_elements);
+    flat->FLCTRL.storage_elements = NULL;
+    flat->FLCTRL.storage_count = 0;
+    flat->FLCTRL.storage_chunks = NULL;
+    flat->FLCTRL.storage_chunk_free = NULL;
+    flat->FLCTRL.storage_chunk_left = 0;
 }
 
 static void binary_stream_print(struct flat* flat) {
@@ -172,290 +365,564 @@ static void binary_stream_print(struct flat* flat) {
 
     FLATTEN_LOG_DEBUG("# Binary stream\n");
     list_for_each_entry(cp, &flat->FLCTRL.storage_head, head) {
-        FLATTEN_LOG_DEBUG("(%zu)(%zu)[%zu]{%lx}[...]\n", cp->index, cp->alignment, cp->size, (unsigned long)cp);
+        FLATTEN_LOG_DEBUG("(%zu)(%u)[%zu]{%lx}[...]\n", cp->index, cp->alignment, cp->size, (unsigned long)cp);
         total_size += cp->size;
     }
 
     FLATTEN_LOG_DEBUG("Total size: %zu\n\n", total_size);
 }
 
-static size_t binary_stream_write(struct flat* flat, size_t* wcounter_p) {
-    int err;
-    struct blstream* cp = NULL;
-    list_for_each_entry(cp, &flat->FLCTRL.storage_head, head) {
-        if((err = binary_stream_element_write(flat, cp, wcounter_p)) != 0) {
-            return err;
-        }
-    }
-    return 0;
+/* Requires binary_stream_calculate_index to be invoked first */
+static size_t binary_stream_size(struct flat* flat) {
+    struct blstream* last;
+
+    if(flat->FLCTRL.storage_count == 0)
+        return 0;
+    last = flat->FLCTRL.storage_elements[flat->FLCTRL.storage_count - 1];
+    return last->index + last->size;
 }
 
-static size_t binary_stream_size(struct flat* flat) {
-    struct blstream* cp = NULL;
-    size_t total_size = 0;
-    list_for_each_entry(cp, &flat->FLCTRL.storage_head, head) {
-        total_size += cp->size;
-    }
-    return total_size;
+/*******************************************************
+ * MEMORY AREA WRITE
+ *  Blobs are copied straight to their final offsets in
+ *  the image and pointers are relocated in place
+ ******************************************************/
+static inline const unsigned char* binary_stream_element_memory(struct blstream* p) {
+    /* With flat->FLCTRL.mem_copy_skip set memory is copied directly from source */
+    return (const unsigned char*)(p->data ? p->data : p->source);
 }
 
-static void binary_stream_update_pointers(struct flat* flat) {
-    int count = 0;
-    size_t size_to_cpy, __ptr_offset;
-    struct blstream* __storage;
-    struct rb_node* p = rb_first(&flat->FLCTRL.fixup_set_root.rb_root);
+static void binary_stream_copy_area(struct flat* flat, unsigned char* memory_area) {
+    struct blstream** elements = flat->FLCTRL.storage_elements;
+    size_t count = flat->FLCTRL.storage_count;
+    size_t i, j;
 
-    FLATTEN_LOG_DEBUG("# Pointer update\n");
-    while(p) {
-        struct fixup_set_node* node = (struct fixup_set_node*)p;
-        if(node->ptr && (!IS_FIXUP_FPTR(node))) {
-            void* newptr = (unsigned char*)node->ptr->node->storage->index + node->ptr->offset + flat->FLCTRL.HDR.last_mem_addr;
-            DBGS("@ ptr update at ((%lx)%lx:%zu) : %lx => %lx\n", (unsigned long)node->inode, (unsigned long)node->inode->start, node->offset,
-                 (unsigned long)newptr, (unsigned long)(((unsigned char*)node->inode->storage->data) + node->offset));
-            size_to_cpy = sizeof(void*);
-            __storage = node->inode->storage;
-            __ptr_offset = node->offset;
-            while(size_to_cpy > 0) {
-                size_t cpy_size = (size_to_cpy > (__storage->size - __ptr_offset)) ? (__storage->size - __ptr_offset) : (size_to_cpy);
-                memcpy(&((unsigned char*)__storage->data)[__ptr_offset], (unsigned char*)&newptr + (sizeof(void*) - size_to_cpy), cpy_size);
-                size_to_cpy -= cpy_size;
-                if(size_to_cpy > 0) {
-                    __storage = list_next_entry(__storage, head);
-                    __ptr_offset = 0;
-                }
-            }
-            count++;
+    for(i = 0; i < count; i = j) {
+        struct blstream* p = elements[i];
+        const unsigned char* src = binary_stream_element_memory(p);
+        size_t end = p->index + p->size;
+        size_t gap = (i > 0) ? elements[i - 1]->index + elements[i - 1]->size : 0;
+
+        /* Alignment padding preceding the element */
+        memset(memory_area + gap, 0, p->index - gap);
+
+        /* Elements adjacent both in memory and in the image are copied at once */
+        for(j = i + 1; j < count; ++j) {
+            struct blstream* n = elements[j];
+            if(n->index != end || binary_stream_element_memory(n) != src + (end - p->index))
+                break;
+            end += n->size;
         }
-        p = rb_next(p);
+        memcpy(memory_area + p->index, src, end - p->index);
     }
-    FLATTEN_LOG_DEBUG("Updated %d pointers\n\n", count);
 }
 
-static void binary_stream_update_pointers_inarea(struct flat* flat, void* memory_area) {
-    int count = 0;
-    size_t __ptr_offset;
-    struct blstream* __storage;
-    struct rb_node* p = rb_first(&flat->FLCTRL.fixup_set_root.rb_root);
+static void binary_stream_relocate_area(struct flat* flat, unsigned char* memory_area) {
+    size_t i;
 
-    FLATTEN_LOG_DEBUG("# Pointer update (in area)\n");
-    while(p) {
-        struct fixup_set_node* node = (struct fixup_set_node*)p;
-        if(node->ptr && (!IS_FIXUP_FPTR(node))) {
-            void* newptr = (unsigned char*)node->ptr->node->storage->index + node->ptr->offset + flat->FLCTRL.HDR.last_mem_addr;
-            DBGS("@ ptr update at ((%lx)%lx:%zu) : %lx => (A) %lx\n", (unsigned long)node->inode, (unsigned long)node->inode->start, node->offset,
-                 (unsigned long)newptr, (unsigned long)(((unsigned char*)node->inode->storage->index) + node->offset));
-            __storage = node->inode->storage;
-            __ptr_offset = node->offset;
-            memcpy((unsigned char*)memory_area + __storage->index + __ptr_offset, (unsigned char*)&newptr, sizeof(void*));
-            count++;
+    for(i = 0; i < flat->FLCTRL.fixup_set.count; ++i) {
+        struct fixup_set_node* node = flat->FLCTRL.fixup_set.sorted[i].node;
+        if(node->target != NULL) {
+            void* newptr = (unsigned char*)node->target->storage->index + node->target_offset + flat->FLCTRL.HDR.last_mem_addr;
+            memcpy(memory_area + node->inode->storage->index + FIXUP_ENTRY_OFFSET(&flat->FLCTRL.fixup_set.sorted[i]),
+                   (unsigned char*)&newptr, sizeof(void*));
         }
-        p = rb_next(p);
     }
-    FLATTEN_LOG_DEBUG("Updated %d pointers\n\n", count);
+}
+
+static int binary_stream_write(struct flat* flat, size_t* wcounter_p) {
+    size_t memory_size = flat->FLCTRL.HDR.memory_size;
+
+    if(flat->area == NULL) {
+        *wcounter_p += memory_size;
+        return 0;
+    }
+    if(*wcounter_p + memory_size > flat->size) {
+        flat->error = ENOMEM;
+        return -1;
+    }
+
+    FLATTEN_LOG_DEBUG("# Memory write\n");
+    binary_stream_copy_area(flat, (unsigned char*)flat->area + *wcounter_p);
+    binary_stream_relocate_area(flat, (unsigned char*)flat->area + *wcounter_p);
+
+    *wcounter_p += memory_size;
+    return 0;
 }
 
 /*******************************************************
  * B-QUEUE
- *  List based implementation of two-way queue
+ *  Ring buffer based implementation of FIFO queue
  ******************************************************/
-int bqueue_init(struct flat* flat, struct bqueue* q, size_t block_size) {
-    struct queue_block* new_block = NULL;
-
+int bqueue_init(struct flat* flat, struct bqueue* q, size_t size) {
     memset(q, 0, sizeof(struct bqueue));
 
-    new_block = (struct queue_block*)flat_zalloc(flat, block_size + sizeof(struct queue_block), 1);
-    if(!new_block)
+    q->data = (unsigned char*)flat_zalloc(flat, size, 1);
+    if(!q->data)
         return ENOMEM;
-
-    q->block_size = block_size;
-    INIT_LIST_HEAD(&q->head);
-    list_add(&new_block->head, &q->head);
+    q->data_size = size;
     return 0;
 }
 
 void bqueue_destroy(struct bqueue* q) {
-    struct queue_block* cur = NULL;
-    struct queue_block* tmp = NULL;
-    list_for_each_entry_safe(cur, tmp, &q->head, head) {
-        list_del(&cur->head);
-        flat_free(cur);
-    }
+    flat_free(q->data);
+    memset(q, 0, sizeof(struct bqueue));
 }
 
 void bqueue_clear(struct bqueue* q) {
-    size_t i = 0;
-    struct queue_block *cur = NULL, *tmp = NULL;
-    list_for_each_entry_safe(cur, tmp, &q->head, head) {
-        // Skip first element of the list
-        if(i++ == 0)
-            continue;
-        list_del(&cur->head);
-        flat_free(cur);
-    }
-
+    q->front = 0;
     q->size = 0;
-    q->front_index = 0;
-    q->back_index = 0;
     q->el_count = 0;
 }
 EXPORT_FUNC(bqueue_clear);
 
-static int bqueue_empty(struct bqueue* q) { return q->size == 0; }
+static int bqueue_empty(struct bqueue* q) { return q->el_count == 0; }
 
 static size_t bqueue_size(struct bqueue* q) { return q->size; }
 
 static unsigned long bqueue_el_count(struct bqueue* q) { return q->el_count; }
 
-int bqueue_push_back(struct flat* flat, struct bqueue* q, const void* m, size_t s) {
-    size_t copied = 0;
-    struct queue_block* front = NULL;
-    struct queue_block* new_block = NULL;
+static inline unsigned char* bqueue_slot(struct bqueue* q, size_t index) {
+    index += q->front;
+    if(index >= q->capacity)
+        index -= q->capacity;
+    return q->data + index * q->el_size;
+}
 
-    if(list_empty(&q->head)) {
-        new_block = (struct queue_block*)flat_zalloc(flat, q->block_size + sizeof(struct queue_block), 1);
-        if(!new_block)
-            return ENOMEM;
+/* Copy count elements from the front of the queue without removing them */
+static void bqueue_copy_front(struct bqueue* q, void* m, size_t count) {
+    size_t first = q->capacity - q->front;
 
-        list_add(&new_block->head, &q->head);
-    }
+    if(first > count)
+        first = count;
+    memcpy(m, q->data + q->front * q->el_size, first * q->el_size);
+    memcpy((unsigned char*)m + first * q->el_size, q->data, (count - first) * q->el_size);
+}
 
-    while(s > 0) {
-        size_t avail_size = q->block_size - q->front_index;
-        size_t copy_size = (s > avail_size) ? (avail_size) : (s);
-        front = list_first_entry(&q->head, struct queue_block, head);
-        memcpy(front->data + q->front_index, (char*)m + copied, copy_size);
-        copied += copy_size;
-        if(unlikely(s >= avail_size)) {
-            s = s - avail_size;
-            new_block = (struct queue_block*)flat_zalloc(flat, q->block_size + sizeof(struct queue_block), 1);
-            if(!new_block)
-                return ENOMEM;
+static int bqueue_grow(struct flat* flat, struct bqueue* q) {
+    size_t capacity = q->capacity ? q->capacity * 2 : 1;
+    unsigned char* data;
 
-            list_add(&new_block->head, &q->head);
-        } else
-            s = 0;
-        q->front_index = (q->front_index + copy_size) % q->block_size;
+    data = (unsigned char*)flat_zalloc(flat, q->el_size, capacity);
+    if(!data)
+        return ENOMEM;
+
+    bqueue_copy_front(q, data, q->el_count);
+    flat_free(q->data);
+    q->data = data;
+    q->data_size = q->el_size * capacity;
+    q->capacity = capacity;
+    q->front = 0;
+    return 0;
+}
+
+int bqueue_push_back(struct flat* flat, struct bqueue* q, const void* m, size_t s) {
+    if(s == 0)
+        return EINVAL;
+
+    if(q->el_count == 0 && q->el_size != s) {
+        q->el_size = s;
+        q->capacity = q->data_size / s;
+        q->front = 0;
+    } else if(q->el_size != s) {
+        flat_errs("bqueue element size mismatch (%zu != %zu)", s, q->el_size);
+        return EINVAL;
     }
-    q->size += copied;
+
+    if(q->el_count == q->capacity) {
+        int err = bqueue_grow(flat, q);
+        if(err)
+            return err;
+    }
+
+    memcpy(bqueue_slot(q, q->el_count), m, s);
+    q->size += s;
     q->el_count++;
     return 0;
 }
 EXPORT_FUNC(bqueue_push_back);
 
 int bqueue_pop_front(struct bqueue* q, void* m, size_t s) {
-    size_t copied = 0;
-    struct queue_block* back = NULL;
+    if(q->el_count && s != q->el_size)
+        return EINVAL;
 
     if(q->size < s) {
         flat_errs("bqueue underflow");
         return EFAULT;
     }
 
-    if(list_empty(&q->head))
+    if(q->el_count == 0)
         return ENOENT;
 
-    while(s > 0) {
-        size_t avail_size = q->block_size - q->back_index;
-        size_t copy_size = (s > avail_size) ? (avail_size) : (s);
-        back = list_last_entry(&q->head, struct queue_block, head);
-        memcpy((char*)m + copied, back->data + q->back_index, copy_size);
-        copied += copy_size;
-        if(s >= avail_size) {
-            s = s - avail_size;
-            list_del(&back->head);
-            flat_free(back);
-        } else
-            s = 0;
-        q->back_index = (q->back_index + copy_size) % q->block_size;
-    }
-    q->size -= copied;
-    q->el_count--;
+    return bqueue_pop_front_batch(q, m, 1) == 1 ? 0 : ENOENT;
+}
 
-    return 0;
+/* Pop up to max_count elements into array m, returns the number of elements popped */
+size_t bqueue_pop_front_batch(struct bqueue* q, void* m, size_t max_count) {
+    size_t count = q->el_count < max_count ? q->el_count : max_count;
+
+    if(count == 0)
+        return 0;
+
+    bqueue_copy_front(q, m, count);
+    q->front += count;
+    if(q->front >= q->capacity)
+        q->front -= q->capacity;
+    q->size -= count * q->el_size;
+    q->el_count -= count;
+    return count;
 }
 
 /*******************************************************
- * FIXUP set
+ * VISITED set
+ *  Addresses of objects already queued for flattening
  ******************************************************/
-#define ADDR_KEY(p) ((((p)->inode) ? ((p)->inode->start) : 0) + (p)->offset)
+#define VISITED_SET_MIN_CAPACITY 4096
+#define VISITED_SET_SLOTS_PER_BLOOM_WORD 16
 
-static struct fixup_set_node* create_fixup_set_node_element(struct flat* flat, struct flat_node* node, size_t offset, struct flatten_pointer* ptr, enum fixup_encoding flags) {
-    struct fixup_set_node* n = (struct fixup_set_node*)flat_zalloc(flat, sizeof(struct fixup_set_node), 1);
-    if(n == 0)
-        return 0;
-    n->inode = node;
-    n->offset = offset;
-    n->ptr = ptr;
-    n->flags = flags;
-    return n;
+INTERVAL_TREE_DEFINE(struct visited_set_range, rb,
+                     uintptr_t, __subtree_last,
+                     START, LAST, static __attribute__((used)), visited_set_range_tree);
+
+static inline uint64_t visited_set_hash(uintptr_t key) {
+    uint64_t h = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
 }
 
-struct fixup_set_node* fixup_set_search(struct flat* flat, uintptr_t v) {
-    struct rb_node* node = flat->FLCTRL.fixup_set_root.rb_root.rb_node;
+/* Slot index is taken from the low bits of the hash, the filter uses the high ones */
+static inline uint64_t* visited_set_bloom_word(struct visited_set* vs, uint64_t h) {
+    return &vs->bloom[(h >> 40) & (vs->bloom_words - 1)];
+}
 
-    while(node) {
-        struct fixup_set_node* data = container_of(node, struct fixup_set_node, node);
+static inline uint64_t visited_set_bloom_mask(uint64_t h) {
+    return (1ULL << ((h >> 28) & 63)) | (1ULL << ((h >> 34) & 63));
+}
 
-        if(v < ADDR_KEY(data)) {
-            node = node->rb_left;
-        } else if(v > ADDR_KEY(data)) {
-            node = node->rb_right;
-        } else {
-            DBGS(" fixup_set_search(%lx): (%lx:%zu,%lx)\n", v, (unsigned long)data->inode, data->offset, (unsigned long)data->ptr);
-            return data;
+static int visited_set_grow(struct flat* flat) {
+    size_t i, j, new_capacity, bloom_words;
+    uintptr_t* keys;
+    uint64_t* bloom;
+    struct visited_set* vs = &flat->FLCTRL.visited_set;
+
+    new_capacity = vs->capacity ? vs->capacity * 2 : VISITED_SET_MIN_CAPACITY;
+    bloom_words = new_capacity / VISITED_SET_SLOTS_PER_BLOOM_WORD;
+    keys = (uintptr_t*)flat_zalloc(flat, sizeof(uintptr_t), new_capacity);
+    bloom = (uint64_t*)flat_zalloc(flat, sizeof(uint64_t), bloom_words);
+    if(keys == NULL || bloom == NULL) {
+        flat_free(keys);
+        flat_free(bloom);
+        return ENOMEM;
+    }
+
+    for(i = 0; i < vs->capacity; ++i) {
+        uint64_t h;
+        if(vs->keys[i] == 0)
+            continue;
+        h = visited_set_hash(vs->keys[i]);
+        j = h & (new_capacity - 1);
+        while(keys[j] != 0)
+            j = (j + 1) & (new_capacity - 1);
+        keys[j] = vs->keys[i];
+        bloom[(h >> 40) & (bloom_words - 1)] |= visited_set_bloom_mask(h);
+    }
+
+    flat_free(vs->keys);
+    flat_free(vs->bloom);
+    vs->keys = keys;
+    vs->bloom = bloom;
+    vs->capacity = new_capacity;
+    vs->bloom_words = bloom_words;
+    return 0;
+}
+
+/* Check whether v is an element of one of the visited arrays */
+static bool visited_set_range_search(struct visited_set* vs, uintptr_t v) {
+    struct visited_set_range* r = vs->last_range;
+
+    if(r == NULL)
+        return false;
+
+    if(r->start <= v && v <= r->last && (v - r->start) % r->stride == 0)
+        return true;
+
+    for(r = visited_set_range_tree_iter_first(&vs->ranges, v, v); r != NULL; r = visited_set_range_tree_iter_next(r, v, v)) {
+        if((v - r->start) % r->stride == 0) {
+            vs->last_range = r;
+            return true;
         }
     }
+    return false;
+}
+
+bool visited_set_search(struct flat* flat, uintptr_t addr) {
+    struct visited_set* vs = &flat->FLCTRL.visited_set;
+
+    if(addr == 0)
+        return false;
+
+    if(vs->capacity != 0) {
+        uint64_t h = visited_set_hash(addr);
+        uint64_t mask = visited_set_bloom_mask(h);
+
+        if((*visited_set_bloom_word(vs, h) & mask) == mask) {
+            size_t i = h & (vs->capacity - 1);
+            while(vs->keys[i] != 0) {
+                if(vs->keys[i] == addr)
+                    return true;
+                i = (i + 1) & (vs->capacity - 1);
+            }
+        }
+    }
+
+    return visited_set_range_search(vs, addr);
+}
+EXPORT_FUNC(visited_set_search);
+
+int visited_set_insert(struct flat* flat, uintptr_t addr) {
+    uint64_t h;
+    size_t i;
+    struct visited_set* vs = &flat->FLCTRL.visited_set;
+
+    if(addr == 0)
+        return EINVAL;
+
+    if(unlikely(4 * (vs->count + 1) > 3 * vs->capacity))
+        if(visited_set_grow(flat))
+            return ENOMEM;
+
+    h = visited_set_hash(addr);
+    for(i = h & (vs->capacity - 1); vs->keys[i] != 0; i = (i + 1) & (vs->capacity - 1))
+        if(vs->keys[i] == addr)
+            return EEXIST;
 
+    vs->keys[i] = addr;
+    vs->count++;
+    *visited_set_bloom_word(vs, h) |= visited_set_bloom_mask(h);
     return 0;
 }
-EXPORT_FUNC(fixup_set_search);
+EXPORT_FUNC(visited_set_insert);
 
-int fixup_set_reserve_address(struct flat* flat, uintptr_t addr) {
+/*
+ * Mark count elements of el_size bytes starting at base as visited. An
+ *  array is stored as a single range, so that its elements don't occupy
+ *  the hash table.
+ */
+static int visited_set_insert_range(struct flat* flat, uintptr_t base, size_t el_size, size_t count) {
+    struct visited_set_range* r;
+    struct visited_set* vs = &flat->FLCTRL.visited_set;
 
-    struct fixup_set_node* data;
-    struct rb_node **new_node, *parent;
-    struct fixup_set_node* inode;
+    if(count == 1 || el_size == 0)
+        return visited_set_insert(flat, base);
 
-    inode = fixup_set_search(flat, addr);
+    r = (struct visited_set_range*)flat_zalloc(flat, sizeof(struct visited_set_range), 1);
+    if(r == NULL)
+        return ENOMEM;
+    r->start = base;
+    r->last = base + (count - 1) * el_size;
+    r->stride = el_size;
+    visited_set_range_tree_insert(r, &vs->ranges);
+    vs->last_range = r;
+    return 0;
+}
 
-    if(inode) {
-        return EEXIST;
+static void visited_set_destroy(struct flat* flat) {
+    struct visited_set_range *r, *tmp;
+    struct visited_set* vs = &flat->FLCTRL.visited_set;
+
+    rbtree_postorder_for_each_entry_safe(r, tmp, &vs->ranges.rb_root, rb) {
+        flat_free(r);
     }
+    flat_free(vs->keys);
+    flat_free(vs->bloom);
+    memset(vs, 0, sizeof(struct visited_set));
+}
+
+/*******************************************************
+ * FIXUP set
+ ******************************************************/
+#define FIXUP_SET_MIN_CAPACITY 4096
+#define FIXUP_SET_BLOCK_SHIFT  10
+#define FIXUP_SET_BLOCK_SIZE   (1UL << FIXUP_SET_BLOCK_SHIFT)
+
+static inline size_t fixup_set_hash(uintptr_t key, size_t capacity) {
+    uint64_t h = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 32;
+    return (size_t)h & (capacity - 1);
+}
+
+static inline struct fixup_set_node* fixup_set_record(struct fixup_set* fs, uint32_t ref) {
+    size_t i = ref - 1;
+    if(ref == 0)
+        return &fs->reserved;
+    return &fs->blocks[i >> FIXUP_SET_BLOCK_SHIFT][i & (FIXUP_SET_BLOCK_SIZE - 1)];
+}
+
+/* Address the original pointer stored in a filled entry refers to */
+static inline uintptr_t fixup_set_target_address(const struct fixup_set_node* n) {
+    if(IS_FIXUP_FPTR(n))
+        return n->target_offset;
+    return n->target->start + n->target_offset;
+}
 
-    new_node = &(flat->FLCTRL.fixup_set_root.rb_root.rb_node);
-    parent = 0;
+/*
+ * Target of the pointer is copied into the fixup record, so the flatten_pointer
+ *  passed by the caller can be reused by the next make_flatten_pointer call
+ */
+static void flatten_pointer_release(struct flat* flat, struct flatten_pointer* ptr) {
+    if(ptr == NULL)
+        return;
+    ptr->node = (struct flat_node*)flat->FLCTRL.fptr_spare;
+    flat->FLCTRL.fptr_spare = ptr;
+}
 
-    data = create_fixup_set_node_element(flat, 0, addr, 0, FIXUP_DATA_POINTER);
-    if(!data) {
+static int fixup_set_grow(struct flat* flat) {
+    size_t i, j, new_capacity;
+    uintptr_t* keys;
+    uint32_t* refs;
+    struct fixup_set* fs = &flat->FLCTRL.fixup_set;
+
+    new_capacity = fs->capacity ? fs->capacity * 2 : FIXUP_SET_MIN_CAPACITY;
+    keys = (uintptr_t*)flat_zalloc(flat, sizeof(uintptr_t), new_capacity);
+    refs = (uint32_t*)flat_zalloc(flat, sizeof(uint32_t), new_capacity);
+    if(keys == NULL || refs == NULL) {
+        flat_free(keys);
+        flat_free(refs);
         return ENOMEM;
     }
 
-    /* Figure out where to put new node */
-    while(*new_node) {
-        struct fixup_set_node* this_node = container_of(*new_node, struct fixup_set_node, node);
+    for(i = 0; i < fs->capacity; ++i) {
+        if(fs->keys[i] == 0)
+            continue;
+        j = fixup_set_hash(fs->keys[i], new_capacity);
+        while(keys[j] != 0)
+            j = (j + 1) & (new_capacity - 1);
+        keys[j] = fs->keys[i];
+        refs[j] = fs->refs[i];
+    }
+
+    flat_free(fs->keys);
+    flat_free(fs->refs);
+    fs->keys = keys;
+    fs->refs = refs;
+    fs->capacity = new_capacity;
+    return 0;
+}
 
-        parent = *new_node;
-        if(data->offset < ADDR_KEY(this_node))
-            new_node = &((*new_node)->rb_left);
-        else if(data->offset > ADDR_KEY(this_node))
-            new_node = &((*new_node)->rb_right);
-        else
-            return EEXIST;
+static int fixup_set_add_block(struct flat* flat) {
+    struct fixup_set_node* block;
+    struct fixup_set* fs = &flat->FLCTRL.fixup_set;
+
+    /* Block directory is doubled whenever block_count reaches a power of 2 */
+    if((fs->block_count & (fs->block_count - 1)) == 0) {
+        struct fixup_set_node** blocks = (struct fixup_set_node**)flat_zalloc(flat, sizeof(struct fixup_set_node*),
+                                                                                fs->block_count ? fs->block_count * 2 : 1);
+        if(blocks == NULL)
+            return ENOMEM;
+        if(fs->block_count)
+            memcpy(blocks, fs->blocks, fs->block_count * sizeof(struct fixup_set_node*));
+        flat_free(fs->blocks);
+        fs->blocks = blocks;
     }
 
-    /* Add new node and rebalance tree. */
-    rb_link_node(&data->node, parent, new_node);
-    rb_insert_color(&data->node, &flat->FLCTRL.fixup_set_root.rb_root);
+    block = (struct fixup_set_node*)flat_zalloc(flat, sizeof(struct fixup_set_node), FIXUP_SET_BLOCK_SIZE);
+    if(block == NULL)
+        return ENOMEM;
+    fs->blocks[fs->block_count++] = block;
+    return 0;
+}
+
+/* Find the slot holding the given key or the empty slot where it should be stored */
+static inline bool fixup_set_probe(struct fixup_set* fs, uintptr_t key, size_t* slot) {
+    size_t i = fixup_set_hash(key, fs->capacity);
+
+    while(fs->keys[i] != 0 && fs->keys[i] != key)
+        i = (i + 1) & (fs->capacity - 1);
+    *slot = i;
+    return fs->keys[i] != 0;
+}
+
+/*
+ * Same as above, but the table is grown beforehand if needed, so the
+ *  returned slot can be filled right away. Key 0 marks empty slots and
+ *  is never stored.
+ */
+static int fixup_set_slot(struct flat* flat, uintptr_t key, size_t* slot) {
+    struct fixup_set* fs = &flat->FLCTRL.fixup_set;
+
+    if(key == 0)
+        return EINVAL;
 
+    if(unlikely(4 * (fs->count + 1) > 3 * fs->capacity))
+        if(fixup_set_grow(flat))
+            return ENOMEM;
+
+    fixup_set_probe(fs, key, slot);
     return 0;
 }
+
+static inline void fixup_set_add_key(struct fixup_set* fs, size_t slot, uintptr_t key) {
+    fs->keys[slot] = key;
+    fs->refs[slot] = 0;
+    fs->count++;
+}
+
+/* Record of the key stored in the given slot or NULL if the slot is empty */
+static inline struct fixup_set_node* fixup_set_slot_lookup(struct fixup_set* fs, size_t slot) {
+    return fs->keys[slot] ? fixup_set_record(fs, fs->refs[slot]) : 0;
+}
+
+/* Get the record of a stored key, allocating one if the key was only reserved so far */
+static struct fixup_set_node* fixup_set_slot_record(struct flat* flat, size_t slot) {
+    struct fixup_set_node* n;
+    struct fixup_set* fs = &flat->FLCTRL.fixup_set;
+
+    if(fs->refs[slot])
+        return fixup_set_record(fs, fs->refs[slot]);
+
+    if(unlikely(fs->record_count >= UINT32_MAX))
+        return 0;
+    if((fs->record_count >> FIXUP_SET_BLOCK_SHIFT) >= fs->block_count && fixup_set_add_block(flat))
+        return 0;
+
+    n = &fs->blocks[fs->record_count >> FIXUP_SET_BLOCK_SHIFT][fs->record_count & (FIXUP_SET_BLOCK_SIZE - 1)];
+    fs->refs[slot] = (uint32_t)++fs->record_count;
+    return n;
+}
+
+static inline void fixup_set_fill(struct fixup_set_node* inode, struct flat_node* node, struct flat_node* target, uintptr_t target_offset) {
+    inode->inode = node;
+    inode->target = target;
+    inode->target_offset = target_offset;
+}
+
+struct fixup_set_node* fixup_set_search(struct flat* flat, uintptr_t v) {
+    size_t i;
+    struct fixup_set* fs = &flat->FLCTRL.fixup_set;
+
+    if(v == 0)
+        return 0;
+
+    if(fs->capacity != 0 && fixup_set_probe(fs, v, &i)) {
+        struct fixup_set_node* data = fixup_set_record(fs, fs->refs[i]);
+        DBGS(" fixup_set_search(%lx): (%lx,%lx:%lx)\n", v, (unsigned long)data->inode, (unsigned long)data->target, (unsigned long)data->target_offset);
+        return data;
+    }
+
+    return 0;
+}
+EXPORT_FUNC(fixup_set_search);
+
+/* Kept for recipes marking addresses as visited on their own */
+int fixup_set_reserve_address(struct flat* flat, uintptr_t addr) {
+    return visited_set_insert(flat, addr);
+}
 EXPORT_FUNC(fixup_set_reserve_address);
 
 int fixup_set_reserve(struct flat* flat, struct flat_node* node, size_t offset) {
 
     struct fixup_set_node* inode;
-    struct fixup_set_node* data;
-    struct rb_node **new_node, *parent;
+    size_t slot;
+    int err;
 
     DBGS(" fixup_set_reserve(%lx,%zu)\n", (uintptr_t)node, offset);
 
@@ -463,36 +930,21 @@ int fixup_set_reserve(struct flat* flat, struct flat_node* node, size_t offset)
         return EINVAL;
     }
 
-    inode = fixup_set_search(flat, node->start + offset);
+    err = fixup_set_slot(flat, node->start + offset, &slot);
+    if(err) {
+        return err;
+    }
 
-    if(inode) {
+    if(flat->FLCTRL.fixup_set.keys[slot]) {
         return EEXIST;
     }
 
-    data = create_fixup_set_node_element(flat, node, offset, 0, FIXUP_DATA_POINTER);
-    if(!data) {
+    fixup_set_add_key(&flat->FLCTRL.fixup_set, slot, node->start + offset);
+    inode = fixup_set_slot_record(flat, slot);
+    if(!inode) {
         return ENOMEM;
     }
-
-    new_node = &(flat->FLCTRL.fixup_set_root.rb_root.rb_node);
-    parent = 0;
-
-    /* Figure out where to put new node */
-    while(*new_node) {
-        struct fixup_set_node* this_node = container_of(*new_node, struct fixup_set_node, node);
-
-        parent = *new_node;
-        if(ADDR_KEY(data) < ADDR_KEY(this_node))
-            new_node = &((*new_node)->rb_left);
-        else if(ADDR_KEY(data) > ADDR_KEY(this_node))
-            new_node = &((*new_node)->rb_right);
-        else
-            return EEXIST;
-    }
-
-    /* Add new node and rebalance tree. */
-    rb_link_node(&data->node, parent, new_node);
-    rb_insert_color(&data->node, &flat->FLCTRL.fixup_set_root.rb_root);
+    inode->inode = node;
 
     return 0;
 }
@@ -500,33 +952,38 @@ int fixup_set_reserve(struct flat* flat, struct flat_node* node, size_t offset)
 int fixup_set_update(struct flat* flat, struct flat_node* node, size_t offset, struct flatten_pointer* ptr, enum fixup_encoding flags) {
 
     struct fixup_set_node* inode;
+    struct fixup_set* fs = &flat->FLCTRL.fixup_set;
+    size_t slot;
 
     DBGS(" fixup_set_update(%lx[%lx:%zu],%zu,%lx)\n", (uintptr_t)node,
          (node) ? (node->start) : 0, (node) ? (node->last - node->start + 1) : 0,
          offset, (uintptr_t)ptr);
 
-    if(node == 0) {
-        flat_free(ptr);
+    if(node == 0 || (!(flags & FIXUP_FUNC_POINTER) && (ptr == 0 || ptr->node == 0))) {
+        if(!(flags & FIXUP_FUNC_POINTER))
+            flatten_pointer_release(flat, ptr);
         return EINVAL;
     }
 
-    inode = fixup_set_search(flat, node->start + offset);
-
-    if(!inode) {
+    if(fs->capacity == 0 || !fixup_set_probe(fs, node->start + offset, &slot)) {
+        if(!(flags & FIXUP_FUNC_POINTER))
+            flatten_pointer_release(flat, ptr);
         return ENOKEY;
     }
 
-    if(!inode->inode) {
-        if((node->start + offset) != inode->offset) {
-            flat_errs("node address not matching reserved offset");
-            return EFAULT;
-        }
-        rb_erase(&inode->node, &flat->FLCTRL.fixup_set_root.rb_root);
-        return fixup_set_insert(flat, node, offset, ptr, flags);
+    inode = fixup_set_slot_record(flat, slot);
+    if(!inode) {
+        if(!(flags & FIXUP_FUNC_POINTER))
+            flatten_pointer_release(flat, ptr);
+        return ENOMEM;
     }
 
-    inode->ptr = ptr;
-    inode->flags = flags;
+    if(flags & FIXUP_FUNC_POINTER) {
+        fixup_set_fill(inode, node, 0, (uintptr_t)ptr);
+    } else {
+        fixup_set_fill(inode, node, ptr->node, ptr->offset);
+        flatten_pointer_release(flat, ptr);
+    }
 
     return 0;
 }
@@ -534,75 +991,58 @@ int fixup_set_update(struct flat* flat, struct flat_node* node, size_t offset, s
 int fixup_set_insert(struct flat* flat, struct flat_node* node, size_t offset, struct flatten_pointer* ptr, enum fixup_encoding flags) {
 
     struct fixup_set_node* inode;
-    struct fixup_set_node* data;
-    struct rb_node **new_node, *parent;
+    size_t slot;
+    int err;
 
     DBGS(" fixup_set_insert(%lx[%lx:%zu],%zu,%lx)\n", (uintptr_t)node,
          (node) ? (node->start) : 0, (node) ? (node->last - node->start + 1) : 0,
          offset, (uintptr_t)ptr);
 
+    if(flags & FIXUP_FUNC_POINTER)
+        return fixup_set_insert_fptr(flat, node, offset, (unsigned long)ptr);
+
     if(!ptr) {
         DBGS("fixup_set_insert(...): ptr - EINVAL\n");
         return EINVAL;
     }
 
-    if(node == 0) {
-        flat_free(ptr);
+    if(node == 0 || ptr->node == 0) {
+        flatten_pointer_release(flat, ptr);
         DBGS("fixup_set_insert(...): node - EINVAL\n");
         return EINVAL;
     }
 
-    inode = fixup_set_search(flat, node->start + offset);
+    err = fixup_set_slot(flat, node->start + offset, &slot);
+    if(err) {
+        flatten_pointer_release(flat, ptr);
+        return err;
+    }
+    inode = fixup_set_slot_lookup(&flat->FLCTRL.fixup_set, slot);
 
-    if(inode && inode->inode) {
-        uintptr_t inode_ptr;
-        if(IS_FIXUP_FPTR(inode))
-            inode_ptr = (uintptr_t)inode->ptr;
-        else
-            inode_ptr = inode->ptr->node->start + inode->ptr->offset;
+    if(inode && inode->inode && IS_FIXUP_SET(inode)) {
+        uintptr_t inode_ptr = fixup_set_target_address(inode);
 
         if(inode_ptr != ptr->node->start + ptr->offset) {
             flat_errs("fixup_set_insert(...): multiple pointer mismatch for the same storage [%ld]: (%lx vs %lx)\n",
-                      (unsigned long)inode->flags, inode_ptr, ptr->node->start + ptr->offset);
-            flat_free(ptr);
+                      (unsigned long)flags, inode_ptr, ptr->node->start + ptr->offset);
+            flatten_pointer_release(flat, ptr);
             DBGS("fixup_set_insert(...): EFAULT\n");
             return EFAULT;
         }
-        flat_free(ptr);
+        flatten_pointer_release(flat, ptr);
         DBGS("fixup_set_insert(...): node - EEXIST\n");
         return EEXIST;
     }
 
-    if(inode) {
-        return fixup_set_update(flat, node, offset, ptr, flags);
-    }
-
-    data = create_fixup_set_node_element(flat, node, offset, ptr, flags);
-    if(!data) {
-        flat_free(ptr);
-        return ENOMEM;
-    }
-    new_node = &(flat->FLCTRL.fixup_set_root.rb_root.rb_node);
-    parent = 0;
-
-    /* Figure out where to put new node */
-    while(*new_node) {
-        struct fixup_set_node* this_node = container_of(*new_node, struct fixup_set_node, node);
-
-        parent = *new_node;
-        if(ADDR_KEY(data) < ADDR_KEY(this_node))
-            new_node = &((*new_node)->rb_left);
-        else if(ADDR_KEY(data) > ADDR_KEY(this_node))
-            new_node = &((*new_node)->rb_right);
-        else {
-            DBGS("fixup_set_insert(...): EEXIST\n");
-            return EEXIST;
-        }
-    }
-
-    /* Add new node and rebalance tree. */
-    rb_link_node(&data->node, parent, new_node);
-    rb_insert_color(&data->node, &flat->FLCTRL.fixup_set_root.rb_root);
+    if(!inode)
+        fixup_set_add_key(&flat->FLCTRL.fixup_set, slot, node->start + offset);
+    inode = fixup_set_slot_record(flat, slot);
+    if(!inode) {
+        flatten_pointer_release(flat, ptr);
+        return ENOMEM;
+    }
+    fixup_set_fill(inode, node, ptr->node, ptr->offset);
+    flatten_pointer_release(flat, ptr);
 
     DBGS("fixup_set_insert(...): 0\n");
 
@@ -612,8 +1052,8 @@ int fixup_set_insert(struct flat* flat, struct flat_node* node, size_t offset, s
 int fixup_set_insert_force_update(struct flat* flat, struct flat_node* node, size_t offset, struct flatten_pointer* ptr) {
 
     struct fixup_set_node* inode;
-    struct fixup_set_node* data;
-    struct rb_node **new_node, *parent;
+    size_t slot;
+    int err;
 
     DBGS(" fixup_set_insert_force_update(%lx[%lx:%zu],%zu,%lx)\n", (uintptr_t)node,
          (node) ? (node->start) : 0, (node) ? (node->last - node->start + 1) : 0,
@@ -624,62 +1064,42 @@ int fixup_set_insert_force_update(struct flat* flat, struct flat_node* node, siz
         return EINVAL;
     }
 
-    if(node == 0) {
-        flat_free(ptr);
+    if(node == 0 || ptr->node == 0) {
+        flatten_pointer_release(flat, ptr);
         DBGS("fixup_set_insert_force_update(...): node - EINVAL\n");
         return EINVAL;
     }
 
-    inode = fixup_set_search(flat, node->start + offset);
+    err = fixup_set_slot(flat, node->start + offset, &slot);
+    if(err) {
+        flatten_pointer_release(flat, ptr);
+        return err;
+    }
+    inode = fixup_set_slot_lookup(&flat->FLCTRL.fixup_set, slot);
 
-    if(inode && inode->inode) {
-        uintptr_t inode_ptr;
-        if(IS_FIXUP_FPTR(inode))
-            inode_ptr = (unsigned long)inode->ptr;
-        else
-            inode_ptr = inode->ptr->node->start + inode->ptr->offset;
+    if(inode && inode->inode && IS_FIXUP_SET(inode)) {
+        uintptr_t inode_ptr = fixup_set_target_address(inode);
 
         if(inode_ptr != ptr->node->start + ptr->offset) {
             flat_errs("fixup_set_insert_force_update(...): multiple pointer mismatch for the same storage [%ld]: (%lx vs %lx)\n",
-                      (unsigned long)inode->flags, inode_ptr, ptr->node->start + ptr->offset);
-        } else {
-            flat_free(ptr);
-            DBGS("fixup_set_insert_force_update(...): node - EEXIST\n");
-            return EEXIST;
+                      (unsigned long)IS_FIXUP_FPTR(inode), inode_ptr, ptr->node->start + ptr->offset);
+            flatten_pointer_release(flat, ptr);
+            return EAGAIN;
         }
+        flatten_pointer_release(flat, ptr);
+        DBGS("fixup_set_insert_force_update(...): node - EEXIST\n");
+        return EEXIST;
     }
 
-    if(inode && !inode->inode) {
-        return fixup_set_update(flat, node, offset, ptr, FIXUP_DATA_POINTER);
-    }
-
-    data = create_fixup_set_node_element(flat, node, offset, ptr, FIXUP_DATA_POINTER);
-    if(!data) {
-        flat_free(ptr);
+    if(!inode)
+        fixup_set_add_key(&flat->FLCTRL.fixup_set, slot, node->start + offset);
+    inode = fixup_set_slot_record(flat, slot);
+    if(!inode) {
+        flatten_pointer_release(flat, ptr);
         return ENOMEM;
     }
-    new_node = &(flat->FLCTRL.fixup_set_root.rb_root.rb_node);
-    parent = 0;
-
-    /* Figure out where to put new node */
-    while(*new_node) {
-        struct fixup_set_node* this_node = container_of(*new_node, struct fixup_set_node, node);
-
-        parent = *new_node;
-        if(ADDR_KEY(data) < ADDR_KEY(this_node))
-            new_node = &((*new_node)->rb_left);
-        else if(ADDR_KEY(data) > ADDR_KEY(this_node))
-            new_node = &((*new_node)->rb_right);
-        else {
-            flat_free((void*)data->ptr);
-            data->ptr = ptr;
-            return EAGAIN;
-        }
-    }
-
-    /* Add new node and rebalance tree. */
-    rb_link_node(&data->node, parent, new_node);
-    rb_insert_color(&data->node, &flat->FLCTRL.fixup_set_root.rb_root);
+    fixup_set_fill(inode, node, ptr->node, ptr->offset);
+    flatten_pointer_release(flat, ptr);
 
     DBGS(" fixup_set_insert_force_update(...): 0\n");
 
@@ -690,8 +1110,8 @@ EXPORT_FUNC(fixup_set_insert_force_update);
 int fixup_set_insert_fptr(struct flat* flat, struct flat_node* node, size_t offset, unsigned long fptr) {
 
     struct fixup_set_node* inode;
-    struct fixup_set_node* data;
-    struct rb_node **new_node, *parent;
+    size_t slot;
+    int err;
 
     DBGS(" fixup_set_insert_fptr(%lx[%lx:%zu],%zu,%lx)\n", (uintptr_t)node,
          (node) ? (node->start) : 0, (node) ? (node->last - node->start + 1) : 0,
@@ -705,44 +1125,28 @@ int fixup_set_insert_fptr(struct flat* flat, struct flat_node* node, size_t offs
         return EINVAL;
     }
 
-    inode = fixup_set_search(flat, node->start + offset);
+    err = fixup_set_slot(flat, node->start + offset, &slot);
+    if(err) {
+        return err;
+    }
+    inode = fixup_set_slot_lookup(&flat->FLCTRL.fixup_set, slot);
 
-    if(inode && inode->inode) {
-        if((unsigned long)inode->ptr != fptr) {
+    if(inode && inode->inode && IS_FIXUP_SET(inode)) {
+        if(fixup_set_target_address(inode) != fptr) {
             flat_errs("fixup_set_insert_fptr(...): multiple pointer mismatch for the same storage: (%lx vs %lx)\n",
-                      (unsigned long)inode->ptr, fptr);
+                      (unsigned long)fixup_set_target_address(inode), fptr);
             return EFAULT;
         }
         return EEXIST;
     }
 
-    if(inode) {
-        return fixup_set_update(flat, node, offset, (struct flatten_pointer*)fptr, FIXUP_FUNC_POINTER);
-    }
-
-    data = create_fixup_set_node_element(flat, node, offset, (struct flatten_pointer*)fptr, FIXUP_FUNC_POINTER);
-    if(!data) {
+    if(!inode)
+        fixup_set_add_key(&flat->FLCTRL.fixup_set, slot, node->start + offset);
+    inode = fixup_set_slot_record(flat, slot);
+    if(!inode) {
         return ENOMEM;
     }
-    new_node = &(flat->FLCTRL.fixup_set_root.rb_root.rb_node);
-    parent = 0;
-
-    /* Figure out where to put new node */
-    while(*new_node) {
-        struct fixup_set_node* this_node = container_of(*new_node, struct fixup_set_node, node);
-
-        parent = *new_node;
-        if(ADDR_KEY(data) < ADDR_KEY(this_node))
-            new_node = &((*new_node)->rb_left);
-        else if(ADDR_KEY(data) > ADDR_KEY(this_node))
-            new_node = &((*new_node)->rb_right);
-        else
-            return EEXIST;
-    }
-
-    /* Add new node and rebalance tree. */
-    rb_link_node(&data->node, parent, new_node);
-    rb_insert_color(&data->node, &flat->FLCTRL.fixup_set_root.rb_root);
+    fixup_set_fill(inode, node, 0, fptr);
 
     return 0;
 }
@@ -750,8 +1154,8 @@ int fixup_set_insert_fptr(struct flat* flat, struct flat_node* node, size_t offs
 int fixup_set_insert_fptr_force_update(struct flat* flat, struct flat_node* node, size_t offset, unsigned long fptr) {
 
     struct fixup_set_node* inode;
-    struct fixup_set_node* data;
-    struct rb_node **new_node, *parent;
+    size_t slot;
+    int err;
 
     DBGS(" fixup_set_insert_fptr_force_update(%lx[%lx:%zu],%zu,%lx)\n", (uintptr_t)node,
          (node) ? (node->start) : 0, (node) ? (node->last - node->start + 1) : 0,
@@ -765,156 +1169,396 @@ int fixup_set_insert_fptr_force_update(struct flat* flat, struct flat_node* node
         return EINVAL;
     }
 
-    inode = fixup_set_search(flat, node->start + offset);
+    err = fixup_set_slot(flat, node->start + offset, &slot);
+    if(err) {
+        return err;
+    }
+    inode = fixup_set_slot_lookup(&flat->FLCTRL.fixup_set, slot);
 
-    if(inode && inode->inode) {
-        if((unsigned long)inode->ptr != fptr) {
+    if(inode && inode->inode && IS_FIXUP_SET(inode)) {
+        if(fixup_set_target_address(inode) != fptr) {
             flat_errs("fixup_set_insert_fptr_force_update(...): multiple pointer mismatch for the same storage: (%lx vs %lx)\n",
-                      (unsigned long)inode->ptr, fptr);
+                      (unsigned long)fixup_set_target_address(inode), fptr);
         }
         return EEXIST;
     }
 
-    if(inode && !inode->inode) {
-        return fixup_set_update(flat, node, offset, (struct flatten_pointer*)fptr, FIXUP_FUNC_POINTER);
+    if(!inode)
+        fixup_set_add_key(&flat->FLCTRL.fixup_set, slot, node->start + offset);
+    inode = fixup_set_slot_record(flat, slot);
+    if(!inode) {
+        return ENOMEM;
     }
+    fixup_set_fill(inode, node, 0, fptr);
+
+    return 0;
+}
+EXPORT_FUNC(fixup_set_insert_fptr_force_update);
 
-    data = create_fixup_set_node_element(flat, node, offset, (struct flatten_pointer*)fptr, FIXUP_FUNC_POINTER);
-    if(!data) {
+/*
+ * Build the array of fixup entries ordered by address (LSD radix sort on
+ *  key bytes). Digits shared by all keys (i.e. upper bytes of addresses)
+ *  are skipped. Must be invoked after the last insertion into fixup set.
+ */
+static int fixup_set_sort(struct flat* flat) {
+    size_t i, j, d, n;
+    size_t* hist;
+    struct fixup_set_entry *src, *dst, *tmp;
+    struct fixup_set* fs = &flat->FLCTRL.fixup_set;
+
+    n = fs->count;
+    if(n == 0)
+        return 0;
+
+    hist = (size_t*)flat_zalloc(flat, sizeof(size_t), sizeof(uintptr_t) * 256);
+    src = (struct fixup_set_entry*)flat_zalloc(flat, sizeof(struct fixup_set_entry), n);
+    dst = (struct fixup_set_entry*)flat_zalloc(flat, sizeof(struct fixup_set_entry), n);
+    if(hist == NULL || src == NULL || dst == NULL) {
+        flat_free(hist);
+        flat_free(src);
+        flat_free(dst);
         return ENOMEM;
     }
-    new_node = &(flat->FLCTRL.fixup_set_root.rb_root.rb_node);
-    parent = 0;
 
-    /* Figure out where to put new node */
-    while(*new_node) {
-        struct fixup_set_node* this_node = container_of(*new_node, struct fixup_set_node, node);
+    for(i = 0, j = 0; i < fs->capacity; ++i) {
+        if(fs->keys[i] == 0)
+            continue;
+        src[j].key = fs->keys[i];
+        src[j].node = fixup_set_record(fs, fs->refs[i]);
+        for(d = 0; d < sizeof(uintptr_t); ++d)
+            hist[d * 256 + ((src[j].key >> (8 * d)) & 0xff)]++;
+        j++;
+    }
 
-        parent = *new_node;
-        if(ADDR_KEY(data) < ADDR_KEY(this_node))
-            new_node = &((*new_node)->rb_left);
-        else if(ADDR_KEY(data) > ADDR_KEY(this_node))
-            new_node = &((*new_node)->rb_right);
-        else {
-            flat_free((void*)data->ptr);
-            data->ptr = (struct flatten_pointer*)fptr;
-            data->flags = FIXUP_FUNC_POINTER;
-            return EAGAIN;
+    for(d = 0; d < sizeof(uintptr_t); ++d) {
+        size_t sum = 0;
+        size_t* h = hist + d * 256;
+
+        if(h[(src[0].key >> (8 * d)) & 0xff] == n)
+            continue;
+
+        for(i = 0; i < 256; ++i) {
+            size_t c = h[i];
+            h[i] = sum;
+            sum += c;
         }
-    }
+        for(i = 0; i < n; ++i)
+            dst[h[(src[i].key >> (8 * d)) & 0xff]++] = src[i];
 
-    /* Add new node and rebalance tree. */
-    rb_link_node(&data->node, parent, new_node);
-    rb_insert_color(&data->node, &flat->FLCTRL.fixup_set_root.rb_root);
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
 
+    flat_free(hist);
+    flat_free(dst);
+    fs->sorted = src;
     return 0;
 }
-EXPORT_FUNC(fixup_set_insert_fptr_force_update);
 
 static void fixup_set_print(struct flat* flat) {
-    struct rb_node* p = rb_first(&flat->FLCTRL.fixup_set_root.rb_root);
+    size_t i;
     FLATTEN_LOG_DEBUG("# Fixup set\n");
     FLATTEN_LOG_DEBUG("[\n");
-    while(p) {
-        struct fixup_set_node* node = (struct fixup_set_node*)p;
-        if(node->ptr) {
+    for(i = 0; i < flat->FLCTRL.fixup_set.count; ++i) {
+        struct fixup_set_entry* entry = &flat->FLCTRL.fixup_set.sorted[i];
+        struct fixup_set_node* node = entry->node;
+        if(node->inode && IS_FIXUP_SET(node)) {
+            size_t offset = FIXUP_ENTRY_OFFSET(entry);
+            uintptr_t origptr = node->inode->storage->index + offset;
             if(IS_FIXUP_FPTR(node)) {
-                uintptr_t newptr = (unsigned long)node->ptr;
-                uintptr_t origptr = node->inode->storage->index + node->offset;
+                uintptr_t newptr = node->target_offset;
                 FLATTEN_LOG_DEBUG(" %zu: (%lx:%zu)->(F) | %zu -> %zu\n",
                                   node->inode->storage->index,
-                                  (unsigned long)node->inode, node->offset,
+                                  (unsigned long)node->inode, offset,
                                   origptr, newptr);
             } else {
-                uintptr_t newptr = node->ptr->node->storage->index + node->ptr->offset;
-                uintptr_t origptr = node->inode->storage->index + node->offset;
+                uintptr_t newptr = node->target->storage->index + node->target_offset;
                 FLATTEN_LOG_DEBUG(" %zu: (%lx:%zu)->(%lx:%zu) | %zu -> %zu\n",
                                   node->inode->storage->index,
-                                  (unsigned long)node->inode, node->offset,
-                                  (unsigned long)node->ptr->node, node->ptr->offset,
+                                  (unsigned long)node->inode, offset,
+                                  (unsigned long)node->target, (size_t)node->target_offset,
                                   origptr, newptr);
             }
         } else if(node->inode) {
             /* Reserved node but never filled */
-            uintptr_t origptr = node->inode->storage->index + node->offset;
+            size_t offset = FIXUP_ENTRY_OFFSET(entry);
+            uintptr_t origptr = node->inode->storage->index + offset;
             FLATTEN_LOG_DEBUG(" %zu: (%lx:%zu)-> 0 | %zu\n",
                               node->inode->storage->index,
-                              (unsigned long)node->inode, node->offset,
+                              (unsigned long)node->inode, offset,
                               origptr);
         } else {
             /* Reserved for dummy pointer */
-            FLATTEN_LOG_DEBUG(" (%lx)-> 0 | \n", (unsigned long)node->offset);
+            FLATTEN_LOG_DEBUG(" (%lx)-> 0 | \n", (unsigned long)entry->key);
         }
-        p = rb_next(p);
     }
     FLATTEN_LOG_DEBUG("]\n\n");
 }
 
-static int fixup_set_write(struct flat* flat, size_t* wcounter_p) {
-    struct rb_node* p = rb_first(&flat->FLCTRL.fixup_set_root.rb_root);
-    while(p) {
-        struct fixup_set_node* node = (struct fixup_set_node*)p;
-        if(node->ptr && (!IS_FIXUP_FPTR(node))) {
-            size_t origptr = node->inode->storage->index + node->offset;
-            FLATTEN_WRITE_ONCE(&origptr, sizeof(size_t), wcounter_p);
-        }
-        p = rb_next(p);
+/*
+ * Function pointers symbolization cache. Each distinct function address
+ *  is resolved with flatten_func_to_name only once per image write and
+ *  its name is stored only once in the symbol table of the image
+ */
+struct fptr_symbol {
+    uintptr_t addr;
+    char* name;
+    size_t len;
+};
+
+struct fptr_symbol_cache {
+    struct fptr_symbol* symbols; /* In the order of the first occurrence */
+    size_t count;
+    size_t symbols_capacity;
+    size_t names_size;
+    size_t* slots; /* Hash table of (index + 1) into symbols */
+    size_t capacity;
+};
+
+#define FPTR_SYMBOL_CACHE_MIN_CAPACITY 64
+
+static int fptr_symbol_cache_grow(struct flat* flat, struct fptr_symbol_cache* cache) {
+    size_t i, j, new_capacity;
+    size_t* slots;
+
+    new_capacity = cache->capacity ? cache->capacity * 2 : FPTR_SYMBOL_CACHE_MIN_CAPACITY;
+    slots = (size_t*)flat_zalloc(flat, sizeof(size_t), new_capacity);
+    if(slots == NULL)
+        return ENOMEM;
+
+    for(i = 0; i < cache->count; ++i) {
+        j = fixup_set_hash(cache->symbols[i].addr, new_capacity);
+        while(slots[j] != 0)
+            j = (j + 1) & (new_capacity - 1);
+        slots[j] = i + 1;
     }
+
+    flat_free(cache->slots);
+    cache->slots = slots;
+    cache->capacity = new_capacity;
     return 0;
 }
 
-static int fixup_set_fptr_write(struct flat* flat, size_t* wcounter_p) {
-    struct rb_node* p = rb_first(&flat->FLCTRL.fixup_set_root.rb_root);
-    while(p) {
-        struct fixup_set_node* node = (struct fixup_set_node*)p;
-        if(IS_FIXUP_FPTR(node)) {
-            size_t origptr = node->inode->storage->index + node->offset;
-            FLATTEN_WRITE_ONCE(&origptr, sizeof(size_t), wcounter_p);
-        }
-        p = rb_next(p);
-    }
-    return 0;
+static struct fptr_symbol* fptr_symbol_cache_append(struct flat* flat, struct fptr_symbol_cache* cache) {
+    if(cache->count == cache->symbols_capacity) {
+        size_t new_capacity = cache->symbols_capacity ? cache->symbols_capacity * 2 : FPTR_SYMBOL_CACHE_MIN_CAPACITY;
+        struct fptr_symbol* symbols = (struct fptr_symbol*)flat_zalloc(flat, sizeof(struct fptr_symbol), new_capacity);
+        if(symbols == NULL)
+            return NULL;
+        if(cache->count)
+            memcpy(symbols, cache->symbols, cache->count * sizeof(struct fptr_symbol));
+        flat_free(cache->symbols);
+        cache->symbols = symbols;
+        cache->symbols_capacity = new_capacity;
+    }
+    return &cache->symbols[cache->count];
 }
 
-static size_t fixup_fptr_info_count(struct flat* flat) {
+/* Returns index of the symbol of function at addr or -1 on allocation failure */
+static ssize_t fptr_symbol_cache_resolve(struct flat* flat, struct fptr_symbol_cache* cache, uintptr_t addr) {
+    size_t i;
     char func_symbol[128];
-    size_t symbol_len, func_ptr, count = sizeof(size_t);
+    struct fptr_symbol* entry;
+
+    if(2 * (cache->count + 1) > cache->capacity)
+        if(fptr_symbol_cache_grow(flat, cache))
+            return -1;
+
+    i = fixup_set_hash(addr, cache->capacity);
+    while(cache->slots[i] != 0) {
+        if(cache->symbols[cache->slots[i] - 1].addr == addr)
+            return cache->slots[i] - 1;
+        i = (i + 1) & (cache->capacity - 1);
+    }
+
+    entry = fptr_symbol_cache_append(flat, cache);
+    if(entry == NULL)
+        return -1;
+
+    entry->len = flatten_func_to_name(func_symbol, sizeof(func_symbol), (void*)addr);
+    if(entry->len > 0) {
+        entry->name = (char*)flat_zalloc(flat, entry->len, 1);
+        if(entry->name == NULL)
+            return -1;
+        memcpy(entry->name, func_symbol, entry->len);
+    }
+    entry->addr = addr;
+    cache->names_size += entry->len;
+    cache->slots[i] = ++cache->count;
+    return cache->count - 1;
+}
 
-    struct rb_node* p = rb_first(&flat->FLCTRL.fixup_set_root.rb_root);
-    while(p) {
-        struct fixup_set_node* node = (struct fixup_set_node*)p;
-        if(IS_FIXUP_FPTR(node)) {
-            func_ptr = (unsigned long)node->ptr;
-            symbol_len = flatten_func_to_name(func_symbol, sizeof(func_symbol), (void*)func_ptr);
+static void fptr_symbol_cache_destroy(struct fptr_symbol_cache* cache) {
+    size_t i;
+    for(i = 0; i < cache->count; ++i)
+        flat_free(cache->symbols[i].name);
+    flat_free(cache->symbols);
+    flat_free(cache->slots);
+    memset(cache, 0, sizeof(*cache));
+}
 
-            count += 2 * sizeof(size_t) + symbol_len;
-        }
-        p = rb_next(p);
+/*
+ * Pointer tables of the image gathered in a single pass over fixup set
+ */
+struct fixup_fptr_record {
+    size_t orig_ptr;
+    uint32_t symbol; /* Index into symbols */
+};
+
+struct fixup_write_info {
+    size_t* ptrs;
+    size_t ptr_count;
+    struct fixup_fptr_record* fptrs;
+    size_t fptr_count;
+    size_t fptr_capacity;
+    size_t fptrmapsz;
+    struct fptr_symbol_cache symbols;
+};
+
+static int fixup_write_info_add_fptr(struct flat* flat, struct fixup_write_info* info, size_t orig_ptr, uintptr_t func_ptr) {
+    struct fixup_fptr_record* record;
+    ssize_t symbol;
+
+    if(info->fptr_count == info->fptr_capacity) {
+        size_t new_capacity = info->fptr_capacity ? info->fptr_capacity * 2 : FPTR_SYMBOL_CACHE_MIN_CAPACITY;
+        struct fixup_fptr_record* fptrs = (struct fixup_fptr_record*)flat_zalloc(flat, sizeof(struct fixup_fptr_record), new_capacity);
+        if(fptrs == NULL)
+            return ENOMEM;
+        if(info->fptr_count)
+            memcpy(fptrs, info->fptrs, info->fptr_count * sizeof(struct fixup_fptr_record));
+        flat_free(info->fptrs);
+        info->fptrs = fptrs;
+        info->fptr_capacity = new_capacity;
     }
-    return count;
+
+    symbol = fptr_symbol_cache_resolve(flat, &info->symbols, func_ptr);
+    if(symbol < 0)
+        return ENOMEM;
+
+    record = &info->fptrs[info->fptr_count++];
+    record->orig_ptr = orig_ptr;
+    record->symbol = symbol;
+    return 0;
 }
 
-static int fixup_set_fptr_info_write(struct flat* flat, size_t* wcounter_p) {
-    char func_symbol[128];
-    size_t symbol_len, func_ptr, orig_ptr;
-    struct rb_node* p;
+static int fixup_write_info_collect(struct flat* flat, struct fixup_write_info* info) {
+    int err;
+    size_t i;
+    struct fixup_set* fs = &flat->FLCTRL.fixup_set;
 
-    FLATTEN_WRITE_ONCE(&flat->FLCTRL.HDR.fptr_count, sizeof(size_t), wcounter_p);
+    memset(info, 0, sizeof(*info));
+    info->fptrmapsz = sizeof(size_t);
+    if(fs->count == 0)
+        return 0;
 
-    p = rb_first(&flat->FLCTRL.fixup_set_root.rb_root);
-    while(p) {
-        struct fixup_set_node* node = (struct fixup_set_node*)p;
+    info->ptrs = (size_t*)flat_zalloc(flat, sizeof(size_t), fs->record_count ? fs->record_count : 1);
+    if(info->ptrs == NULL)
+        return ENOMEM;
+
+    for(i = 0; i < fs->count; ++i) {
+        struct fixup_set_node* node = fs->sorted[i].node;
+        size_t origptr;
+
+        if(!node->inode || !IS_FIXUP_SET(node))
+            continue;
+
+        origptr = node->inode->storage->index + FIXUP_ENTRY_OFFSET(&fs->sorted[i]);
         if(IS_FIXUP_FPTR(node)) {
-            func_ptr = (uintptr_t)node->ptr;
-            orig_ptr = node->inode->storage->index + node->offset;
-            symbol_len = flatten_func_to_name(func_symbol, sizeof(func_symbol), (void*)func_ptr);
+            err = fixup_write_info_add_fptr(flat, info, origptr, node->target_offset);
+            if(err)
+                return err;
+        } else
+            info->ptrs[info->ptr_count++] = origptr;
+    }
 
-            FLATTEN_WRITE_ONCE(&orig_ptr, sizeof(size_t), wcounter_p);
-            FLATTEN_WRITE_ONCE(&symbol_len, sizeof(size_t), wcounter_p);
-            FLATTEN_WRITE_ONCE(func_symbol, symbol_len, wcounter_p);
-        }
-        p = rb_next(p);
+    /* Symbol table followed by symbol index of each function pointer */
+    info->fptrmapsz += info->symbols.count * sizeof(size_t) + info->symbols.names_size;
+    info->fptrmapsz += info->fptr_count * sizeof(uint32_t);
+    return 0;
+}
+
+static void fixup_write_info_destroy(struct fixup_write_info* info) {
+    fptr_symbol_cache_destroy(&info->symbols);
+    flat_free(info->ptrs);
+    flat_free(info->fptrs);
+    memset(info, 0, sizeof(*info));
+}
+
+/*
+ * Writer of pointer and fragment tables in FLATTEN_TABLES_COMPACT encoding.
+ *  Varints are gathered in a small buffer to avoid writing them byte by byte
+ */
+#define TABLE_WRITER_BUFFER_SIZE 256
+
+struct table_writer {
+    unsigned char buf[TABLE_WRITER_BUFFER_SIZE];
+    size_t used;
+    size_t start; /* Image offset of the first table */
+};
+
+static int table_writer_flush(struct flat* flat, struct table_writer* tw, size_t* wcounter_p) {
+    FLATTEN_WRITE_ONCE(tw->buf, tw->used, wcounter_p);
+    tw->used = 0;
+    return 0;
+}
+
+static int table_writer_put(struct flat* flat, struct table_writer* tw, uint64_t value, size_t* wcounter_p) {
+    if(tw->used + FLATTEN_VARINT_MAX_SIZE > sizeof(tw->buf) && table_writer_flush(flat, tw, wcounter_p))
+        return -1;
+    tw->used += flatten_varint_encode(tw->buf + tw->used, value);
+    return 0;
+}
+
+static int table_writer_put_offset(struct flat* flat, struct table_writer* tw, size_t offset, size_t* prev, size_t* wcounter_p) {
+    uint64_t delta = offset - *prev;
+    *prev = offset;
+    return table_writer_put(flat, tw, flatten_zigzag_encode(delta), wcounter_p);
+}
+
+/* Flush the buffer and pad the tables, so that the memory area stays aligned */
+static int table_writer_finish(struct flat* flat, struct table_writer* tw, size_t* wcounter_p) {
+    size_t size = *wcounter_p + tw->used - tw->start;
+    size_t padding = FLATTEN_TABLES_PADDING + (-(size + FLATTEN_TABLES_PADDING) & 7);
+
+    if(tw->used + padding > sizeof(tw->buf) && table_writer_flush(flat, tw, wcounter_p))
+        return -1;
+    memset(tw->buf + tw->used, 0, padding);
+    tw->used += padding;
+    return table_writer_flush(flat, tw, wcounter_p);
+}
+
+static int fixup_set_write(struct flat* flat, struct fixup_write_info* info, struct table_writer* tw, size_t* wcounter_p) {
+    size_t i, prev;
+
+    if(tw == NULL) {
+        FLATTEN_WRITE_ONCE(info->ptrs, info->ptr_count * sizeof(size_t), wcounter_p);
+        for(i = 0; i < info->fptr_count; ++i)
+            FLATTEN_WRITE_ONCE(&info->fptrs[i].orig_ptr, sizeof(size_t), wcounter_p);
+        return 0;
+    }
+
+    for(i = 0, prev = 0; i < info->ptr_count; ++i)
+        if(table_writer_put_offset(flat, tw, info->ptrs[i], &prev, wcounter_p))
+            return -1;
+    for(i = 0, prev = 0; i < info->fptr_count; ++i)
+        if(table_writer_put_offset(flat, tw, info->fptrs[i].orig_ptr, &prev, wcounter_p))
+            return -1;
+    return 0;
+}
+
+static int fixup_set_fptr_info_write(struct flat* flat, struct fixup_write_info* info, size_t* wcounter_p) {
+    size_t i;
+    struct fptr_symbol_cache* symbols = &info->symbols;
+
+    FLATTEN_WRITE_ONCE(&symbols->count, sizeof(size_t), wcounter_p);
+    for(i = 0; i < symbols->count; ++i) {
+        FLATTEN_WRITE_ONCE(&symbols->symbols[i].len, sizeof(size_t), wcounter_p);
+        FLATTEN_WRITE_ONCE(symbols->symbols[i].name, symbols->symbols[i].len, wcounter_p);
     }
+
+    for(i = 0; i < info->fptr_count; ++i)
+        FLATTEN_WRITE_ONCE(&info->fptrs[i].symbol, sizeof(uint32_t), wcounter_p);
     return 0;
 }
 
@@ -933,12 +1577,25 @@ static size_t mem_fragment_index_count(struct flat* flat) {
     return mcount;
 }
 
-static int mem_fragment_index_write(struct flat* flat, size_t* wcounter_p) {
+static int mem_fragment_write(struct flat* flat, struct table_writer* tw, size_t index, size_t size, size_t* prev, size_t* wcounter_p) {
+    if(tw == NULL) {
+        FLATTEN_WRITE_ONCE(&index, sizeof(size_t), wcounter_p);
+        FLATTEN_WRITE_ONCE(&size, sizeof(size_t), wcounter_p);
+        return 0;
+    }
+
+    if(table_writer_put_offset(flat, tw, index, prev, wcounter_p))
+        return -1;
+    return table_writer_put(flat, tw, size, wcounter_p);
+}
+
+static int mem_fragment_index_write(struct flat* flat, struct table_writer* tw, size_t* wcounter_p) {
 
     struct rb_node* p = rb_first(&flat->FLCTRL.imap_root.rb_root);
     size_t index = 0;
     size_t fragment_size = 0;
     size_t mcount = 0;
+    size_t prev = 0;
     while(p) {
         struct flat_node* node = (struct flat_node*)p;
         fragment_size += node->storage->size;
@@ -946,14 +1603,12 @@ static int mem_fragment_index_write(struct flat* flat, size_t* wcounter_p) {
         if((!p) || (node->last + 1 != ((struct flat_node*)p)->start)) {
             if(p) {
                 size_t nindex = ((struct flat_node*)p)->storage->index;
-                size_t wrnfo;
-                FLATTEN_WRITE_ONCE(&index, sizeof(size_t), wcounter_p);
-                wrnfo = nindex - index;
-                FLATTEN_WRITE_ONCE(&wrnfo, sizeof(size_t), wcounter_p);
+                if(mem_fragment_write(flat, tw, index, nindex - index, &prev, wcounter_p))
+                    return -1;
                 index = nindex;
             } else {
-                FLATTEN_WRITE_ONCE(&index, sizeof(size_t), wcounter_p);
-                FLATTEN_WRITE_ONCE(&fragment_size, sizeof(size_t), wcounter_p);
+                if(mem_fragment_write(flat, tw, index, fragment_size, &prev, wcounter_p))
+                    return -1;
             }
             fragment_size = 0;
             mcount++;
@@ -990,41 +1645,23 @@ static int mem_fragment_index_debug_print(struct flat* flat) {
     return 0;
 }
 
-static size_t fixup_set_count(struct flat* flat) {
-    struct rb_node* p = rb_first(&flat->FLCTRL.fixup_set_root.rb_root);
-    size_t count = 0;
-    while(p) {
-        struct fixup_set_node* node = (struct fixup_set_node*)p;
-        if(node->ptr && (!IS_FIXUP_FPTR(node))) {
-            count++;
-        }
-        p = rb_next(p);
-    }
-    return count;
-}
+static void fixup_set_destroy(struct flat* flat) {
+    size_t i;
+    struct fixup_set* fs = &flat->FLCTRL.fixup_set;
 
-static size_t fixup_set_fptr_count(struct flat* flat) {
-    struct rb_node* p = rb_first(&flat->FLCTRL.fixup_set_root.rb_root);
-    size_t count = 0;
-    while(p) {
-        struct fixup_set_node* node = (struct fixup_set_node*)p;
-        if(IS_FIXUP_FPTR(node)) {
-            count++;
-        }
-        p = rb_next(p);
-    }
-    return count;
-}
+    for(i = 0; i < fs->block_count; ++i)
+        flat_free(fs->blocks[i]);
+    flat_free(fs->blocks);
+    flat_free(fs->keys);
+    flat_free(fs->refs);
+    flat_free(fs->sorted);
+    memset(fs, 0, sizeof(struct fixup_set));
 
-static void fixup_set_destroy(struct flat* flat) {
-    struct fixup_set_node *node, *tmp;
-    rbtree_postorder_for_each_entry_safe(node, tmp, &flat->FLCTRL.fixup_set_root.rb_root, node) {
-        if(!IS_FIXUP_FPTR(node)) {
-            flat_free(node->ptr);
-        }
-        flat_free(node);
+    while(flat->FLCTRL.fptr_spare) {
+        struct flatten_pointer* next = (struct flatten_pointer*)flat->FLCTRL.fptr_spare->node;
+        flat_free(flat->FLCTRL.fptr_spare);
+        flat->FLCTRL.fptr_spare = next;
     }
-    memset(&flat->FLCTRL.fixup_set_root, 0, sizeof(struct rb_root_cached));
 }
 
 /*******************************************************
@@ -1186,6 +1823,7 @@ int interval_tree_destroy(struct flat* flat) {
         flat_free(node);
     }
     memset(&flat->FLCTRL.imap_root, 0, sizeof(struct rb_root_cached));
+    memset(flat->FLCTRL.node_cache, 0, sizeof(flat->FLCTRL.node_cache));
     return 0;
 }
 
@@ -1196,23 +1834,22 @@ void flatten_init(struct flat* flat) {
     memset(&flat->FLCTRL, 0, sizeof(struct FLCONTROL));
     INIT_LIST_HEAD(&flat->FLCTRL.storage_head);
     INIT_LIST_HEAD(&flat->FLCTRL.root_addr_head);
-    flat->FLCTRL.fixup_set_root = RB_ROOT_CACHED;
     flat->FLCTRL.imap_root = RB_ROOT_CACHED;
     flat->root_addr_set.rb_node = 0;
-    flat->mptrindex = 0;
+    flat->mchunk = NULL;
+    flat->mchunk_size = 0;
+    flat->mused = 0;
     flat->msize = 0;
 #if LINEAR_MEMORY_ALLOCATOR > 0
-    flat->msize = FLAT_LINEAR_MEMORY_INITIAL_POOL_SIZE;
-    flat->mpool = FLATTEN_BSP_ZALLOC(FLAT_LINEAR_MEMORY_INITIAL_POOL_SIZE);
-    if(!flat->mpool) {
-        flat_errs("Failed to allocate initial kflat memory pool of size %lluu\n", FLAT_LINEAR_MEMORY_INITIAL_POOL_SIZE);
+    flat->mchunk_size = FLAT_LINEAR_MEMORY_INITIAL_POOL_SIZE;
+    if(!flat_mem_chunk_alloc(flat, 0)) {
+        flat_errs("Failed to allocate initial kflat memory pool of size %llu\n", FLAT_LINEAR_MEMORY_INITIAL_POOL_SIZE);
         flat->error = ENOMEM;
     }
-#else
-    flat->mpool = 0;
 #endif
 
-    bqueue_init(flat, &flat->bq, DEFAULT_ITER_QUEUE_SIZE); // Error handling?
+    if(bqueue_init(flat, &flat->bq, DEFAULT_ITER_QUEUE_SIZE))
+        flat->error = ENOMEM;
     FLATTEN_LOG_CLEAR();
 }
 
@@ -1230,43 +1867,38 @@ static uintptr_t get_mem_addr(struct FLCONTROL* FLCTRL) {
            sizeof(FLCTRL->HDR) +
            FLCTRL->HDR.root_addr_count * sizeof(size_t) +
            FLCTRL->HDR.root_addr_extended_size +
-           FLCTRL->HDR.ptr_count * sizeof(size_t) +
-           FLCTRL->HDR.fptr_count * sizeof(size_t) +
-           FLCTRL->HDR.mcount * 2 * sizeof(size_t);
+           FLCTRL->HDR.tables_size;
 }
 
-static int flatten_write_internal(struct flat* flat, size_t* wcounter_p) {
+static int flatten_write_sections(struct flat* flat, struct fixup_write_info* info, size_t* wcounter_p) {
     int err = 0;
-    size_t memory_area_start;
     struct root_addrnode* entry = NULL;
+    struct table_writer table_writer;
+    struct table_writer* tw = NULL;
+    size_t header_offset = *wcounter_p;
 
-    binary_stream_calculate_index(flat);
-    if(flat->FLCTRL.debug_flag) {
-        flatten_debug_info(flat);
-    }
     flat->FLCTRL.HDR.magic = KFLAT_IMG_MAGIC;
     flat->FLCTRL.HDR.version = KFLAT_IMG_VERSION;
+    flat->FLCTRL.HDR.table_encoding = flat->FLCTRL.compact_tables ? FLATTEN_TABLES_COMPACT : FLATTEN_TABLES_RAW;
     flat->FLCTRL.HDR.last_load_addr = (uintptr_t)FLATTEN_GET_IMG_BASE_ADDR();
 
     flat->FLCTRL.HDR.memory_size = binary_stream_size(flat);
-    flat->FLCTRL.HDR.ptr_count = fixup_set_count(flat);
-    flat->FLCTRL.HDR.fptr_count = fixup_set_fptr_count(flat);
+    flat->FLCTRL.HDR.ptr_count = info->ptr_count;
+    flat->FLCTRL.HDR.fptr_count = info->fptr_count;
     flat->FLCTRL.HDR.root_addr_count = root_addr_count(flat);
     flat->FLCTRL.HDR.root_addr_extended_count = root_addr_extended_count(flat);
     flat->FLCTRL.HDR.root_addr_extended_size = root_addr_extended_size(flat);
-    flat->FLCTRL.HDR.fptrmapsz = fixup_fptr_info_count(flat);
+    flat->FLCTRL.HDR.fptrmapsz = info->fptrmapsz;
     if(!flat->FLCTRL.mem_fragments_skip)
         flat->FLCTRL.HDR.mcount = mem_fragment_index_count(flat);
     else
         flat->FLCTRL.HDR.mcount = 0;
 
+    /* Size of compact tables is known once they're written - header is updated then */
+    flat->FLCTRL.HDR.tables_size = (flat->FLCTRL.HDR.ptr_count + flat->FLCTRL.HDR.fptr_count + flat->FLCTRL.HDR.mcount * 2) * sizeof(size_t);
     flat->FLCTRL.HDR.last_mem_addr = get_mem_addr(&flat->FLCTRL);
     FLATTEN_WRITE_ONCE(&flat->FLCTRL.HDR, sizeof(struct flatten_header), wcounter_p);
 
-    if(!flat->FLCTRL.mem_copy_skip) {
-        binary_stream_update_pointers(flat);
-    }
-
     list_for_each_entry(entry, &flat->FLCTRL.root_addr_head, head) {
         size_t root_addr_offset;
         if(entry->root_addr) {
@@ -1299,43 +1931,100 @@ static int flatten_write_internal(struct flat* flat, size_t* wcounter_p) {
         }
     }
 
-    if((err = fixup_set_write(flat, wcounter_p)) != 0) {
-        return err;
+    if(flat->FLCTRL.HDR.table_encoding == FLATTEN_TABLES_COMPACT) {
+        tw = &table_writer;
+        tw->used = 0;
+        tw->start = *wcounter_p;
     }
-    if((err = fixup_set_fptr_write(flat, wcounter_p)) != 0) {
+
+    if((err = fixup_set_write(flat, info, tw, wcounter_p)) != 0) {
         return err;
     }
     if(!flat->FLCTRL.mem_fragments_skip) {
-        if((err = mem_fragment_index_write(flat, wcounter_p)) != 0) {
+        if((err = mem_fragment_index_write(flat, tw, wcounter_p)) != 0) {
             return err;
         }
     }
-    memory_area_start = *wcounter_p;
+
+    if(tw) {
+        if((err = table_writer_finish(flat, tw, wcounter_p)) != 0)
+            return err;
+        flat->FLCTRL.HDR.tables_size = *wcounter_p - tw->start;
+        flat->FLCTRL.HDR.last_mem_addr = get_mem_addr(&flat->FLCTRL);
+        if(flat->area != NULL)
+            memcpy((unsigned char*)flat->area + header_offset, &flat->FLCTRL.HDR, sizeof(struct flatten_header));
+    }
     if((err = binary_stream_write(flat, wcounter_p)) != 0) {
         return err;
     }
 
-    if((err = fixup_set_fptr_info_write(flat, wcounter_p)) != 0) {
+    if((err = fixup_set_fptr_info_write(flat, info, wcounter_p)) != 0) {
         return err;
     }
 
-    if(flat->FLCTRL.mem_copy_skip) {
-        binary_stream_update_pointers_inarea(flat, (unsigned char*)flat->area + memory_area_start);
-    }
+    return 0;
+}
+
+/*
+ * Size the image with a dry run of flatten_write_sections (nothing is
+ *  written while there's no area) and allocate an area that fits it
+ */
+static int flatten_area_alloc(struct flat* flat, struct fixup_write_info* info) {
+    size_t size = 0;
+    int err;
+
+    if((err = flatten_write_sections(flat, info, &size)) != 0)
+        return err;
 
+    flat->area = FLATTEN_BSP_AREA_ALLOC(size);
+    if(flat->area == NULL)
+        return ENOMEM;
+    flat->size = size;
+    flat->area_owned = 1;
     return 0;
 }
 
+static int flatten_write_internal(struct flat* flat, size_t* wcounter_p) {
+    int err;
+    struct fixup_write_info info;
+
+    if((err = binary_stream_calculate_index(flat)) != 0) {
+        flat_errs("Failed to calculate binary stream layout (%d)\n", err);
+        return err;
+    }
+    if((err = fixup_set_sort(flat)) != 0) {
+        flat_errs("Failed to sort fixup set (%d)\n", err);
+        return err;
+    }
+    if(flat->FLCTRL.debug_flag) {
+        flatten_debug_info(flat);
+    }
+
+    err = fixup_write_info_collect(flat, &info);
+    if(err)
+        flat_errs("Failed to collect pointers for flatten image (%d)\n", err);
+    else if(flat->area == NULL && (err = flatten_area_alloc(flat, &info)) != 0)
+        flat_errs("Failed to allocate area for flatten image (%d)\n", err);
+    else
+        err = flatten_write_sections(flat, &info, wcounter_p);
+
+    fixup_write_info_destroy(&info);
+    return err;
+}
+
 int flatten_write(struct flat* flat) {
 
     size_t written = 0;
     int err;
 
+    /* Area left from the previous image might be too small */
+    flatten_release_area(flat);
+
     if((err = flatten_write_internal(flat, &written)) == 0) {
         flat_infos("OK. Flatten size: %lu, %lu pointers, %zu root pointers, %lu function pointers, %lu continuous memory fragments, "
                    "%zu bytes written, memory used: %zu, memory avail: %zu\n",
                    flat->FLCTRL.HDR.memory_size, flat->FLCTRL.HDR.ptr_count, flat->FLCTRL.HDR.root_addr_count, flat->FLCTRL.HDR.fptr_count,
-                   flat->FLCTRL.HDR.mcount, written - sizeof(size_t), flat->mptrindex, flat->msize);
+                   flat->FLCTRL.HDR.mcount, written - sizeof(size_t), flat->mused, flat->msize);
     } else {
         flat_errs("ERROR %d: Could not write flatten image. Flatten size: %lu, %lu pointers, %zu root pointers, %lu function pointers,"
                   "%lu continuous memory fragments, %zu bytes written\n",
@@ -1343,7 +2032,8 @@ int flatten_write(struct flat* flat) {
                   flat->FLCTRL.HDR.ptr_count, flat->FLCTRL.HDR.root_addr_count, flat->FLCTRL.HDR.fptr_count, flat->FLCTRL.HDR.mcount, written - sizeof(size_t));
     }
 
-    ((struct flatten_header*)flat->area)->image_size = written;
+    if(flat->area != NULL)
+        ((struct flatten_header*)flat->area)->image_size = written;
     return err;
 }
 EXPORT_FUNC(flatten_write);
@@ -1354,6 +2044,7 @@ int flatten_fini(struct flat* flat) {
     bqueue_destroy(&flat->bq);
     binary_stream_destroy(flat);
     fixup_set_destroy(flat);
+    visited_set_destroy(flat);
     list_for_each_entry_safe(ptr, tmp, &flat->FLCTRL.root_addr_head, head) {
         list_del(&ptr->head);
         flat_free(ptr);
@@ -1361,16 +2052,19 @@ int flatten_fini(struct flat* flat) {
     interval_tree_destroy(flat);
     root_addr_set_destroy(flat);
 #if LINEAR_MEMORY_ALLOCATOR
-    FLATTEN_BSP_FREE(flat->mpool);
-    flat->mptrindex = 0;
-    flat->msize = 0;
+    flat_mem_chunks_destroy(flat);
 #endif
     return 0;
 }
 
 struct flat_node* flatten_acquire_node_for_ptr(struct flat* flat, const void* _ptr, size_t size) {
-    struct flat_node* node = flat_interval_tree_iter_first(&flat->FLCTRL.imap_root, (uint64_t)_ptr, (uint64_t)_ptr + size - 1);
+    struct flat_node* node = flat_node_lookup(flat, (uint64_t)_ptr, (uint64_t)_ptr + size - 1);
     struct flat_node* head_node = 0;
+
+    /* Whole range already stored - most of the lookups end here */
+    if(node && node->start <= (uintptr_t)_ptr && (uintptr_t)_ptr + size - 1 <= node->last)
+        return node;
+
     if(node) {
         uintptr_t p = (uintptr_t)_ptr;
         struct flat_node* prev = NULL;
@@ -1393,7 +2087,7 @@ struct flat_node* flatten_acquire_node_for_ptr(struct flat* flat, const void* _p
                 nn->storage = binary_stream_insert_front(flat, (void*)p, node->start - p, node->storage);
                 flat_interval_tree_insert(nn, &flat->FLCTRL.imap_root);
                 if(head_node == 0) {
-                    head_node = node;
+                    head_node = nn;
                 }
             } else {
                 if(head_node == 0) {
@@ -1458,6 +2152,7 @@ struct flat_node* flatten_acquire_node_for_ptr(struct flat* flat, const void* _p
         }
     }
 
+    flat_node_cache_insert(flat, head_node);
     return head_node;
 }
 EXPORT_FUNC(flatten_acquire_node_for_ptr);
@@ -1484,8 +2179,8 @@ void flatten_generic(struct flat* flat, void* q, struct flatten_pointer* fptr, c
     }
 
     if(shift != 0) {
-        __ptr_node = flat_interval_tree_iter_first(
-            &flat->FLCTRL.imap_root,
+        __ptr_node = flat_node_lookup(
+            flat,
             (uintptr_t)_fp - shift,
             (uintptr_t)_fp - shift + 1);
         __shifted->node = __ptr_node;
@@ -1497,19 +2192,14 @@ void flatten_generic(struct flat* flat, void* q, struct flatten_pointer* fptr, c
         DBGS("flatten_generic: fixup_set_insert_force_update(): err(%d)", err);
         flat->error = err;
     } else if(err != EEXIST) {
-        struct fixup_set_node* struct_inode;
+        size_t pushed = 0;
         err = 0;
 
         for(i = 0; i < count; ++i) {
             const void* target = (char*)_fp + i * el_size;
-            struct_inode = fixup_set_search(flat, (uint64_t)target);
-            if(!struct_inode) {
+            if(!visited_set_search(flat, (uintptr_t)target)) {
                 struct flatten_job job = {0};
 
-                int err = fixup_set_reserve_address(flat, (uint64_t)target);
-                if(err)
-                    break;
-
                 job.size = 1;
                 job.custom_val = custom_val;
                 job.index = i;
@@ -1518,9 +2208,12 @@ void flatten_generic(struct flat* flat, void* q, struct flatten_pointer* fptr, c
                 err = bqueue_push_back(flat, (struct bqueue*)q, &job, sizeof(struct flatten_job));
                 if(err)
                     break;
+                pushed++;
             }
         }
 
+        if(!err && pushed)
+            err = visited_set_insert_range(flat, (uintptr_t)_fp, el_size, count);
         if(err && err != EEXIST)
             flat->error = err;
     }
@@ -1535,8 +2228,7 @@ void flatten_aggregate_generic(struct flat* flat, void* q, const void* _ptr,
     void* _p;
     const void* _fp = 0;
     struct flatten_pointer* __shifted;
-    struct fixup_set_node* __struct_inode;
-    size_t _i;
+    size_t _i, _pushed = 0;
 
     _p = (void*)OFFATTR(const void*, _off);
     if(pre_f)
@@ -1548,8 +2240,8 @@ void flatten_aggregate_generic(struct flat* flat, void* q, const void* _ptr,
         DBGS("  \\-> AGGREGATE_FLATTEN_GENERIC: error(%d), ADDR(%lx)\n", flat->error, (uintptr_t)OFFATTR(void**, _off));
         return;
     }
-    __node = flat_interval_tree_iter_first(
-        &flat->FLCTRL.imap_root,
+    __node = flat_node_lookup(
+        flat,
         (uint64_t)_ptr + _off,
         (uint64_t)_ptr + _off + sizeof(void*) - 1);
     if(__node == NULL) {
@@ -1564,8 +2256,8 @@ void flatten_aggregate_generic(struct flat* flat, void* q, const void* _ptr,
         return;
     }
     if(_shift != 0) {
-        __ptr_node = flat_interval_tree_iter_first(
-            &flat->FLCTRL.imap_root,
+        __ptr_node = flat_node_lookup(
+            flat,
             (uintptr_t)_fp - _shift,
             (uintptr_t)_fp - _shift + 1);
         __shifted->node = __ptr_node;
@@ -1586,8 +2278,8 @@ void flatten_aggregate_generic(struct flat* flat, void* q, const void* _ptr,
 
     err = 0;
     for(_i = 0; _i < count; ++_i) {
-        struct flat_node* __struct_node = flat_interval_tree_iter_first(
-            &flat->FLCTRL.imap_root,
+        struct flat_node* __struct_node = flat_node_lookup(
+            flat,
             (uint64_t)((char*)_fp + _i * el_size),
             (uint64_t)((char*)_fp + (_i + 1) * el_size - 1));
         if(__struct_node == NULL) {
@@ -1595,12 +2287,8 @@ void flatten_aggregate_generic(struct flat* flat, void* q, const void* _ptr,
             break;
         }
 
-        __struct_inode = fixup_set_search(flat, (uint64_t)((char*)_fp + _i * el_size));
-        if(!__struct_inode) {
+        if(!visited_set_search(flat, (uintptr_t)((char*)_fp + _i * el_size))) {
             struct flatten_job __job;
-            int err = fixup_set_reserve_address(flat, (uint64_t)((char*)_fp + _i * el_size));
-            if(err)
-                break;
             __job.node = 0;
             __job.offset = 0;
             __job.size = 1;
@@ -1613,8 +2301,11 @@ void flatten_aggregate_generic(struct flat* flat, void* q, const void* _ptr,
             err = bqueue_push_back(flat, (struct bqueue*)q, &__job, sizeof(struct flatten_job));
             if(err)
                 break;
+            _pushed++;
         }
     }
+    if(!err && _pushed)
+        err = visited_set_insert_range(flat, (uintptr_t)_fp, el_size, count);
     if(err && (err != EEXIST))
         flat->error = err;
 }
@@ -1625,7 +2316,7 @@ void flatten_aggregate_generic_storage(struct flat* flat, void* q, const void* _
     int err = 0;
     void* target;
     struct flatten_job job;
-    struct fixup_set_node* inode;
+    bool reserve = false;
     void* _fp = (unsigned char*)_ptr + _off;
 
     if(flat->error || !ADDR_RANGE_VALID(_fp, count * el_size)) {
@@ -1638,15 +2329,8 @@ void flatten_aggregate_generic_storage(struct flat* flat, void* q, const void* _
         if(flat->error)
             break;
 
-        inode = fixup_set_search(flat, (uintptr_t)target);
-        if(!inode)
-            err = fixup_set_reserve_address(flat, (uintptr_t)target);
-
-        if(err && err != EEXIST) {
-            flat->error = err;
-            DBGS("AGGREGATE_FLATTEN_GENERIC_STORAGE: error(%d)\n", flat->error);
-            break;
-        }
+        if(!visited_set_search(flat, (uintptr_t)target))
+            reserve = true;
 
         job.node = 0;
         job.offset = 0;
@@ -1659,6 +2343,14 @@ void flatten_aggregate_generic_storage(struct flat* flat, void* q, const void* _
         job.convert = 0;
         bqueue_push_back(flat, (struct bqueue*)q, &job, sizeof(struct flatten_job));
     }
+
+    if(!flat->error && reserve) {
+        err = visited_set_insert_range(flat, (uintptr_t)_fp, el_size, count);
+        if(err && err != EEXIST) {
+            flat->error = err;
+            DBGS("AGGREGATE_FLATTEN_GENERIC_STORAGE: error(%d)\n", flat->error);
+        }
+    }
 }
 EXPORT_FUNC(flatten_aggregate_generic_storage);
 
@@ -1698,56 +2390,66 @@ void flatten_run_iter_harness(struct flat* flat) {
     ktime_t init_time, now;
     long long int total_time = 0;
     void* fp;
-    struct flatten_job job;
+    struct flatten_job jobs[FLAT_ITER_JOB_BATCH];
+    size_t i, count;
     struct bqueue* bq = &flat->bq;
 
     init_time = ktime_get();
     while((!flat->error) && (!bqueue_empty(bq))) {
-        int err;
-
         DBGS("\n%s: queue iteration, size: %zu el_count: %ld\n", __func__, bqueue_size(bq), bqueue_el_count(bq));
 
-        err = bqueue_pop_front(bq, &job, sizeof(struct flatten_job));
-        if(err) {
-            flat->error = err;
+        if(bq->el_size != sizeof(struct flatten_job)) {
+            flat->error = EINVAL;
             break;
         }
 
-        fp = job.fun(flat, job.ptr, job.size, job.custom_val, job.index, bq);
-        if(job.convert != NULL)
-            fp = job.convert((struct flatten_pointer*)fp, job.ptr);
-
-        if(job.node != NULL) {
-            err = fixup_set_insert_force_update(flat, job.node, job.offset, (struct flatten_pointer*)fp);
-            if(err && err != EINVAL && err != EEXIST && err != EAGAIN) {
-                flat->error = err;
-                break;
+        /* Jobs pushed while processing the batch land behind it, so FIFO order is kept */
+        count = bqueue_pop_front_batch(bq, jobs, FLAT_ITER_JOB_BATCH);
+        for(i = 0; i < count; i++) {
+            struct flatten_job* job = &jobs[i];
+            int err;
+
+            /* Don't run the rest of the batch once a recipe failed */
+            if(flat->error)
+                goto done;
+
+            fp = job->fun(flat, job->ptr, job->size, job->custom_val, job->index, bq);
+            if(job->convert != NULL)
+                fp = job->convert((struct flatten_pointer*)fp, job->ptr);
+
+            if(job->node != NULL) {
+                err = fixup_set_insert_force_update(flat, job->node, job->offset, (struct flatten_pointer*)fp);
+                if(err && err != EINVAL && err != EEXIST && err != EAGAIN) {
+                    flat->error = err;
+                    goto done;
+                }
+            } else {
+                if(!fp)
+                    goto done;
+                flatten_pointer_release(flat, (struct flatten_pointer*)fp);
             }
-        } else {
-            if(!fp)
-                break;
-            flat_free(fp);
-        }
-
-        n++;
-        now = ktime_get();
-        DBGS("UNDER_ITER_HARNESS: recipes done: %lu, elapsed: %lld\n", n, now - init_time);
 
-        if(now - init_time > FLAT_PING_TIME_NS) {
-            total_time += now - init_time;
-            if(total_time > FLAT_MAX_TIME_NS) {
-                flat_errs("Timeout! Total time %lld [ms] exceeds maximum allowed %ld [ms]\n",
-                          total_time / NSEC_PER_MSEC, FLAT_MAX_TIME_NS / NSEC_PER_MSEC);
-                flat->error = EAGAIN;
-                break;
+            n++;
+            now = ktime_get();
+            DBGS("UNDER_ITER_HARNESS: recipes done: %lu, elapsed: %lld\n", n, now - init_time);
+
+            if(now - init_time > FLAT_PING_TIME_NS) {
+                total_time += now - init_time;
+                if(total_time > FLAT_MAX_TIME_NS) {
+                    flat_errs("Timeout! Total time %lld [ms] exceeds maximum allowed %ld [ms]\n",
+                              total_time / NSEC_PER_MSEC, FLAT_MAX_TIME_NS / NSEC_PER_MSEC);
+                    flat->error = EAGAIN;
+                    goto done;
+                }
+                flat_infos("Still working! done %lu recipes in total time %lld [ms], memory used: %zu, memory avail: %zu \n",
+                           n, total_time / NSEC_PER_MSEC, flat->mused, flat->msize);
+                init_time = ktime_get();
             }
-            flat_infos("Still working! done %lu recipes in total time %lld [ms], memory used: %zu, memory avail: %zu \n",
-                       n, total_time / NSEC_PER_MSEC, flat->mptrindex, flat->msize);
-            init_time = ktime_get();
         }
     }
+done:
     total_time += ktime_get() - init_time;
     flat_infos("Done working with %lu recipes in total time %lld [ms], memory used: %zu, memory avail: %zu \n",
-               n, total_time / NSEC_PER_MSEC, flat->mptrindex, flat->msize);
+               n, total_time / NSEC_PER_MSEC, flat->mused, flat->msize);
 }
 EXPORT_FUNC(flatten_run_iter_harness);
@@ -22,7 +22,9 @@
 #include <linux/version.h>
 #include <linux/vmalloc.h>
 #include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/poll.h>
+#include <linux/uio.h>
 
 #if defined(CONFIG_KASAN)
 #include <linux/kasan.h>
@@ -35,6 +37,10 @@ static int dbg_buffer_size = 50 * 1024 * 1024; // 50MB
 module_param(dbg_buffer_size, int, 0660);
 MODULE_PARM_DESC(dbg_buffer_size, "size of dbg buf used when flattening with debug flag enabled");
 
+static bool compact_tables;
+module_param(compact_tables, bool, 0660);
+MODULE_PARM_DESC(compact_tables, "delta encode and varint pack pointer and fragment tables of images");
+
 /*******************************************************
  * NON-EXPORTED FUNCTIONS
  *******************************************************/
@@ -51,6 +57,7 @@ void kflat_put(struct kflat* kflat) {
     if(atomic_dec_and_test(&kflat->refcount)) {
         kflat_recipe_put(kflat->recipe);
         kflat->recipe = NULL;
+        flatten_release_pool(&kflat->flat);
         vfree(kflat->flat.area);
         kfree(kflat);
     }
@@ -136,23 +143,16 @@ void kflat_dbg_buf_clear(void) {
     spin_unlock_irqrestore(&kflat_dbg_lock, flags);
 }
 
-static ssize_t kflat_dbg_buf_read(struct file* file, char* __user buffer, size_t size, loff_t* ppos) {
-    ssize_t ret = 0;
-    loff_t pos = *ppos;
-    void* page;
+/*
+ * Copy up to a page of the debug buffer starting at pos. Returns the number
+ *  of bytes copied, which is 0 past the end of the buffer
+ */
+static size_t kflat_dbg_buf_copy(void* page, loff_t pos, size_t size) {
     unsigned long flags;
 
-    if(pos < 0)
-        return -EINVAL;
-    if(size == 0)
-        return 0;
-    else if(size > PAGE_SIZE)
+    if(size > PAGE_SIZE)
         size = PAGE_SIZE;
 
-    page = (void*)__get_free_page(GFP_KERNEL);
-    if(page == NULL)
-        return -ENOMEM;
-
     spin_lock_irqsave(&kflat_dbg_lock, flags);
     if(_dbg_buffer.mem == NULL || _dbg_buffer.offset == 0 || pos > _dbg_buffer.offset) {
         size = 0;
@@ -164,14 +164,54 @@ static ssize_t kflat_dbg_buf_read(struct file* file, char* __user buffer, size_t
 
 exit:
     spin_unlock_irqrestore(&kflat_dbg_lock, flags);
+    return size;
+}
 
+static ssize_t kflat_dbg_buf_read(struct file* file, char* __user buffer, size_t size, loff_t* ppos) {
+    ssize_t ret = 0;
+    loff_t pos = *ppos;
+    void* page;
+
+    if(pos < 0)
+        return -EINVAL;
+    if(size == 0)
+        return 0;
+
+    page = (void*)__get_free_page(GFP_KERNEL);
+    if(page == NULL)
+        return -ENOMEM;
+
+    size = kflat_dbg_buf_copy(page, pos, size);
     ret = copy_to_user(buffer, page, size);
+    free_page((unsigned long)page);
     if(ret)
         return -EFAULT;
     *ppos = pos + size;
+    return size;
+}
+
+static ssize_t kflat_dbg_buf_read_iter(struct kiocb* iocb, struct iov_iter* to) {
+    loff_t pos = iocb->ki_pos;
+    size_t size = iov_iter_count(to);
+    size_t copied;
+    void* page;
+
+    if(pos < 0)
+        return -EINVAL;
+    if(size == 0)
+        return 0;
+
+    page = (void*)__get_free_page(GFP_KERNEL);
+    if(page == NULL)
+        return -ENOMEM;
 
+    size = kflat_dbg_buf_copy(page, pos, size);
+    copied = copy_to_iter(page, size, to);
     free_page((unsigned long)page);
-    return size;
+    if(copied == 0 && size > 0)
+        return -EFAULT;
+    iocb->ki_pos = pos + copied;
+    return copied;
 }
 
 void kflat_dbg_printf(const char* fmt, ...) {
@@ -253,6 +293,114 @@ static int flatten_stop_machine(struct kflat* kflat, struct probe_regs* regs) {
     return err;
 }
 
+/*******************************************************
+ * MULTI-SHOT CAPTURE
+ *  In multi-shot mode the mmaped area is split into a ring
+ *  of slots, each starting with struct kflat_slot_header.
+ *  Probing delegate flattens memory into the next slot and
+ *  the kprobe is re-armed from workqueue once the probed
+ *  function is resumed
+ *******************************************************/
+#define KFLAT_DEFAULT_SLOT_COUNT 4
+
+static inline bool kflat_multishot_enabled(struct kflat* kflat) {
+    return kflat->multishot.slot_count > 0;
+}
+
+static int kflat_multishot_setup(struct kflat* kflat, struct kflat_ioctl_enable* enable) {
+    size_t i;
+    struct kflat_multishot* ms = &kflat->multishot;
+
+    if(enable->run_recipe_now) {
+        pr_err("multi-shot mode cannot be used together with run_recipe_now");
+        return -EINVAL;
+    }
+
+    ms->slot_count = enable->slot_count;
+    if(ms->slot_count == 0)
+        ms->slot_count = min(enable->shot_count, (unsigned int)KFLAT_DEFAULT_SLOT_COUNT);
+    ms->slot_size = (kflat->flat.size / ms->slot_count) & PAGE_MASK;
+    if(ms->slot_size < KFLAT_SLOT_HEADER_SIZE + PAGE_SIZE) {
+        pr_err("mmaped area is too small to hold %u slots", ms->slot_count);
+        ms->slot_count = 0;
+        return -EINVAL;
+    }
+
+    ms->ring = kflat->flat.area;
+    ms->ring_size = kflat->flat.size;
+    ms->shots_left = enable->shot_count;
+    ms->min_interval_ns = enable->min_interval_ns;
+    ms->completed = 0;
+    ms->consumed = 0;
+    for(i = 0; i < ms->slot_count; i++)
+        memset(ms->ring + i * ms->slot_size, 0, sizeof(struct kflat_slot_header));
+    return 0;
+}
+
+// Capture counters are 64-bit, so plain modulo would need libgcc on 32-bit targets
+static struct kflat_slot_header* kflat_slot_at(struct kflat_multishot* ms, uint64_t capture) {
+    u32 index;
+
+    div_u64_rem(capture, ms->slot_count, &index);
+    return ms->ring + (size_t)index * ms->slot_size;
+}
+
+static struct kflat_slot_header* kflat_slot_begin(struct kflat* kflat) {
+    struct kflat_multishot* ms = &kflat->multishot;
+    struct kflat_slot_header* hdr;
+
+    hdr = kflat_slot_at(ms, ms->completed);
+    WRITE_ONCE(hdr->seq, 0);
+    smp_wmb();
+    hdr->timestamp = ktime_get_ns();
+
+    kflat->flat.area = (void*)hdr + KFLAT_SLOT_HEADER_SIZE;
+    kflat->flat.size = ms->slot_size - KFLAT_SLOT_HEADER_SIZE;
+    kflat->flat.error = 0;
+    return hdr;
+}
+
+static void kflat_slot_end(struct kflat* kflat, struct kflat_slot_header* hdr) {
+    struct kflat_multishot* ms = &kflat->multishot;
+
+    hdr->error = kflat->flat.error;
+    hdr->size = kflat->flat.error ? 0 : ((struct flatten_header*)kflat->flat.area)->image_size;
+    kflat->flat.area = ms->ring;
+    kflat->flat.size = ms->ring_size;
+
+    smp_wmb();
+    WRITE_ONCE(hdr->seq, ms->completed + 1);
+    smp_store_release(&ms->completed, ms->completed + 1);
+    WRITE_ONCE(ms->shots_left, ms->shots_left - 1);
+}
+
+static void kflat_multishot_rearm(struct work_struct* work) {
+    struct kflat* kflat = container_of(to_delayed_work(work), struct kflat, multishot.rearm_work);
+
+    mutex_lock(&kflat->lock);
+    if(kflat->mode == KFLAT_MODE_ENABLED && READ_ONCE(kflat->multishot.shots_left) > 0) {
+        if(probing_arm(kflat, kflat->recipe->symbol, kflat->pid))
+            pr_err("failed to re-arm kprobe for the next shot");
+    }
+    mutex_unlock(&kflat->lock);
+    kflat_put(kflat);
+}
+
+static void kflat_multishot_schedule(struct kflat* kflat) {
+    unsigned long delay;
+    struct kflat_multishot* ms = &kflat->multishot;
+
+    if(READ_ONCE(ms->shots_left) == 0)
+        return;
+
+    // Wait at least one tick, so that the invocation we're returning to
+    //  won't be caught by the re-armed probe
+    delay = max(nsecs_to_jiffies(ms->min_interval_ns), 1UL);
+    kflat_get(kflat);
+    if(!schedule_delayed_work(&ms->rearm_work, delay))
+        kflat_put(kflat);
+}
+
 /*******************************************************
  * PROBING DELEGATE
  *  This functions will be invoked after kprobe successfully
@@ -267,6 +415,7 @@ asmlinkage __used uint64_t probing_delegate(struct probe_regs* regs) {
     int err;
     uint64_t return_addr;
     struct kflat* kflat;
+    struct kflat_slot_header* slot = NULL;
 
     pr_info("flatten started");
 
@@ -280,11 +429,17 @@ asmlinkage __used uint64_t probing_delegate(struct probe_regs* regs) {
     if(in_atomic()) {
         pr_err("This is still an atomic context. Attaching to a non-preemtible code is not supported");
         kflat->flat.error = EFAULT;
+        if(kflat_multishot_enabled(kflat))
+            WRITE_ONCE(kflat->multishot.shots_left, 0);
         goto probing_exit;
     }
 
+    if(kflat_multishot_enabled(kflat))
+        slot = kflat_slot_begin(kflat);
+
     flatten_init(&kflat->flat);
     kflat->flat.FLCTRL.debug_flag = kflat->debug_flag;
+    kflat->flat.FLCTRL.compact_tables = READ_ONCE(compact_tables);
 
     if(kflat->recipe->pre_handler)
         kflat->recipe->pre_handler(kflat);
@@ -294,10 +449,14 @@ asmlinkage __used uint64_t probing_delegate(struct probe_regs* regs) {
     kasan_disable_current();
 #endif
 
-    // Invoke recipe via stop_machine if user asked for that
-    if(kflat->use_stop_machine)
-        flatten_stop_machine(kflat, regs);
-    else
+    // Invoke recipe via stop_machine if user asked for that. Memory has to be
+    //  reserved beforehand, as only atomic allocations are possible there
+    if(kflat->use_stop_machine) {
+        if(flatten_reserve_pool(&kflat->flat, FLAT_LINEAR_MEMORY_ATOMIC_RESERVE))
+            kflat->flat.error = ENOMEM;
+        else
+            flatten_stop_machine(kflat, regs);
+    } else
         kflat->recipe->handler(kflat, regs);
 
 #if defined(CONFIG_KASAN)
@@ -309,15 +468,22 @@ asmlinkage __used uint64_t probing_delegate(struct probe_regs* regs) {
         err = flatten_write(&kflat->flat);
         if(err)
             pr_err("flatten write failed: %d\n", kflat->flat.error);
+        else if(kflat->stream_output)
+            smp_store_release(&kflat->stream_size, ((struct flatten_header*)kflat->flat.area)->image_size);
     }
     flatten_fini(&kflat->flat);
 
+    if(slot)
+        kflat_slot_end(kflat, slot);
+
     // Wake up poll handler
     wake_up_interruptible(&kflat->dump_ready_wq);
 
 probing_exit:
     // Prepare for return
     probing_disarm(kflat);
+    if(slot)
+        kflat_multishot_schedule(kflat);
     return_addr = READ_ONCE(kflat->probing.return_ip);
 
     if(kflat->skip_function_body) {
@@ -382,6 +548,12 @@ int kflat_run_test(struct kflat* kflat, struct kflat_ioctl_tests* test) {
                     return -EINVAL;
                 }
 
+                err = flatten_reserve_pool(&kflat->flat, FLAT_LINEAR_MEMORY_ATOMIC_RESERVE);
+                if(err) {
+                    flatten_fini(&kflat->flat);
+                    return err;
+                }
+
                 cpumask_clear(&cpumask);
                 cpumask_set_cpu(smp_processor_id(), &cpumask);
 
@@ -430,7 +602,11 @@ static int kflat_open(struct inode* inode, struct file* filep) {
 
     mutex_init(&kflat->lock);
     init_waitqueue_head(&kflat->dump_ready_wq);
+    INIT_DELAYED_WORK(&kflat->multishot.rearm_work, kflat_multishot_rearm);
     probing_init(kflat);
+
+    // Keep flattening memory pool between captures on this fd
+    kflat->flat.mkeep = 1;
     filep->private_data = kflat;
     return nonseekable_open(inode, filep);
 }
@@ -443,14 +619,13 @@ static int kflat_ioctl_locked(struct kflat* kflat, unsigned int cmd,
         struct kflat_ioctl_disable disable;
         struct kflat_ioctl_mem_map map;
         struct kflat_ioctl_tests tests;
+        struct kflat_ioctl_slot slot;
         char* buf;
     } args;
     struct kflat_recipe* recipe;
 
     switch(cmd) {
     case KFLAT_PROC_ENABLE:
-        if(kflat->flat.area == NULL)
-            return -EINVAL;
         if(kflat->mode == KFLAT_MODE_ENABLED)
             return -EBUSY;
 
@@ -459,6 +634,23 @@ static int kflat_ioctl_locked(struct kflat* kflat, unsigned int cmd,
         if(args.enable.target_name[0] == '\0')
             return -EINVAL;
 
+        // Image is either written to mmaped area or streamed to user with read()
+        kflat->stream_output = !!args.enable.stream_image;
+        if(kflat->stream_output != (kflat->flat.area == NULL || kflat->flat.area_owned)) {
+            pr_err("kflat memory has to be mmaped unless the image is streamed");
+            return -EINVAL;
+        }
+        if(kflat->stream_output) {
+            if(args.enable.shot_count > 1) {
+                pr_err("multi-shot mode requires mmaped kflat memory");
+                return -EINVAL;
+            }
+            flatten_release_area(&kflat->flat);
+            kflat->stream_size = 0;
+            kflat->stream_pos = 0;
+            kflat->flat.error = 0;
+        }
+
         kflat->pid = args.enable.pid;
         kflat->debug_flag = !!args.enable.debug_flag;
         kflat->use_stop_machine = !!args.enable.use_stop_machine;
@@ -484,6 +676,16 @@ static int kflat_ioctl_locked(struct kflat* kflat, unsigned int cmd,
             kflat_recipe_put(kflat->recipe);
         kflat->recipe = recipe;
 
+        kflat->multishot.slot_count = 0;
+        if(args.enable.shot_count > 1) {
+            ret = kflat_multishot_setup(kflat, &args.enable);
+            if(ret) {
+                kflat_recipe_put(kflat->recipe);
+                kflat->recipe = NULL;
+                return ret;
+            }
+        }
+
         if(args.enable.run_recipe_now) {
             // Run probing delegate here, instead of attaching kprobe
             struct probe_regs regs = {0};
@@ -505,12 +707,30 @@ static int kflat_ioctl_locked(struct kflat* kflat, unsigned int cmd,
     case KFLAT_PROC_DISABLE:
         if(kflat->mode == KFLAT_MODE_DISABLED)
             return -EINVAL;
-        kflat->mode = KFLAT_MODE_DISABLED;
+        WRITE_ONCE(kflat->mode, KFLAT_MODE_DISABLED);
 
+        // Readers waiting for streamed image won't get it any longer
+        wake_up_interruptible(&kflat->dump_ready_wq);
+
+        // Pending re-arm work will notice disabled mode on its own
+        if(cancel_delayed_work(&kflat->multishot.rearm_work))
+            kflat_put(kflat);
         probing_disarm(kflat);
 
-        args.disable.size = ((struct flatten_header*)kflat->flat.area)->image_size;
-        args.disable.invoked = args.disable.size > sizeof(size_t);
+        if(kflat_multishot_enabled(kflat)) {
+            struct kflat_multishot* ms = &kflat->multishot;
+            uint64_t completed = smp_load_acquire(&ms->completed);
+            struct kflat_slot_header* last = kflat_slot_at(ms, completed - 1);
+
+            args.disable.invoked = completed > 0;
+            args.disable.size = completed > 0 ? last->size : 0;
+        } else if(kflat->stream_output) {
+            args.disable.size = smp_load_acquire(&kflat->stream_size);
+            args.disable.invoked = args.disable.size > sizeof(size_t);
+        } else {
+            args.disable.size = ((struct flatten_header*)kflat->flat.area)->image_size;
+            args.disable.invoked = args.disable.size > sizeof(size_t);
+        }
         args.disable.error = kflat->flat.error;
         if(copy_to_user((void*)arg, &args.disable, sizeof(args.disable)))
             return -EFAULT;
@@ -520,7 +740,7 @@ static int kflat_ioctl_locked(struct kflat* kflat, unsigned int cmd,
         if(kflat->mode != KFLAT_MODE_DISABLED) {
             pr_err("Cannot run embedded tests when KFLAT is armed");
             return -EBUSY;
-        } else if(kflat->flat.area == NULL) {
+        } else if(kflat->flat.area == NULL || kflat->flat.area_owned) {
             pr_err("MMap KFLAT shared buffer before running tests");
             return -EINVAL;
         }
@@ -531,6 +751,45 @@ static int kflat_ioctl_locked(struct kflat* kflat, unsigned int cmd,
 
         return kflat_run_test(kflat, &args.tests);
 
+    case KFLAT_SLOT_CONSUME: {
+        uint64_t completed;
+        struct kflat_slot_header* hdr;
+        struct kflat_multishot* ms = &kflat->multishot;
+
+        if(!kflat_multishot_enabled(kflat))
+            return -EINVAL;
+
+        completed = smp_load_acquire(&ms->completed);
+        if(ms->consumed == completed)
+            return -EAGAIN;
+
+        // Skip captures that have already been overwritten
+        args.slot.lost = 0;
+        if(completed - ms->consumed > ms->slot_count) {
+            args.slot.lost = min_t(u64, completed - ms->slot_count - ms->consumed, U32_MAX);
+            ms->consumed = completed - ms->slot_count;
+        }
+
+        hdr = kflat_slot_at(ms, ms->consumed);
+        args.slot.seq = ms->consumed + 1;
+        args.slot.offset = (void*)hdr - ms->ring + KFLAT_SLOT_HEADER_SIZE;
+        args.slot.size = hdr->size;
+        args.slot.error = hdr->error;
+        ms->consumed++;
+
+        if(copy_to_user((void*)arg, &args.slot, sizeof(args.slot)))
+            return -EFAULT;
+        return 0;
+    }
+
+    case KFLAT_RELEASE_POOL:
+        // Any capture in progress holds an extra reference
+        if(kflat->mode != KFLAT_MODE_DISABLED || atomic_read(&kflat->refcount) > 1)
+            return -EBUSY;
+
+        flatten_release_pool(&kflat->flat);
+        return 0;
+
     case KFLAT_MEMORY_MAP:
         if(copy_from_user(&args.map, (void*)arg, sizeof(args.map)))
             return -EFAULT;
@@ -586,11 +845,16 @@ static int kflat_mmap_flatten(struct kflat* kflat, struct vm_area_struct* vma) {
 
     mutex_lock(&kflat->lock);
 
-    if(kflat->flat.area != NULL) {
+    if(kflat->flat.area != NULL && !kflat->flat.area_owned) {
         pr_err("cannot mmap kflat device twice");
         ret = -EBUSY;
         goto exit;
     }
+    if(kflat->mode != KFLAT_MODE_DISABLED) {
+        ret = -EBUSY;
+        goto exit;
+    }
+    flatten_release_area(&kflat->flat);
 
     area = vmalloc_user(alloc_size);
     if(!area) {
@@ -663,11 +927,30 @@ static __poll_t kflat_poll(struct file* filep, struct poll_table_struct* wait) {
 
     // Check whether timeout occurred or recipe was triggered
     mutex_lock(&kflat->lock);
+    if(kflat->stream_output) {
+        size = smp_load_acquire(&kflat->stream_size);
+        if(kflat->flat.error)
+            ret_mask = POLLERR;
+        else if(size > sizeof(size_t) && kflat->stream_pos < size)
+            ret_mask = POLLIN | POLLRDNORM;
+        goto exit;
+    }
     if(kflat->flat.area == NULL) {
         ret_mask = POLLERR;
         goto exit;
     }
 
+    if(kflat_multishot_enabled(kflat)) {
+        struct kflat_multishot* ms = &kflat->multishot;
+
+        // Signal every completed slot until it's consumed with KFLAT_SLOT_CONSUME
+        if(smp_load_acquire(&ms->completed) != ms->consumed)
+            ret_mask = POLLIN | POLLRDNORM;
+        else if(READ_ONCE(ms->shots_left) == 0)
+            ret_mask = POLLHUP | (kflat->flat.error ? POLLERR : 0);
+        goto exit;
+    }
+
     size = ((struct flatten_header*)kflat->flat.area)->image_size;
     if(kflat->flat.error) {
         ret_mask = POLLERR;
@@ -681,11 +964,109 @@ exit:
     return ret_mask;
 }
 
+/*
+ * Streamed image is read sequentially from the area allocated by
+ *  flatten_write. The area is released once the whole image was read
+ */
+static ssize_t kflat_stream_avail(struct kflat* kflat, size_t size) {
+    size_t image_size;
+
+    image_size = smp_load_acquire(&kflat->stream_size);
+    if(image_size != 0)
+        return min(size, image_size - kflat->stream_pos);
+
+    // Error code itself is reported by KFLAT_PROC_DISABLE
+    if(READ_ONCE(kflat->flat.error))
+        return -EIO;
+    if(READ_ONCE(kflat->mode) == KFLAT_MODE_DISABLED)
+        return 0;
+    return -EAGAIN;
+}
+
+/*
+ * Wait until the image is written by the recipe, unless the file was opened
+ *  with O_NONBLOCK. Called and returns with kflat->lock held
+ */
+static ssize_t kflat_stream_wait(struct kflat* kflat, struct file* file, size_t size) {
+    ssize_t ret;
+
+    while((ret = kflat_stream_avail(kflat, size)) == -EAGAIN) {
+        if(file->f_flags & O_NONBLOCK)
+            break;
+
+        mutex_unlock(&kflat->lock);
+        ret = wait_event_interruptible(kflat->dump_ready_wq, kflat_stream_avail(kflat, size) != -EAGAIN);
+        mutex_lock(&kflat->lock);
+        if(ret)
+            break;
+    }
+    return ret;
+}
+
+static void kflat_stream_consume(struct kflat* kflat, size_t size) {
+    kflat->stream_pos += size;
+    if(kflat->stream_pos == kflat->stream_size)
+        flatten_release_area(&kflat->flat);
+}
+
+static ssize_t kflat_read(struct file* file, char* __user buffer, size_t size, loff_t* ppos) {
+    struct kflat* kflat = file->private_data;
+    ssize_t ret;
+
+    mutex_lock(&kflat->lock);
+    if(!kflat->stream_output) {
+        mutex_unlock(&kflat->lock);
+        return kflat_dbg_buf_read(file, buffer, size, ppos);
+    }
+
+    ret = kflat_stream_wait(kflat, file, size);
+    if(ret > 0) {
+        if(copy_to_user(buffer, kflat->flat.area + kflat->stream_pos, ret))
+            ret = -EFAULT;
+        else
+            kflat_stream_consume(kflat, ret);
+    }
+    mutex_unlock(&kflat->lock);
+    return ret;
+}
+
+static ssize_t kflat_read_iter(struct kiocb* iocb, struct iov_iter* to) {
+    struct kflat* kflat = iocb->ki_filp->private_data;
+    size_t copied;
+    ssize_t ret;
+
+    mutex_lock(&kflat->lock);
+    if(!kflat->stream_output) {
+        mutex_unlock(&kflat->lock);
+        return kflat_dbg_buf_read_iter(iocb, to);
+    }
+
+    ret = kflat_stream_wait(kflat, iocb->ki_filp, iov_iter_count(to));
+    if(ret > 0) {
+        copied = copy_to_iter(kflat->flat.area + kflat->stream_pos, ret, to);
+        if(copied == 0) {
+            ret = -EFAULT;
+        } else {
+            kflat_stream_consume(kflat, copied);
+            ret = copied;
+        }
+    }
+    mutex_unlock(&kflat->lock);
+    return ret;
+}
+
 static int kflat_close(struct inode* inode, struct file* filep) {
     struct kflat* kflat = filep->private_data;
 
-    if(kflat->mode != KFLAT_MODE_DISABLED)
+    mutex_lock(&kflat->lock);
+    if(kflat->mode != KFLAT_MODE_DISABLED) {
+        kflat->mode = KFLAT_MODE_DISABLED;
         probing_disarm(kflat);
+    }
+    mutex_unlock(&kflat->lock);
+
+    if(cancel_delayed_work_sync(&kflat->multishot.rearm_work))
+        kflat_put(kflat);
     kflat_put(kflat);
     return 0;
 }
@@ -697,7 +1078,13 @@ static const struct file_operations kflat_fops = {
     .compat_ioctl = kflat_ioctl,
     .mmap = kflat_mmap,
     .release = kflat_close,
-    .read = kflat_dbg_buf_read,
+    .read = kflat_read,
+    .read_iter = kflat_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
     .poll = kflat_poll,
 };
 
@@ -15,8 +15,13 @@ extern "C" {
  * DEFAULT CONFIGURATION
  *************************************/
 #define LINEAR_MEMORY_ALLOCATOR              1
-#define FLAT_LINEAR_MEMORY_INITIAL_POOL_SIZE (256ULL * 1024 * 1024)
-#define DEFAULT_ITER_QUEUE_SIZE              (8ULL * 1024 * 1024)
+#define FLAT_LINEAR_MEMORY_INITIAL_POOL_SIZE (1ULL * 1024 * 1024)
+#define FLAT_LINEAR_MEMORY_MAX_CHUNK_SIZE    (64ULL * 1024 * 1024)
+#define FLAT_LINEAR_MEMORY_MIN_CHUNK_SIZE    (64ULL * 1024)
+#define FLAT_LINEAR_MEMORY_ATOMIC_RESERVE    (128ULL * 1024 * 1024)
+#define FLAT_NODE_CACHE_SIZE                 4
+#define DEFAULT_ITER_QUEUE_SIZE              (64ULL * 1024)
+#define FLAT_ITER_JOB_BATCH                  8
 #define FLAT_PING_TIME_NS                    (1 * NSEC_PER_SEC)
 #define FLAT_MAX_TIME_NS                     (8 * NSEC_PER_SEC)
 
@@ -47,46 +52,106 @@ struct flatten_pointer {
 struct blstream {
     struct list_head head;
     const void* source;
-    void* data;
+    void* data; /* Copied memory kept in one of blstream_chunk */
     size_t size;
     size_t index;
-    size_t alignment;
-    size_t align_offset;
+    uint32_t alignment;
+    uint32_t align_offset;
+};
+
+struct blstream_chunk {
+    struct blstream_chunk* next;
+    unsigned char data[];
+};
+
+/* Fixup set */
+struct fixup_set_node {
+    /* Storage area where the original address to be fixed is stored */
+    struct flat_node* inode;
+    /* Storage area and offset where the original address points to. For
+     *  function pointers target is NULL and target_offset holds the address */
+    struct flat_node* target;
+    uintptr_t target_offset;
+};
+
+struct fixup_set_entry {
+    uintptr_t key;
+    struct fixup_set_node* node;
+};
+
+struct fixup_set {
+    /* Open addressing hash table. Probing touches only the keys (0 marks
+     *  an empty slot), the matching record is then located through its
+     *  32-bit reference (record index + 1) */
+    uintptr_t* keys;
+    uint32_t* refs;
+    size_t capacity; /* Power of 2 */
+    size_t count;
+    /* Records stored in fixed size blocks, so they never move */
+    struct fixup_set_node** blocks;
+    size_t block_count;
+    size_t record_count;
+    struct fixup_set_node reserved; /* Returned for keys without a record */
+    struct fixup_set_entry* sorted; /* All entries ordered by key (filled on write) */
+};
+
+/* Visited set */
+/* All elements of an array: start + k * stride for start <= address <= last */
+struct visited_set_range {
+    struct rb_node rb;
+    uintptr_t start;
+    uintptr_t last;
+    uintptr_t __subtree_last;
+    size_t stride;
+};
+
+struct visited_set {
+    /* Open addressing hash table of addresses (0 marks an empty slot) */
+    uintptr_t* keys;
+    size_t capacity; /* Power of 2 */
+    size_t count;
+    /* Bloom filter over keys, two bits set within a single word per key */
+    uint64_t* bloom;
+    size_t bloom_words; /* Power of 2 */
+    /* Arrays kept out of the hash table */
+    struct rb_root_cached ranges;
+    struct visited_set_range* last_range; /* Most recent range hit */
 };
 
 struct FLCONTROL {
     struct list_head storage_head;
+    size_t storage_count;
+    struct blstream** storage_elements; /* Elements in stream order (filled on write) */
+    struct blstream_chunk* storage_chunks;
+    unsigned char* storage_chunk_free;
+    size_t storage_chunk_left;
     struct list_head root_addr_head;
-    struct rb_root_cached fixup_set_root;
+    struct fixup_set fixup_set;
+    struct visited_set visited_set; /* Addresses of objects already queued for flattening */
     struct rb_root_cached imap_root;
+    struct flat_node* node_cache[FLAT_NODE_CACHE_SIZE]; /* Recently used nodes of imap_root, most recent first */
     struct flatten_header HDR;
     struct root_addrnode* last_accessed_root;
     size_t root_addr_count;
+    struct flatten_pointer* fptr_spare; /* Pointers handed back by the fixup set, linked via node */
     void* mem;
 
     int debug_flag;
     int mem_fragments_skip;
     int mem_copy_skip;
+    int compact_tables; /* Write tables with FLATTEN_TABLES_COMPACT encoding */
 };
 
-/* Fixup set */
 enum fixup_encoding {
     FIXUP_DATA_POINTER = 0,
     FIXUP_FUNC_POINTER = 1
 };
 
-struct fixup_set_node {
-    struct rb_node node;
-    /* Storage area and offset where the original address to be fixed is stored */
-    struct flat_node* inode;
-    size_t offset;
-    /* Storage area and offset where the original address points to */
-    struct flatten_pointer* ptr;
-
-    enum fixup_encoding flags;
-};
+#define IS_FIXUP_FPTR(NODE) ((NODE)->target == NULL && (NODE)->target_offset != 0)
+#define IS_FIXUP_SET(NODE)  ((NODE)->target != NULL || (NODE)->target_offset != 0)
 
-#define IS_FIXUP_FPTR(NODE) ((NODE)->flags & FIXUP_FUNC_POINTER)
+/* Offset of the fixed location isn't stored - it's the key relative to inode */
+#define FIXUP_ENTRY_OFFSET(ENTRY) ((ENTRY)->key - (ENTRY)->node->inode->start)
 
 /* Root address list */
 struct root_addrnode {
@@ -103,20 +168,26 @@ struct root_addr_set_node {
     uintptr_t root_addr;
 };
 
-struct queue_block {
-    struct list_head head;
-    unsigned char data[];
-};
-
+/*
+ * Ring of equally sized element slots, grown by doubling. The element size
+ *  is taken from the first push into an empty queue.
+ */
 struct bqueue {
-    struct list_head head;
-    size_t block_size;
+    unsigned char* data;
+    size_t data_size; /* Allocated bytes */
+    size_t el_size;
+    size_t capacity; /* Number of el_size slots in data */
+    size_t front;    /* Slot of the oldest element */
     size_t size;
-    size_t front_index;
-    size_t back_index;
     unsigned long el_count;
 };
 
+struct flat_mem_chunk {
+    struct flat_mem_chunk* next;
+    size_t size;
+    size_t used;
+};
+
 struct flat {
     struct FLCONTROL FLCTRL;
     struct rb_root root_addr_set;
@@ -126,14 +197,19 @@ struct flat {
     /* Iter jobs queue */
     struct bqueue bq;
 
-    /* Destination area where dump will be saved */
+    /* Destination area where dump will be saved. When area is NULL,
+     *  flatten_write allocates one that fits the image (area_owned) */
     unsigned long size;
     void* area;
+    int area_owned;
 
-    /* Linear memory pool allocator support*/
-    void* mpool;
-    size_t mptrindex;
+    /* Linear memory pool allocator support */
+    struct flat_mem_chunk* mchunk; /* Most recent chunk, older ones linked via next */
+    size_t mchunk_size;            /* Size of the next chunk to be allocated */
+    size_t mused;
     size_t msize;
+    struct flat_mem_chunk* mspare; /* Zeroed chunks, reserved in advance or kept from the previous capture */
+    int mkeep;                     /* Recycle chunks in flatten_fini instead of freeing them */
 };
 
 struct flatten_base;
@@ -164,6 +240,43 @@ INTERVAL_TREE_DEFINE(struct flat_node, rb,
                      uintptr_t, __subtree_last,
                      START, LAST, static __attribute__((used)), flat_interval_tree);
 
+/* Move node at position pos of the node cache to the front */
+static inline void flat_node_cache_touch(struct flat* flat, struct flat_node* node, size_t pos) {
+    struct flat_node** cache = flat->FLCTRL.node_cache;
+    for(; pos > 0; --pos)
+        cache[pos] = cache[pos - 1];
+    cache[0] = node;
+}
+
+static inline void flat_node_cache_insert(struct flat* flat, struct flat_node* node) {
+    flat_node_cache_touch(flat, node, FLAT_NODE_CACHE_SIZE - 1);
+}
+
+/*
+ * Find the first node overlapping [start, last]. Recently used nodes are
+ *  checked before descending the interval tree - nodes never change their
+ *  bounds once inserted and never overlap, so a cached node covering the
+ *  whole range is the only match.
+ */
+static inline struct flat_node* flat_node_lookup(struct flat* flat, uintptr_t start, uintptr_t last) {
+    struct flat_node* node;
+    size_t i;
+
+    for(i = 0; i < FLAT_NODE_CACHE_SIZE && flat->FLCTRL.node_cache[i] != NULL; ++i) {
+        node = flat->FLCTRL.node_cache[i];
+        if(node->start <= start && last <= node->last) {
+            if(i != 0)
+                flat_node_cache_touch(flat, node, i);
+            return node;
+        }
+    }
+
+    node = flat_interval_tree_iter_first(&flat->FLCTRL.imap_root, start, last);
+    if(node != NULL && node->start <= start && last <= node->last)
+        flat_node_cache_insert(flat, node);
+    return node;
+}
+
 /*************************************
  * EXPORTED FLATTEN FUNCTIONS
  *************************************/
@@ -171,22 +284,28 @@ INTERVAL_TREE_DEFINE(struct flat_node, rb,
 void flatten_init(struct flat* flat);
 int flatten_write(struct flat* flat);
 int flatten_fini(struct flat* flat);
+void flatten_release_pool(struct flat* flat);
+int flatten_reserve_pool(struct flat* flat, size_t size);
+void flatten_release_area(struct flat* flat);
 
 struct flatten_pointer* flatten_plain_type(struct flat* flat, const void* _ptr, size_t _sz);
 int fixup_set_insert_force_update(struct flat* flat, struct flat_node* node, size_t offset, struct flatten_pointer* ptr);
 int fixup_set_insert_fptr(struct flat* flat, struct flat_node* node, size_t offset, unsigned long fptr);
 int fixup_set_insert_fptr_force_update(struct flat* flat, struct flat_node* node, size_t offset, unsigned long fptr);
 int fixup_set_reserve_address(struct flat* flat, uintptr_t addr);
+int visited_set_insert(struct flat* flat, uintptr_t addr);
+bool visited_set_search(struct flat* flat, uintptr_t addr);
 int fixup_set_reserve(struct flat* flat, struct flat_node* node, size_t offset);
 int root_addr_append(struct flat* flat, size_t root_addr);
 int root_addr_append_extended(struct flat* flat, size_t root_addr, const char* name, size_t size);
 struct fixup_set_node* fixup_set_search(struct flat* flat, uintptr_t v);
 
-int bqueue_init(struct flat* flat, struct bqueue* q, size_t block_size);
+int bqueue_init(struct flat* flat, struct bqueue* q, size_t size);
 void bqueue_destroy(struct bqueue* q);
 void bqueue_clear(struct bqueue* q);
 int bqueue_push_back(struct flat* flat, struct bqueue* q, const void* m, size_t s);
 int bqueue_pop_front(struct bqueue* q, void* m, size_t s);
+size_t bqueue_pop_front_batch(struct bqueue* q, void* m, size_t max_count);
 
 void flatten_run_iter_harness(struct flat* flat);
 void flatten_generic(struct flat* flat, void* q, struct flatten_pointer* fptr, const void* p, size_t el_size, size_t count, uintptr_t custom_val, flatten_struct_t func_ptr, unsigned long shift);
@@ -201,7 +320,11 @@ void* flat_zalloc(struct flat* flat, size_t size, size_t n);
 void flat_free(void* p);
 
 static inline struct flatten_pointer* make_flatten_pointer(struct flat* flat, struct flat_node* node, size_t offset) {
-    struct flatten_pointer* v = (struct flatten_pointer*)flat_zalloc(flat, sizeof(struct flatten_pointer), 1);
+    struct flatten_pointer* v = flat->FLCTRL.fptr_spare;
+    if(v != 0)
+        flat->FLCTRL.fptr_spare = (struct flatten_pointer*)v->node;
+    else
+        v = (struct flatten_pointer*)flat_zalloc(flat, sizeof(struct flatten_pointer), 1);
     if(v == 0)
         return 0;
     v->node = node;
@@ -264,8 +387,13 @@ static inline void destroy_flatten_pointer(struct flatten_pointer* fp) {
 }))
 #define OFFADDR(T, _off) ((T*)((unsigned char*)(_ptr) + _off))
 
+/* Without destination area only the image size is counted */
 #define FLATTEN_WRITE_ONCE(addr, wsize, wcounter_p)               \
     do {                                                          \
+        if(flat->area == NULL) {                                  \
+            *wcounter_p += wsize;                                 \
+            break;                                                \
+        }                                                         \
         if((*(wcounter_p) + wsize) > flat->size) {                \
             flat->error = ENOMEM;                                 \
             return -1;                                            \
@@ -274,7 +402,7 @@ static inline void destroy_flatten_pointer(struct flatten_pointer* fp) {
         *wcounter_p += wsize;                                     \
     } while(0)
 
-#define PTRNODE(PTRV) (flat_interval_tree_iter_first(&flat->FLCTRL.imap_root, (uintptr_t)(PTRV), (uintptr_t)(PTRV)))
+#define PTRNODE(PTRV) (flat_node_lookup(flat, (uintptr_t)(PTRV), (uintptr_t)(PTRV)))
 #define FLAT_ACCESSOR flat
 #define __THIS_STRUCT (_ptr)
 #define __ROOT_PTR    (FLAT_ACCESSOR->_root_ptr)
@@ -7,12 +7,22 @@
 #ifndef FLATTEN_IMAGE_H
 #define FLATTEN_IMAGE_H
 
-#define KFLAT_IMG_MAGIC   0x4e455454414c46ULL // 'FLATTEN\0'
-#define KFLAT_IMG_VERSION 0x2
+#define KFLAT_IMG_MAGIC      0x4e455454414c46ULL // 'FLATTEN\0'
+#define KFLAT_IMG_VERSION    0x3
+#define KFLAT_IMG_VERSION_V2 0x2
+
+/*
+ * Encoding of pointer, function pointer and memory fragment tables
+ */
+enum flatten_table_encoding {
+    FLATTEN_TABLES_RAW = 0,     /* Array of 8-byte values */
+    FLATTEN_TABLES_COMPACT = 1, /* Prefix varints, offsets delta encoded */
+};
 
 struct flatten_header {
     uint64_t magic;
     uint32_t version;
+    uint32_t table_encoding; /* enum flatten_table_encoding, always 0 in v2 */
 
     uintptr_t last_load_addr;
     uintptr_t last_mem_addr;
@@ -26,6 +36,62 @@ struct flatten_header {
     size_t root_addr_extended_size;
     size_t fptrmapsz;
     size_t mcount;
+
+    /* Fields below are not present in v2 images */
+    size_t tables_size; /* Size of all tables, memory area starts right after them */
 };
 
+#define FLATTEN_HEADER_V2_SIZE offsetof(struct flatten_header, tables_size)
+
+/*
+ * Compact tables store each value as a prefix varint - the number of trailing
+ *  zero bits in the first byte tells how many bytes follow it (0x00 is followed
+ *  by full 8-byte value). Offsets are stored as zigzag encoded differences from
+ *  the previous offset of the same table, as these are usually close to each other.
+ * The decoder always loads 8 bytes at once, hence the tables are followed by
+ *  FLATTEN_TABLES_PADDING bytes (and aligned to 8 bytes, so the memory area is).
+ * Values are stored in little-endian byte order.
+ */
+#define FLATTEN_VARINT_MAX_SIZE 9
+#define FLATTEN_TABLES_PADDING  8
+
+static inline uint64_t flatten_zigzag_encode(uint64_t delta) {
+    return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+}
+
+static inline uint64_t flatten_zigzag_decode(uint64_t value) {
+    return (value >> 1) ^ -(value & 1);
+}
+
+static inline size_t flatten_varint_encode(unsigned char* buf, uint64_t value) {
+    unsigned int bits = 64 - __builtin_clzll(value | 1);
+    unsigned int n = (bits + 6) / 7;
+    uint64_t word;
+
+    if(n > 8) {
+        buf[0] = 0;
+        memcpy(buf + 1, &value, sizeof(value));
+        return FLATTEN_VARINT_MAX_SIZE;
+    }
+
+    word = (value << n) | (1ULL << (n - 1));
+    memcpy(buf, &word, n);
+    return n;
+}
+
+static inline const unsigned char* flatten_varint_decode(const unsigned char* buf, uint64_t* value) {
+    unsigned int n;
+    uint64_t word;
+
+    if(__builtin_expect(buf[0] == 0, 0)) {
+        memcpy(value, buf + 1, sizeof(*value));
+        return buf + FLATTEN_VARINT_MAX_SIZE;
+    }
+
+    memcpy(&word, buf, sizeof(word));
+    n = __builtin_ctz(buf[0]) + 1;
+    *value = (word << (64 - 8 * n)) >> (64 - 7 * n);
+    return buf + n;
+}
+
 #endif /* FLATTEN_IMAGE_H */
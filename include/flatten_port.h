@@ -39,6 +39,10 @@
 #error "Missing allocation macros (flat_zalloc/flat_free)"
 #endif
 
+#if !defined(FLATTEN_BSP_AREA_ALLOC) || !defined(FLATTEN_BSP_AREA_FREE)
+#error "Missing allocation macros for image area (FLATTEN_BSP_AREA_*)"
+#endif
+
 #if !defined(EXPORT_FUNC)
 #error "Missing macro for marking exported functions"
 #endif
@@ -15,6 +15,7 @@
 #include "kdump.h"
 #include "flatten.h"
 #include <linux/version.h>
+#include <linux/workqueue.h>
 
 /*******************************
  * LOGGING FMT WRAPPER
@@ -91,6 +92,19 @@ struct kflat_recipe {
     void (*pre_handler)(struct kflat*);
 };
 
+struct kflat_multishot {
+    void* ring;
+    size_t ring_size;
+    unsigned int shots_left;
+    unsigned int slot_count;
+    size_t slot_size;
+    uint64_t min_interval_ns;
+
+    uint64_t completed; /* number of captures written to slots */
+    uint64_t consumed;  /* number of captures handed over to user */
+    struct delayed_work rearm_work;
+};
+
 enum kflat_mode {
     KFLAT_MODE_DISABLED = 0,
     KFLAT_MODE_ENABLED
@@ -110,7 +124,13 @@ struct kflat {
     int use_stop_machine;
     int skip_function_body;
     int debug_flag;
+    struct kflat_multishot multishot;
     wait_queue_head_t dump_ready_wq;
+
+    /* Image not mmaped - drained with read() from the area allocated by flatten_write */
+    bool stream_output;
+    size_t stream_size; /* set once the image is written */
+    size_t stream_pos;
 };
 
 /*******************************
@@ -30,9 +30,9 @@
 #undef LINEAR_MEMORY_ALLOCATOR
 #define LINEAR_MEMORY_ALLOCATOR 1
 #undef FLAT_LINEAR_MEMORY_INITIAL_POOL_SIZE
-#define FLAT_LINEAR_MEMORY_INITIAL_POOL_SIZE (128ULL * 1024 * 1024)
-#undef DEFAULT_ITER_QUEUE_SIZE
-#define DEFAULT_ITER_QUEUE_SIZE (1ULL * 1024 * 1024)
+#define FLAT_LINEAR_MEMORY_INITIAL_POOL_SIZE (8ULL * 1024 * 1024)
+#undef FLAT_LINEAR_MEMORY_MAX_CHUNK_SIZE
+#define FLAT_LINEAR_MEMORY_MAX_CHUNK_SIZE (32ULL * 1024 * 1024)
 
 /* Logging */
 void kflat_dbg_buf_clear(void);
@@ -50,6 +50,17 @@ void kflat_dbg_printf(const char* fmt, ...);
 #define FLATTEN_BSP_FREE(PTR)           kvfree(PTR)
 #define FLATTEN_BSP_VMA_ALLOC(SIZE)     vmalloc(SIZE)
 #define FLATTEN_BSP_VMA_FREE(PTR, SIZE) vfree(PTR)
+#define FLATTEN_BSP_AREA_ALLOC(SIZE)    vmalloc(SIZE)
+#define FLATTEN_BSP_AREA_FREE(PTR)      vfree(PTR)
+
+/* Linear allocator might need a new chunk while running under stop_machine */
+#define FLATTEN_BSP_ZALLOC_CHUNK(SIZE) \
+    ((in_atomic() || irqs_disabled()) ? kzalloc(SIZE, GFP_ATOMIC | __GFP_NOWARN) : kvzalloc(SIZE, GFP_KERNEL))
+/* Largest chunk worth asking for - kzalloc can't go beyond KMALLOC_MAX_SIZE */
+#define FLATTEN_BSP_ZALLOC_CHUNK_MAX                                    \
+    ((in_atomic() || irqs_disabled())                                   \
+         ? (size_t)KMALLOC_MAX_SIZE - sizeof(struct flat_mem_chunk)     \
+         : (size_t)FLAT_LINEAR_MEMORY_MAX_CHUNK_SIZE)
 
 /* Memory validation */
 static __used bool _addr_range_valid(void* ptr, size_t size) {
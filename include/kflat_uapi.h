@@ -22,6 +22,20 @@ struct kflat_ioctl_enable {
     int use_stop_machine;
     int skip_function_body;
     int run_recipe_now;
+
+    /* Multi-shot mode: capture up to shot_count images (more than one enables
+       the mode) into a ring of slot_count slots of the mmaped area. The probe
+       is re-armed no sooner than min_interval_ns after each capture */
+    unsigned int shot_count;
+    unsigned int slot_count;
+    uint64_t min_interval_ns;
+
+    /* Don't use mmaped area, read the image from kflat fd with read() or
+       splice() instead. Until the next enable, read() returns the image
+       rather than the debug log. It blocks until the image is written
+       (fails with EAGAIN with O_NONBLOCK) and fails with EIO when
+       flattening failed */
+    int stream_image;
 };
 
 struct kflat_ioctl_disable {
@@ -37,6 +51,26 @@ struct kflat_ioctl_tests {
     char test_name[128];
 };
 
+/* Header at the beginning of every slot in multi-shot mode. The image
+   itself starts KFLAT_SLOT_HEADER_SIZE bytes after the header */
+struct kflat_slot_header {
+    uint64_t seq;       /* 1-based capture number, 0 while slot is being written */
+    uint64_t timestamp; /* CLOCK_MONOTONIC time of capture in ns */
+    uint64_t size;      /* size of the image stored in slot */
+    int32_t error;
+    uint32_t _reserved;
+};
+
+#define KFLAT_SLOT_HEADER_SIZE 64
+
+struct kflat_ioctl_slot {
+    uint64_t seq;
+    uint64_t offset; /* offset of the image in mmaped area */
+    uint64_t size;
+    int32_t error;
+    uint32_t lost;   /* captures overwritten before being consumed, saturated at UINT32_MAX */
+};
+
 struct kflat_ioctl_mem_map {
     void* buffer;
     size_t size;
@@ -47,6 +81,8 @@ struct kflat_ioctl_mem_map {
 #define KFLAT_TESTS              _IOW('k', 4, struct kflat_ioctl_tests)
 #define KFLAT_MEMORY_MAP         _IOR('k', 5, struct kflat_ioctl_mem_map)
 #define KFLAT_GET_LOADED_RECIPES _IOR('k', 6, char[RECIPE_LIST_BUFF_SIZE])
+#define KFLAT_SLOT_CONSUME       _IOR('k', 7, struct kflat_ioctl_slot)
+#define KFLAT_RELEASE_POOL       _IO('k', 8)
 
 #define KFLAT_MMAP_FLATTEN 0
 #define KFLAT_MMAP_KDUMP   1
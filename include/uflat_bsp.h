@@ -63,6 +63,10 @@ uintptr_t uflat_image_base_addr(void);
 #define FLATTEN_BSP_FREE(PTR)           free(PTR)
 #define FLATTEN_BSP_VMA_ALLOC(SIZE)     mmap(0, SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
 #define FLATTEN_BSP_VMA_FREE(PTR, SIZE) munmap(PTR, SIZE)
+#define FLATTEN_BSP_AREA_ALLOC(SIZE)    malloc(SIZE)
+#define FLATTEN_BSP_AREA_FREE(PTR)      free(PTR)
+#define FLATTEN_BSP_ZALLOC_CHUNK(SIZE)  FLATTEN_BSP_ZALLOC(SIZE)
+#define FLATTEN_BSP_ZALLOC_CHUNK_MAX    ((size_t)FLAT_LINEAR_MEMORY_MAX_CHUNK_SIZE)
 
 /* Memory validation */
 #define ADDR_VALID(PTR)             uflat_test_address_range(flat, (void*)PTR, 1)
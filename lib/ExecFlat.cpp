@@ -50,10 +50,14 @@ void ExecFlat::sigalrm_handler(int signum) { }
 
 ExecFlat::ExecFlat(size_t dump_size, ExecFlatVerbosity log_level) : dump_size(dump_size), log_level(log_level) {
     out_size = 0;
+    shot_count = slot_count = 0;
+    min_interval_ns = 0;
     start_time = std::chrono::system_clock::now();
     LOG(INFO) << "Initializing ExecFlat...";
     open_kflat_node();
-    mmap_kflat();
+    shared_memory = nullptr;
+    if (dump_size > 0)
+        mmap_kflat();
 
     // We need to make sure that the execution stays on the same CPU
     getcpu(&current_cpu, NULL);
@@ -71,7 +75,8 @@ ExecFlat::ExecFlat(size_t dump_size, ExecFlatVerbosity log_level) : dump_size(du
 
 ExecFlat::~ExecFlat() {
     restore_governor();
-    munmap(shared_memory, dump_size);
+    if (shared_memory != nullptr)
+        munmap(shared_memory, dump_size);
     close(kflat_fd);
     LOG(INFO) << "Quitting ExecFlat...";
 }
@@ -93,6 +98,10 @@ void ExecFlat::do_enable(
         opts.use_stop_machine = use_stop_machine;
         opts.skip_function_body = skip_func_body;
         opts.run_recipe_now = run_recipe_now;
+        opts.shot_count = shot_count;
+        opts.slot_count = slot_count;
+        opts.min_interval_ns = min_interval_ns;
+        opts.stream_image = shared_memory == nullptr;
 
         strncpy(opts.target_name, recipe.c_str(), sizeof(opts.target_name) - 1);
 
@@ -200,7 +209,20 @@ void ExecFlat::stop_alarm() {
     alarm(0);
 }
 
+void ExecFlat::set_multishot(unsigned int shots, unsigned int slots, unsigned int min_interval_ms) {
+    // Slots live in the mmaped kflat memory, there's none when the image is streamed
+    if (shots > 1 && dump_size == 0)
+        throw std::runtime_error("Multi-shot mode requires kflat memory to be mmaped (dump_size > 0)");
+
+    shot_count = shots > 1 ? shots : 0;
+    slot_count = slots;
+    min_interval_ns = (uint64_t)min_interval_ms * 1000 * 1000;
+}
+
 void ExecFlat::disable(const fs::path &outfile, int poll_timeout) {
+    if (shot_count > 1)
+        return disable_multishot(outfile, poll_timeout);
+
     struct pollfd kflat_poll;
     kflat_poll.fd = kflat_fd;
     kflat_poll.events = POLLIN | POLLRDNORM;
@@ -223,6 +245,8 @@ void ExecFlat::disable(const fs::path &outfile, int poll_timeout) {
     }
 
     out_size = ret.size;
+    if (shared_memory == nullptr)
+        return save_stream(outfile);
     if (out_size > dump_size) {
         std::stringstream ss;
         ss << "KFLAT produced image larger than the mmaped memory (kernel bug?).\nKernel size: " << out_size << " User size: " << dump_size;
@@ -240,6 +264,135 @@ void ExecFlat::disable(const fs::path &outfile, int poll_timeout) {
     LOG(INFO) << "Recipe successfully executed. Dump saved to " << outfile;
 }
 
+// Move the image from kflat node to the output file through a pipe with splice
+void ExecFlat::save_stream(const fs::path &outfile) {
+    int pipe_fd[2];
+    int out_fd;
+    size_t left = out_size;
+    const char *failure = nullptr;
+
+    out_fd = open(outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        ERRNO_TO_EXCEPTION("Failed to open output file");
+    }
+    if (pipe(pipe_fd)) {
+        close(out_fd);
+        ERRNO_TO_EXCEPTION("Failed to create pipe");
+    }
+
+    while (left > 0 && failure == nullptr) {
+        ssize_t in_pipe = splice(kflat_fd, NULL, pipe_fd[1], NULL, left, SPLICE_F_MOVE);
+        if (in_pipe <= 0) {
+            failure = in_pipe == 0 ? "Image streamed from kflat node is truncated" : "Failed to read image from kflat node";
+            break;
+        }
+        left -= in_pipe;
+
+        while (in_pipe > 0) {
+            ssize_t written = splice(pipe_fd[0], NULL, out_fd, NULL, in_pipe, SPLICE_F_MOVE);
+            if (written <= 0) {
+                failure = "Failed to save memory dump to a file.";
+                break;
+            }
+            in_pipe -= written;
+        }
+    }
+
+    int saved_errno = errno;
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    close(out_fd);
+    if (failure != nullptr) {
+        errno = saved_errno;
+        ERRNO_TO_EXCEPTION(failure);
+    }
+
+    LOG(INFO) << "Recipe successfully executed. Dump streamed to " << outfile;
+}
+
+bool ExecFlat::save_slot(const fs::path &outfile, const struct kflat_ioctl_slot &slot) {
+    if (slot.lost)
+        LOG(WARNING) << slot.lost << " image(s) were overwritten before being saved. Consider using more slots.";
+
+    if (slot.error || slot.size == 0) {
+        LOG(WARNING) << "Capture #" << slot.seq << " failed with error " << slot.error;
+        return false;
+    }
+    if (slot.offset < KFLAT_SLOT_HEADER_SIZE || slot.offset + slot.size > dump_size) {
+        std::stringstream ss;
+        ss << "KFLAT produced slot outside of the mmaped memory (kernel bug?).\nOffset: " << slot.offset << " Size: " << slot.size;
+        throw std::runtime_error(ss.str());
+    }
+
+    fs::path path = outfile;
+    path += "." + std::to_string(slot.seq);
+    std::ofstream file(path, std::ofstream::binary);
+    file.write(shared_memory + slot.offset, slot.size);
+    if (file.bad())
+        throw std::runtime_error("Failed to save memory dump to a file.");
+    file.close();
+
+    // Kernel doesn't wait for us, so the slot could have been reused in the meantime
+    auto hdr = reinterpret_cast<const volatile struct kflat_slot_header *>(shared_memory + slot.offset - KFLAT_SLOT_HEADER_SIZE);
+    if (hdr->seq != slot.seq) {
+        LOG(WARNING) << "Capture #" << slot.seq << " was overwritten while being saved";
+        fs::remove(path);
+        return false;
+    }
+
+    LOG(INFO) << "Capture #" << slot.seq << " saved to " << path;
+    return true;
+}
+
+void ExecFlat::disable_multishot(const fs::path &outfile, int poll_timeout) {
+    struct pollfd kflat_poll;
+    kflat_poll.fd = kflat_fd;
+    kflat_poll.events = POLLIN | POLLRDNORM;
+    unsigned int saved = 0;
+
+    try {
+        while (true) {
+            int ret_poll = poll(&kflat_poll, 1, (poll_timeout ? poll_timeout : -1));
+            if (ret_poll == 0) {
+                LOG(WARNING) << "Poll timeout - finishing multi-shot capture";
+                break;
+            }
+            if (ret_poll == -1) {
+                if (errno == EINTR)
+                    continue;
+                ERRNO_TO_EXCEPTION("Poll failed");
+            }
+
+            struct kflat_ioctl_slot slot;
+            while (ioctl(kflat_fd, KFLAT_SLOT_CONSUME, &slot) == 0)
+                saved += save_slot(outfile, slot);
+            if (errno != EAGAIN)
+                ERRNO_TO_EXCEPTION("KFLAT_SLOT_CONSUME IOCTL failed");
+
+            // All requested shots have been taken and consumed
+            if (kflat_poll.revents & POLLHUP)
+                break;
+        }
+    } catch (...) {
+        // Don't leave the probe armed behind us
+        struct kflat_ioctl_disable ret = {0};
+        int saved_errno = errno;
+        ioctl(kflat_fd, KFLAT_PROC_DISABLE, &ret);
+        errno = saved_errno;
+        throw;
+    }
+
+    struct kflat_ioctl_disable ret = {0};
+    kflat_ioctl_disable(&ret);
+
+    if (saved == 0) {
+        errno = ret.error;
+        ERRNO_TO_EXCEPTION("KFLAT_PROC_DISABLE IOCTL returned: no image was captured in multi-shot mode.");
+    }
+
+    LOG(INFO) << "Recipe successfully executed. " << saved << " dumps saved to " << outfile << ".*";
+}
+
 std::vector<std::string> ExecFlat::get_loaded_recipes() {
     char buf[RECIPE_LIST_BUFF_SIZE];
     std::vector<std::string> recipes;
@@ -298,6 +451,14 @@ void ExecFlat::kflat_ioctl_disable(struct kflat_ioctl_disable *ret) {
     LOG(DEBUG) << "KFLAT_PROC_DISABLE ioctl returned " << r;
 }
 
+void ExecFlat::release_memory_pool() {
+    int r = ioctl(kflat_fd, KFLAT_RELEASE_POOL);
+    if (r != 0)
+         ERRNO_TO_EXCEPTION("Failed to release kflat memory pool");
+
+    LOG(DEBUG) << "KFLAT_RELEASE_POOL ioctl returned " << r;
+}
+
 void ExecFlat::execute_interface(const fs::path &target, ExecFlatInterface interface) {
     int flags = O_RDONLY | O_NONBLOCK;
 
@@ -172,7 +172,8 @@ public:
     /**
      * @brief Construct and initialize a new ExecFlat object.
      * 
-     * @param dump_size Max size of kflat memory dump.
+     * @param dump_size Max size of kflat memory dump. When 0, kflat memory is not mmaped and
+     *      the image is streamed from kflat node once the recipe finishes.
      * @param log_level One of ExecFlatVerbosity enum members.
      */
     ExecFlat(size_t dump_size, ExecFlatVerbosity log_level);
@@ -252,6 +253,23 @@ public:
         int poll_timeout=-1
     );
 
+    /**
+     * @brief Enable multi-shot mode for the following recipe runs. Each captured image
+     *        is saved to a separate file named OUTFILE.<capture number>
+     * 
+     * @param shots Number of images to capture. Values below 2 restore single-shot mode.
+     *        Multi-shot mode needs mmaped kflat memory, so dump_size can't be 0.
+     * @param slots Number of image slots in kflat memory (0 for the default one).
+     * @param min_interval_ms In miliseconds. Minimal interval between two captures.
+     */
+    void set_multishot(unsigned int shots, unsigned int slots=0, unsigned int min_interval_ms=0);
+
+    /**
+     * @brief Free the memory pool that KFLAT keeps between recipe runs. It is
+     *        released automatically when ExecFlat is destroyed.
+     */
+    void release_memory_pool();
+
     /**
      * @brief Read all KFLAT recipes available to execute.
      * 
@@ -271,9 +289,12 @@ private:
     ExecFlatVerbosity log_level;
     int kflat_fd;
     size_t out_size; // Actual size returned by KFLAT LKM
-    char *shared_memory;
+    char *shared_memory; // nullptr when the image is streamed
     std::chrono::system_clock::time_point start_time;
     std::string saved_governor;
+    unsigned int shot_count;
+    unsigned int slot_count;
+    uint64_t min_interval_ns;
 
     // Interfaces
     static int interface_read(int fd);
@@ -302,6 +323,9 @@ private:
         int pid
     );
     void disable(const fs::path &outfile, int poll_timeout);
+    void disable_multishot(const fs::path &outfile, int poll_timeout);
+    bool save_slot(const fs::path &outfile, const struct kflat_ioctl_slot &slot);
+    void save_stream(const fs::path &outfile);
 
     // CPU governor stuff
     fs::path get_governor_path();
@@ -2,230 +2,161 @@
  * @file uflat.c
  * @author Samsung R&D Poland - Mobile Security Group (srpol.mb.sec@samsung.com)
  * @brief Userspace FLAT (UFLAT) API implementation
- * 
+ *
  */
 
-#include "funcsymsutils.h"
-#include "uflat.h"
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-static char *get_current_process_exec_path() {
-	char *buff = (char *) malloc(256);
-	ssize_t buff_len;
-	if ((buff_len = readlink("/proc/self/exe", buff, 255)) != -1) {
-		buff[buff_len] = '\0';
-	}
-	else {
-		FLATTEN_LOG_DEBUG("Failed to read the /proc/self/exe symlink");
-		free(buff);
-		return NULL;
-	}
+#include "funcsymsutils.h"
+#include "uflat.h"
 
-	return buff;
-}
 
+static void *map_current_process_exec(size_t *size) {
+	struct stat st;
+	void *image;
+	int fd;
 
-static Elf64_Shdr *get_section_header_table(FILE *f, Elf64_Ehdr *ehdr) {
-	Elf64_Shdr *sh_table = (Elf64_Shdr *) malloc(SECTION_TABLE_SIZE(ehdr));
-	if (sh_table == NULL) {
-		FLATTEN_LOG_DEBUG("Failed to alloc memory for Section Header Table");
+	fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		FLATTEN_LOG_DEBUG("Failed to open /proc/self/exe");
 		return NULL;
 	}
 
-	fseek(f, ehdr->e_shoff, SEEK_SET);
-	size_t rv = fread(sh_table, sizeof(char), SECTION_TABLE_SIZE(ehdr), f);
-
-	if (rv == 0) {
-		FLATTEN_LOG_DEBUG("Failed to fread Section Header Table");
-		free(sh_table);
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(Elf64_Ehdr)) {
+		FLATTEN_LOG_DEBUG("Failed to stat /proc/self/exe");
+		close(fd);
 		return NULL;
 	}
 
-	return sh_table;
-}
-
-/*
-* This string table is used for the names of sections.
-*/
-static char *get_section_header_string_table(FILE *f, Elf64_Shdr *sh_table, size_t shstrtab_idx, size_t *str_tab_size) {
-	Elf64_Shdr *sh_str_tab_hdr = &sh_table[shstrtab_idx];
-	char *sh_str_tab = (char *) malloc(sh_str_tab_hdr->sh_size);
-
-	if (sh_str_tab == NULL) {
-		FLATTEN_LOG_DEBUG("Failed to alloc memory for .shstrtab");
-		return NULL;
-	}
-
-	*str_tab_size = sh_str_tab_hdr->sh_size;
-
-	fseek(f, sh_str_tab_hdr->sh_offset, SEEK_SET);
-	size_t rv = fread(sh_str_tab, sizeof(char), sh_str_tab_hdr->sh_size, f);
-	
-	if (rv == 0) {
-		FLATTEN_LOG_DEBUG("Failed to fread .shstrtab");
-		free(sh_str_tab);
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) {
+		FLATTEN_LOG_DEBUG("Failed to mmap /proc/self/exe");
 		return NULL;
 	}
 
-	return sh_str_tab;
+	*size = st.st_size;
+	return image;
 }
 
 
-static Elf64_Sym *get_sym_tab(FILE *f, Elf64_Shdr *sh_table, size_t sh_table_size, size_t *sym_tab_num) {
-	Elf64_Shdr *symtab_hdr;
-	int symtab_idx = -1;
-
-	for (size_t i = 0; i < sh_table_size; i++) {
-		if (sh_table[i].sh_type == SHT_SYMTAB) {
-			symtab_idx = i;
-			break;
-		}
-	}
+static bool is_valid_range(size_t image_size, size_t offset, size_t size) {
+	return offset <= image_size && size <= image_size - offset;
+}
 
-	if (symtab_idx == -1) {
-		FLATTEN_LOG_DEBUG("Failed to find .symtab in ELF file");
-		return NULL;
-	}
-	
 
-	symtab_hdr = &sh_table[symtab_idx];
-	*sym_tab_num = symtab_hdr->sh_size / symtab_hdr->sh_entsize;
+static Elf64_Shdr *get_section_header_table(void *image, size_t image_size) {
+	Elf64_Ehdr *ehdr = ELF_HEADER(image);
 
-	Elf64_Sym *symtab = (Elf64_Sym *) malloc(symtab_hdr->sh_size);
-	if (symtab == NULL) {
-		FLATTEN_LOG_DEBUG("Failed to alloc memory for .symtab");
+	if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) || ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+		FLATTEN_LOG_DEBUG("Current process executable is not a 64-bit ELF file");
 		return NULL;
 	}
 
-	fseek(f, symtab_hdr->sh_offset, SEEK_SET);
-	size_t rv = fread(symtab, sizeof(char), sh_table[symtab_idx].sh_size, f);
-
-	if (rv == 0) {
-		FLATTEN_LOG_DEBUG("Failed to fread .symtab");
-		free(symtab);
+	if (ehdr->e_shentsize != sizeof(Elf64_Shdr) ||
+			!is_valid_range(image_size, ehdr->e_shoff, SECTION_TABLE_SIZE(ehdr))) {
+		FLATTEN_LOG_DEBUG("Invalid Section Header Table");
 		return NULL;
 	}
 
-	return symtab;
+	return (Elf64_Shdr *) ((char *) image + ehdr->e_shoff);
 }
 
 
 /*
-* This string table is used for the names of .symtab symbols. 
+* The string table with names of .symtab symbols is pointed to by the sh_link of .symtab.
 * NOTE. For the names of symbols in .dynsym there is yet another string table that can be found by
 * looking at dynamic tags DT_STRTAB and DT_STRSZ.
 */
+static int get_sym_tab(void *image, size_t image_size, Elf64_Shdr *sh_table, size_t sh_table_size,
+		Elf64_Sym **sym_tab, size_t *sym_tab_num, const char **str_tab, size_t *str_tab_size) {
+	Elf64_Shdr *symtab_hdr = NULL;
+	Elf64_Shdr *strtab_hdr;
 
-static char *get_sym_tab_str_tab(FILE *f, Elf64_Shdr *sh_table, size_t sh_table_size, char *sh_str_tab, size_t shstr_tab_size, size_t *str_tab_size) {
-	Elf64_Shdr *str_tab_hdr = NULL; 
-	for (size_t i = 0; i < sh_table_size; i++){	
-		if (
-				IS_VALID_INDEX(sh_table[i].sh_name, shstr_tab_size) &&
-				strcmp(".strtab", &sh_str_tab[sh_table[i].sh_name]) == 0
-			)
-			str_tab_hdr = &sh_table[i];
+	for (size_t i = 0; i < sh_table_size; i++) {
+		if (sh_table[i].sh_type == SHT_SYMTAB) {
+			symtab_hdr = &sh_table[i];
+			break;
+		}
 	}
 
-	if (str_tab_hdr == NULL) {
-		FLATTEN_LOG_DEBUG("Failed to find .strtab section");
-		return NULL;
+	if (symtab_hdr == NULL) {
+		FLATTEN_LOG_DEBUG("Failed to find .symtab in ELF file");
+		return -1;
 	}
 
-	char *str_tab = (char *) malloc(str_tab_hdr->sh_size);
-	if (str_tab == NULL){
-		FLATTEN_LOG_DEBUG("Failed to alloc memory for .strtab");
-		return NULL;
+	if (symtab_hdr->sh_entsize != sizeof(Elf64_Sym) ||
+			!is_valid_range(image_size, symtab_hdr->sh_offset, symtab_hdr->sh_size) ||
+			!IS_VALID_INDEX(symtab_hdr->sh_link, sh_table_size)) {
+		FLATTEN_LOG_DEBUG("Invalid .symtab section header");
+		return -1;
 	}
-	*str_tab_size = str_tab_hdr->sh_size;
 
-	fseek(f, str_tab_hdr->sh_offset, SEEK_SET);
-	size_t rv = fread(str_tab, sizeof(char), str_tab_hdr->sh_size, f);
+	strtab_hdr = &sh_table[symtab_hdr->sh_link];
+	if (strtab_hdr->sh_size == 0 || !is_valid_range(image_size, strtab_hdr->sh_offset, strtab_hdr->sh_size)) {
+		FLATTEN_LOG_DEBUG("Invalid .strtab section header");
+		return -1;
+	}
 
-	if (rv == 0) {
-		FLATTEN_LOG_DEBUG("Failed to fread .strtab");
-		free(str_tab);
-		return NULL;
+	*sym_tab = (Elf64_Sym *) ((char *) image + symtab_hdr->sh_offset);
+	*sym_tab_num = symtab_hdr->sh_size / symtab_hdr->sh_entsize;
+	*str_tab = (const char *) image + strtab_hdr->sh_offset;
+	*str_tab_size = strtab_hdr->sh_size;
+
+	// Names are used in place, so make sure the last one is terminated
+	if ((*str_tab)[*str_tab_size - 1] != '\0') {
+		FLATTEN_LOG_DEBUG(".strtab is not NULL terminated");
+		return -1;
 	}
 
-	return str_tab;
+	return 0;
 }
 
 
-func_symbol_info *get_symbol_to_name_mapping(size_t *num) {
-	func_symbol_info *func_info_table = NULL;
+struct func_symbol_table *get_symbol_to_name_mapping(void) {
+	struct func_symbol_table *table = NULL;
 	unsigned long base_addr = 0;
-	Elf64_Ehdr *ELF_header = NULL;
 	Elf64_Shdr *sh_table = NULL;
 	Elf64_Sym *sym_tab = NULL;
-	char *sh_str_tab = NULL;
-	char *str_tab = NULL;
-	size_t shstr_tab_size;
+	const char *str_tab = NULL;
 	size_t sym_tab_num;
 	size_t str_tab_size;
 	size_t n_sym = 0;
-	FILE *f = NULL;
-	size_t rv;
-
-	char *filepath = get_current_process_exec_path();
-	if (filepath == NULL) {
-		goto filename_is_null_err;
-	}
 
-	f = fopen(filepath, "r");
-	if (f == NULL){
-		FLATTEN_LOG_DEBUG("Failed to open %s", filepath);
-		goto f_open_err;
-	}
-	free(filepath);
-
-	// Read elf header from the very beginning of the file
-	char ELF_hdr_buff[ELF_HEADER_SIZE];
-	rv = fread(ELF_hdr_buff, sizeof(char), ELF_HEADER_SIZE, f);
-
-	if (rv == 0) {
-		FLATTEN_LOG_DEBUG("Failed to fread the ELF header");
-		goto elf_hdr_read_err;
-	}
+	table = (struct func_symbol_table *) calloc(1, sizeof(*table));
+	if (table == NULL)
+		return NULL;
 
-	ELF_header = ELF_HEADER(ELF_hdr_buff);
+	table->image = map_current_process_exec(&table->image_size);
+	if (table->image == NULL)
+		goto err;
 
 	// Read Section Header Table
-	sh_table = get_section_header_table(f, ELF_header);
-	if (sh_table == NULL) {
-        goto sh_table_read_err;
-	}
-	
-	// Find the section containing names of all sections (.shstrtab)
-	
-	sh_str_tab = get_section_header_string_table(f, sh_table, ELF_header->e_shstrndx, &shstr_tab_size);
-	if (sh_str_tab == NULL) {
-        goto sh_str_tab_read_err;
+	sh_table = get_section_header_table(table->image, table->image_size);
+	if (sh_table == NULL)
+		goto err;
+
+	// Find all symbols from .symtab and their names in .strtab
+	if (get_sym_tab(table->image, table->image_size, sh_table, ELF_HEADER(table->image)->e_shnum,
+			&sym_tab, &sym_tab_num, &str_tab, &str_tab_size))
+		goto err;
+
+	if (sym_tab_num > UINT32_MAX - 1) {
+		FLATTEN_LOG_DEBUG("Too many symbols in .symtab (%zu)", sym_tab_num);
+		goto err;
 	}
 
-	// Read all symbols from .symtab
-	
-	sym_tab = get_sym_tab(f, sh_table, ELF_header->e_shnum, &sym_tab_num);
-	if (sym_tab == NULL) {
-        goto sym_tab_read_err;
-	}
-
-	// Read names of .symtab symbols from .strtab
-	
-	str_tab = get_sym_tab_str_tab(f, sh_table, ELF_header->e_shnum, sh_str_tab, shstr_tab_size, &str_tab_size);
-	if (str_tab == NULL) {
-        goto str_tab_read_err;
-	}
-	
-	
-
 	// Extract only relevant info - name and symbol value (relative address)
-	func_info_table = (func_symbol_info *) calloc(sym_tab_num, sizeof(func_symbol_info));
+	table->symbols = (func_symbol_info *) calloc(sym_tab_num ? sym_tab_num : 1, sizeof(func_symbol_info));
+	if (table->symbols == NULL)
+		goto err;
 
-	if (func_info_table == NULL) {
-		goto func_info_table_alloc_err;
-	}
-	
-	
 	for (size_t i = 0; i < sym_tab_num; i++) {
 		if (
 				IS_VALID_INDEX(sym_tab[i].st_name, str_tab_size) &&
@@ -242,46 +173,101 @@ func_symbol_info *get_symbol_to_name_mapping(size_t *num) {
 
 	for (size_t i = 0; i < sym_tab_num; i++) {
 		// Skip if empty name or address == 0
-		if (str_tab[sym_tab[i].st_name] != '\0' && sym_tab[i].st_value != 0){
-			func_info_table[n_sym].address = base_addr + sym_tab[i].st_value;
-			func_info_table[n_sym].name = strdup(&str_tab[sym_tab[i].st_name]);
+		if (IS_VALID_INDEX(sym_tab[i].st_name, str_tab_size) &&
+				str_tab[sym_tab[i].st_name] != '\0' && sym_tab[i].st_value != 0) {
+			table->symbols[n_sym].address = base_addr + sym_tab[i].st_value;
+			table->symbols[n_sym].name = &str_tab[sym_tab[i].st_name];
 			n_sym++;
 		}
 	}
 
-
 	// Update number of entries
-	*num = n_sym;
-
-filename_is_null_err:
-func_info_table_alloc_err:
-	free(str_tab);
-str_tab_read_err:
-	free(sym_tab);
-sym_tab_read_err:
-	free(sh_str_tab);
-sh_str_tab_read_err:
-	free(sh_table);
-sh_table_read_err:
-elf_hdr_read_err:
-	fclose(f);
-f_open_err:
-
-	return func_info_table;
+	table->n_entries = n_sym;
+	return table;
+
+err:
+	cleanup_symbol_to_name_mapping(table);
+	return NULL;
 }
 
 
+/*
+* Lookup indexes
+*/
+static int compare_by_address(const void *a, const void *b, void *arg) {
+	const func_symbol_info *symbols = (const func_symbol_info *) arg;
+	uint32_t ia = *(const uint32_t *) a;
+	uint32_t ib = *(const uint32_t *) b;
+
+	if (symbols[ia].address != symbols[ib].address)
+		return symbols[ia].address < symbols[ib].address ? -1 : 1;
+	// Aliases resolve to the one that comes first in .symtab
+	return (ia > ib) - (ia < ib);
+}
+
+static int build_address_index(struct func_symbol_table *table) {
+	table->by_address = (uint32_t *) malloc((table->n_entries ? table->n_entries : 1) * sizeof(uint32_t));
+	if (table->by_address == NULL)
+		return -1;
 
+	for (size_t i = 0; i < table->n_entries; i++)
+		table->by_address[i] = i;
+	qsort_r(table->by_address, table->n_entries, sizeof(uint32_t), compare_by_address, table->symbols);
+	return 0;
+}
+
+static size_t hash_name(const char *name) {
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	while (*name) {
+		hash ^= (unsigned char) *name++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
 
-unsigned long lookup_func_by_name(func_symbol_info *func_info_table, size_t n_entries, const char *name) {
-	if (func_info_table == NULL) {
+static int build_name_index(struct func_symbol_table *table) {
+	size_t size = 16;
+
+	while (size < table->n_entries * 2)
+		size *= 2;
+
+	table->by_name = (uint32_t *) calloc(size, sizeof(uint32_t));
+	if (table->by_name == NULL)
+		return -1;
+	table->by_name_size = size;
+
+	for (size_t i = 0; i < table->n_entries; i++) {
+		size_t slot = hash_name(table->symbols[i].name) & (size - 1);
+
+		while (table->by_name[slot] != 0) {
+			// Keep the first occurrence of duplicated names
+			if (strcmp(table->symbols[table->by_name[slot] - 1].name, table->symbols[i].name) == 0)
+				break;
+			slot = (slot + 1) & (size - 1);
+		}
+		if (table->by_name[slot] == 0)
+			table->by_name[slot] = i + 1;
+	}
+	return 0;
+}
+
+
+unsigned long lookup_func_by_name(struct func_symbol_table *table, const char *name) {
+	if (table == NULL) {
+		return 0;
+	}
+
+	if (table->by_name == NULL && build_name_index(table)) {
+		FLATTEN_LOG_DEBUG("Failed to build symbol name index");
 		return 0;
 	}
 
-	size_t name_len = strlen(name);
-	for (size_t i = 0; i < n_entries; i++) {
-		if (strlen(func_info_table[i].name) == name_len && strncmp(func_info_table[i].name, name, name_len) == 0) {
-			return func_info_table[i].address;
+	size_t mask = table->by_name_size - 1;
+	for (size_t slot = hash_name(name) & mask; table->by_name[slot] != 0; slot = (slot + 1) & mask) {
+		const func_symbol_info *sym = &table->symbols[table->by_name[slot] - 1];
+		if (strcmp(sym->name, name) == 0) {
+			return sym->address;
 		}
 	}
 
@@ -289,30 +275,43 @@ unsigned long lookup_func_by_name(func_symbol_info *func_info_table, size_t n_en
 }
 
 
-const char *lookup_func_by_address(func_symbol_info *func_info_table, size_t n_entries, unsigned long address) {
-	if (func_info_table == NULL) {
+const char *lookup_func_by_address(struct func_symbol_table *table, unsigned long address) {
+	if (table == NULL) {
 		return NULL;
 	}
 
-	for (size_t i = 0; i < n_entries; i++) {
-		if (address == func_info_table[i].address) {
-			return func_info_table[i].name;
-		}
+	if (table->by_address == NULL && build_address_index(table)) {
+		FLATTEN_LOG_DEBUG("Failed to build symbol address index");
+		return NULL;
+	}
+
+	// Find the first entry with address not lower than the requested one
+	size_t lo = 0, hi = table->n_entries;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (table->symbols[table->by_address[mid]].address < address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < table->n_entries && table->symbols[table->by_address[lo]].address == address) {
+		return table->symbols[table->by_address[lo]].name;
 	}
 
 	return NULL;
 }
 
 
-void cleanup_symbol_to_name_mapping(func_symbol_info *func_info_table, size_t n_entries) {
-	if (func_info_table == NULL) {
+void cleanup_symbol_to_name_mapping(struct func_symbol_table *table) {
+	if (table == NULL) {
 		return;
 	}
 
-	for (size_t i = 0; i < n_entries; i++) {
-		free(func_info_table[i].name);
-	}
-
-	free(func_info_table);
+	free(table->by_name);
+	free(table->by_address);
+	free(table->symbols);
+	if (table->image != NULL)
+		munmap(table->image, table->image_size);
+	free(table);
 }
-
@@ -2,6 +2,7 @@
 #define FUNCSYMSUTILS_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <elf.h>
 #include <malloc.h>
@@ -9,12 +10,9 @@
 #include <string.h>
 
 #define ELF_HEADER(__buff) ((Elf64_Ehdr *)(__buff))
-#define SECTION_TABLE_START(__sh_table) ((void *) (__sh_table))
 #define SECTION_TABLE_SIZE(__elf_header) ((__elf_header)->e_shentsize * (__elf_header)->e_shnum)
 #define IS_VALID_INDEX(__idx, __max) ((__idx) >= 0 && (__idx) < (__max))
 
-#define ELF_HEADER_SIZE 64
-
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -25,55 +23,69 @@ extern "C" {
 
 /**
  * @brief Symbol name to symbol address mapping.
- * 
+ *
  */
 typedef struct {
 	unsigned long address;
-	char *name;
+	const char *name;	/* Points into the mmapped .strtab section */
 } func_symbol_info;
 
+/**
+ * @brief Symbols of the current process together with lookup indexes.
+ *
+ */
+struct func_symbol_table {
+	func_symbol_info *symbols;	/* In .symtab order */
+	size_t n_entries;
+
+	/* Built on the first lookup_func_by_address call */
+	uint32_t *by_address;		/* Indexes of symbols sorted by address */
+
+	/* Built on the first lookup_func_by_name call */
+	uint32_t *by_name;			/* Open addressing hash table of (index + 1) */
+	size_t by_name_size;
+
+	void *image;				/* Executable file mmapped in place */
+	size_t image_size;
+};
+
 /***********************
  * Exported functions
 ************************/
 
 /**
- * @brief Create array of func_symbol_info variables with mapping of all .symtab symbols defined in the current process. 
- * 
- * @param num OUTPUT - number of entries in returned array.
- * @return func_symbol_info* Pointer to the func_symbol_info array.
+ * @brief Map the executable of the current process and collect all .symtab symbols defined in it.
+ *   Symbol names are not copied - they stay valid until cleanup_symbol_to_name_mapping is called.
+ *
+ * @return struct func_symbol_table* Pointer to the symbol table or NULL in case of an error.
  */
-func_symbol_info *get_symbol_to_name_mapping(size_t *num);
+struct func_symbol_table *get_symbol_to_name_mapping(void);
 
 /**
  * @brief Extract the address of a symbol with a given name.
- * 
- * @param func_info_table Pointer to array created with func_symbol_info *get_symbol_to_name_mapping;
-.
- * @param n_entries Number of funcInfoTable entries.
+ *
+ * @param table Pointer to the table created with get_symbol_to_name_mapping.
  * @param name Symbol name
  * @return unsigned long Address of a symbol
  */
-unsigned long lookup_func_by_name(func_symbol_info *func_info_table, size_t n_entries, const char *name);
+unsigned long lookup_func_by_name(struct func_symbol_table *table, const char *name);
 
 /**
  * @brief Extract the name of a symbol at a given address.
- * 
- * @param func_info_table Pointer to array created with func_symbol_info *get_symbol_to_name_mapping;
-.
- * @param n_entries Number of func_info_table entries.
+ *
+ * @param table Pointer to the table created with get_symbol_to_name_mapping.
  * @param address Symbol address
  * @return const char* Name of a symbol
  */
-const char *lookup_func_by_address(func_symbol_info *func_info_table, size_t n_entries, unsigned long address);
+const char *lookup_func_by_address(struct func_symbol_table *table, unsigned long address);
 
 
 /**
- * @brief Free all the memory used to store symbol info. NOTE. All symbol names returned by lookup_func_by_address are freed and become invalid after calling this function. 
- * 
- * @param func_info_table Pointer to array created with get_symbol_to_name_mapping.
- * @param n_entries Number of func_info_table entries.
+ * @brief Free all the memory used to store symbol info. NOTE. All symbol names returned by lookup_func_by_address are freed and become invalid after calling this function.
+ *
+ * @param table Pointer to the table created with get_symbol_to_name_mapping.
  */
-void cleanup_symbol_to_name_mapping(func_symbol_info *func_info_table, size_t n_entries);
+void cleanup_symbol_to_name_mapping(struct func_symbol_table *table);
 
 
 #ifdef __cplusplus
@@ -16,6 +16,7 @@
 #include <limits.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "uflat.h"
@@ -24,6 +25,9 @@ enum mem_prot {
     UFLAT_MEM_PROT_READ     = (1 << 0),
     UFLAT_MEM_PROT_WRITE    = (1 << 1),
     UFLAT_MEM_PROT_EXEC     = (1 << 2),
+
+    /* Range detected by probing - only read access is known */
+    UFLAT_MEM_PROBED        = (1 << 3),
 };
 
 struct udump_memory_node {
@@ -35,8 +39,18 @@ struct udump_memory_node {
     uint16_t prot;
 };
 
+#define UDUMP_NEG_CACHE_SIZE   64
+#define UDUMP_PROBE_BATCH_SIZE 256
+
 struct udump_memory_map {
     struct rb_root_cached imap_root;
+    size_t page_size;
+
+    /* Pages recently found to be inaccessible (page address + 1) */
+    uintptr_t neg_cache[UDUMP_NEG_CACHE_SIZE];
+
+    /* process_vm_readv is not available, fallback to parsing procfs */
+    bool probe_unsupported;
 };
 
 
@@ -49,8 +63,8 @@ int udump_dump_vma(struct udump_memory_map* mem);
  */
 volatile int debug_flag = false;
 int verbose_flag = false;
-func_symbol_info *func_sym_table = NULL;
-size_t func_sym_table_n_entries = 0;
+struct func_symbol_table *func_sym_table = NULL;
+static bool func_sym_table_loaded = false;
 
 struct uflat* uflat_init(const char* path) {
     int rv;
@@ -69,6 +83,7 @@ struct uflat* uflat_init(const char* path) {
         return UFLAT_ERR_PTR(ENOMEM);
     }
 
+    uflat->udump_memory->page_size = sysconf(_SC_PAGESIZE);
     rv = udump_dump_vma(uflat->udump_memory);
     if (rv) {
         FLATTEN_LOG_ERROR("Failed to initialize uflat - udump_dump_vma returned (%d)", rv);
@@ -112,9 +127,6 @@ struct uflat* uflat_init(const char* path) {
     uflat->flat.area = uflat->out_mem;
     uflat->flat.size = uflat->out_size;
 
-    // Initialize symbol address resolution engine
-    func_sym_table = get_symbol_to_name_mapping(&func_sym_table_n_entries);
-
     return uflat;
 
 err_mmap:
@@ -142,7 +154,9 @@ void uflat_fini(struct uflat* uflat) {
     free(uflat->udump_memory);
     free(uflat);
 
-    cleanup_symbol_to_name_mapping(func_sym_table, func_sym_table_n_entries);
+    cleanup_symbol_to_name_mapping(func_sym_table);
+    func_sym_table = NULL;
+    func_sym_table_loaded = false;
 
     FLATTEN_LOG_DEBUG("Deinitialized uflat");
 }
@@ -196,6 +210,10 @@ int uflat_set_option(struct uflat* uflat, enum uflat_options option, unsigned lo
         case UFLAT_OPT_SKIP_MEM_COPY:
             uflat->flat.FLCTRL.mem_copy_skip = value & 1;
             break;
+
+        case UFLAT_OPT_COMPACT_TABLES:
+            uflat->flat.FLCTRL.compact_tables = value & 1;
+            break;
         
         default:
             FLATTEN_LOG_ERROR("Invalid option provided to uflat_set_option (%d)", option);
@@ -396,6 +414,9 @@ int udump_dump_vma(struct udump_memory_map* mem) {
     free(line);
     fclose(fp);
 
+    // Fresh snapshot - forget everything we've learnt about unmapped pages
+    memset(mem->neg_cache, 0, sizeof(mem->neg_cache));
+
     if(count <= 0) {
         FLATTEN_LOG_ERROR("Failed to parse any line (count == 0)");
         return -EFAULT;
@@ -405,15 +426,161 @@ int udump_dump_vma(struct udump_memory_map* mem) {
     return 0;
 }
 
-static size_t uflat_test_address(struct uflat* uflat, void* ptr, size_t size) {
+static void udump_refresh_vma(struct udump_memory_map* mem) {
+    udump_destroy(mem);
+    udump_dump_vma(mem);
+}
+
+/*
+ * Negative lookup cache
+ *  Direct mapped cache of pages that turned out to be inaccessible.
+ *  Flattened structures often contain the same garbage pointers multiple
+ *  times, so there's no need to probe them again. Cache is dropped whenever
+ *  VMA snapshot is rebuilt from procfs. Memory mapped at such page after it
+ *  has been probed won't be noticed until then
+ */
+static inline size_t udump_neg_cache_slot(struct udump_memory_map* mem, uintptr_t page) {
+    return (page / mem->page_size) % UDUMP_NEG_CACHE_SIZE;
+}
+
+static bool udump_neg_cache_test(struct udump_memory_map* mem, uintptr_t addr) {
+    uintptr_t page = addr & ~(mem->page_size - 1);
+    return mem->neg_cache[udump_neg_cache_slot(mem, page)] == page + 1;
+}
+
+static void udump_neg_cache_add(struct udump_memory_map* mem, uintptr_t addr) {
+    uintptr_t page = addr & ~(mem->page_size - 1);
+    mem->neg_cache[udump_neg_cache_slot(mem, page)] = page + 1;
+}
+
+/*
+ * Check how many consecutive pages starting at page aligned address `addr`
+ *  are readable. Each page is probed by reading a single byte of it with
+ *  process_vm_readv, which reports EFAULT instead of crashing on unmapped
+ *  memory. Returns the number of readable pages or negative error code if
+ *  the probe itself is not supported
+ */
+static ssize_t udump_probe_pages(struct udump_memory_map* mem, uintptr_t addr, size_t pages) {
+    char buf[UDUMP_PROBE_BATCH_SIZE];
+    struct iovec local, remote[UDUMP_PROBE_BATCH_SIZE];
+    size_t done = 0;
+
+    while(done < pages) {
+        ssize_t rv;
+        size_t batch = pages - done;
+        if(batch > UDUMP_PROBE_BATCH_SIZE)
+            batch = UDUMP_PROBE_BATCH_SIZE;
+
+        for(size_t i = 0; i < batch; i++) {
+            remote[i].iov_base = (void*)(addr + (done + i) * mem->page_size);
+            remote[i].iov_len = 1;
+        }
+        local.iov_base = buf;
+        local.iov_len = batch;
+
+        rv = process_vm_readv(getpid(), &local, 1, remote, batch, 0);
+        if(rv < 0) {
+            if(errno == EFAULT)
+                break;
+            return -errno;
+        }
+
+        done += rv;
+        if((size_t)rv < batch)
+            break;
+    }
+
+    return done;
+}
+
+/*
+ * Update VMA snapshot with the range starting at `addr` which is not
+ *  covered by any node yet. Returns the number of bytes added to the
+ *  snapshot or negative error code when the range can't be handled
+ *  without rebuilding the whole snapshot
+ */
+static ssize_t udump_refresh_range(struct udump_memory_map* mem, uintptr_t addr, size_t size) {
+    int rv;
+    ssize_t pages;
+    uintptr_t first, last;
     struct udump_memory_node* node;
 
-    node = memory_tree_iter_first(&uflat->udump_memory->imap_root, (uintptr_t)ptr, (uintptr_t)ptr + size - 1);
-    if(node == NULL || !(node->prot & UFLAT_MEM_PROT_READ))
+    if(mem->probe_unsupported)
+        return -ENOTSUP;
+    if(udump_neg_cache_test(mem, addr))
         return 0;
-    
-    ssize_t remaining = (uintptr_t)node->end - (uintptr_t)ptr + 1;
-    return (remaining < (ssize_t) size) ? remaining : size;
+
+    // Memory is already described by snapshot (but it's not readable).
+    //  Most likely mapping changed, so reparse procfs
+    if(memory_tree_iter_first(&mem->imap_root, addr, addr) != NULL)
+        return -EAGAIN;
+
+    first = addr & ~(mem->page_size - 1);
+    last = ((addr + size - 1) & ~(mem->page_size - 1)) + mem->page_size - 1;
+    if(last < first)
+        last = UINTPTR_MAX;
+
+    node = memory_tree_iter_first(&mem->imap_root, first, last);
+    if(node != NULL)
+        last = node->start - 1;
+
+    pages = udump_probe_pages(mem, first, (last - first) / mem->page_size + 1);
+    if(pages < 0) {
+        FLATTEN_LOG_DEBUG("process_vm_readv is not available (%zd) - falling back to /proc/self/maps", pages);
+        mem->probe_unsupported = true;
+        return pages;
+    } else if(pages == 0) {
+        udump_neg_cache_add(mem, addr);
+        return 0;
+    }
+
+    last = first + pages * mem->page_size - 1;
+    rv = udump_tree_add_range(mem, first, last, UFLAT_MEM_PROT_READ | UFLAT_MEM_PROBED);
+    if(rv)
+        return rv;
+    return last - addr + 1;
+}
+
+/* Get the number of readable bytes at `ptr` (up to `size`) according to VMA snapshot */
+static size_t uflat_test_address(struct uflat* uflat, void* ptr, size_t size) {
+    struct udump_memory_node* node;
+    uintptr_t addr = (uintptr_t)ptr;
+    uintptr_t last = (uintptr_t)ptr + size - 1;
+
+    node = memory_tree_iter_first(&uflat->udump_memory->imap_root, addr, addr);
+    while(node != NULL && (node->prot & UFLAT_MEM_PROT_READ)) {
+        if(node->end >= last)
+            return size;
+
+        // Range might continue in the adjacent VMA
+        addr = node->end + 1;
+        node = memory_tree_iter_first(&uflat->udump_memory->imap_root, addr, addr);
+    }
+
+    return addr - (uintptr_t)ptr;
+}
+
+/* Same as uflat_test_address, but update VMA snapshot when needed */
+static size_t uflat_test_address_refresh(struct uflat* uflat, void* ptr, size_t size) {
+    size_t avail;
+    ssize_t added;
+
+    avail = uflat_test_address(uflat, ptr, size);
+    while(avail < size) {
+        added = udump_refresh_range(uflat->udump_memory, (uintptr_t)ptr + avail, size - avail);
+        if(added < 0) {
+            udump_refresh_vma(uflat->udump_memory);
+            avail = uflat_test_address(uflat, ptr, size);
+            if(avail < size)
+                udump_neg_cache_add(uflat->udump_memory, (uintptr_t)ptr + avail);
+            break;
+        } else if(added == 0)
+            break;
+
+        avail = uflat_test_address(uflat, ptr, size);
+    }
+
+    return avail;
 }
 
 bool uflat_test_address_range(struct flat* flat, void* ptr, size_t size) {
@@ -422,17 +589,9 @@ bool uflat_test_address_range(struct flat* flat, void* ptr, size_t size) {
     if(size == 0 || ptr == NULL)
         return false;
 
-    ssize_t remaining = uflat_test_address(uflat, ptr, size);
-    if(remaining <= 0 || (size_t) remaining < size) {
-        // Check if there are any new mapping
-        udump_destroy(uflat->udump_memory);
-        udump_dump_vma(uflat->udump_memory);
-
-        ssize_t remaining = uflat_test_address(uflat, ptr, size);
-        if(remaining <= 0 || (size_t) remaining < size) {
-            FLATTEN_LOG_INFO("Failed to access memory at %lx@%zu - access violation", (uintptr_t) ptr, size);
-            return false;
-        }
+    if(uflat_test_address_refresh(uflat, ptr, size) < size) {
+        FLATTEN_LOG_INFO("Failed to access memory at %lx@%zu - access violation", (uintptr_t) ptr, size);
+        return false;
     }
 
     return true;
@@ -443,10 +602,10 @@ bool uflat_test_exec_range(struct flat* flat, void* ptr) {
     struct uflat* uflat = container_of(flat, struct uflat, flat);
 
     node = memory_tree_iter_first(&uflat->udump_memory->imap_root, (uintptr_t)ptr, (uintptr_t)ptr);
-    if (node == NULL) {
-        // Check if there are any new mapping
-        udump_destroy(uflat->udump_memory);
-        udump_dump_vma(uflat->udump_memory);
+    if (node == NULL || (node->prot & UFLAT_MEM_PROBED)) {
+        // Probing can't tell whether memory is executable, so check
+        //  if there are any new mappings in procfs
+        udump_refresh_vma(uflat->udump_memory);
 
         node = memory_tree_iter_first(&uflat->udump_memory->imap_root, (uintptr_t)ptr, (uintptr_t)ptr);
         if(node == NULL) {
@@ -469,7 +628,7 @@ __attribute__((no_sanitize("address"))) size_t uflat_test_string_len(struct flat
 	
 	// 1. Fast-path. Check whether first 1000 bytes are maped
 	//  and look for null-terminator in there
-	avail_size = uflat_test_address(uflat, (void*) str, 1000);
+	avail_size = uflat_test_address_refresh(uflat, (void*) str, 1000);
 	if(avail_size == 0)
 		return 0;
 
@@ -485,7 +644,7 @@ __attribute__((no_sanitize("address"))) size_t uflat_test_string_len(struct flat
 		size_t partial_size;
 		size_t off = avail_size;
 
-		partial_size = uflat_test_address(uflat, (char*)str + off, test_size);
+		partial_size = uflat_test_address_refresh(uflat, (char*)str + off, test_size);
 		if(partial_size == 0)
 			return avail_size;
 		avail_size += partial_size;
@@ -508,6 +667,12 @@ size_t flatten_func_to_name(char* name, size_t size, void* func_ptr) {
     Dl_info info;
     static bool not_ready_warn_issued = false;
 
+    // Symbol address resolution engine is initialized on the first use
+    if (!func_sym_table_loaded) {
+        func_sym_table = get_symbol_to_name_mapping();
+        func_sym_table_loaded = true;
+    }
+
     if (func_sym_table == NULL) {
         if(!not_ready_warn_issued) {
             FLATTEN_LOG_ERROR("Failed to initialize symbol address resolution engine");
@@ -533,7 +698,7 @@ size_t flatten_func_to_name(char* name, size_t size, void* func_ptr) {
             return 0;
         }
     
-        const char *symbol_name = lookup_func_by_address(func_sym_table, func_sym_table_n_entries, (unsigned long) func_ptr);
+        const char *symbol_name = lookup_func_by_address(func_sym_table, (unsigned long) func_ptr);
 
         if(symbol_name == NULL) {
             FLATTEN_LOG_INFO("Failed to symbolize function at address %p - no symbol found with given address", func_ptr);
@@ -572,3 +737,4 @@ uintptr_t uflat_image_base_addr(void) {
     number = rand() % UFLAT_IMAGE_SLICE_COUNT;
     return UFLAT_IMAGE_REGION_START + number * UFLAT_IMAGE_SLICE_SIZE;
 }
+
@@ -63,6 +63,10 @@ enum uflat_options {
        but make sure the memory won't change during the process) */
     UFLAT_OPT_SKIP_MEM_COPY,
 
+    /* Delta encode and varint pack pointer and fragment tables (smaller
+       image, decoded when the image is loaded) */
+    UFLAT_OPT_COMPACT_TABLES,
+
     UFLAT_OPT_MAX
 };
 
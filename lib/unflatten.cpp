@@ -13,10 +13,12 @@
 #include <cstring>
 #include <cstdio>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <map>
 #include <vector>
 #include <memory>
@@ -24,18 +26,31 @@
 #include <stdexcept>
 #include <set>
 #include <unordered_set>
+#include <unordered_map>
 
 #include "unflatten.hpp"
 
-#define container_of(ptr, type, member) ({			\
-  	const __typeof__( ((type *)0)->member ) *__mptr = (ptr);	\
-  	(type *)( (char *)__mptr - offsetof(type,member) );})
-
 extern "C" {
-#include "interval_tree_generic.h"
 #include <flatten_image.h>
 }
 
+#if defined(__SANITIZE_ADDRESS__)
+	#define __SUPPORTS_ASAN_POISONING
+#elif defined(__has_feature)
+	#if __has_feature(address_sanitizer)
+		#define __SUPPORTS_ASAN_POISONING
+	#endif
+#endif
+
+#ifdef __SUPPORTS_ASAN_POISONING
+	#include <sanitizer/asan_interface.h>
+	#define POISON_MEMORY_REGION(addr, size)   ASAN_POISON_MEMORY_REGION(addr, size)
+	#define UNPOISON_MEMORY_REGION(addr, size) ASAN_UNPOISON_MEMORY_REGION(addr, size)
+#else
+	#define POISON_MEMORY_REGION(addr, size)   ((void)(addr), (void)(size))
+	#define UNPOISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#endif
+
 #ifdef __has_builtin
 	#if __has_builtin(__builtin_uaddl_overflow)
 		#define __SUPPORTS_BUILTIN_UADDL_OVERFLOW
@@ -49,22 +64,24 @@ extern "C" {
  * Private data types
  *******************************/
 
-struct interval_tree_node {
-	struct rb_node rb;
-	uintptr_t start;	/* Start of interval */
-	uintptr_t last;	/* Last location _in_ interval */
-	uintptr_t __subtree_last;
+struct fragment_node {
+	uintptr_t start;	/* Offset of the fragment in flattened memory */
+	size_t size;
 	void* mptr;
 };
 
-#define START(node) ((node)->start)
-#define LAST(node)  ((node)->last)
-
-#define WITHIN_MEM_BOUNDS(ptr_, type_) ((char *)(ptr_) >= (char *)FLCTRL.mem && (char *)(ptr_) + sizeof(type_) < (char *)FLCTRL.mem + get_memsz())
+/*
+ * With fragment arena every memory fragment is placed in one anonymous mapping.
+ *  Fragments are separated by redzones (poisoned when built with ASAN) and the
+ *  mapping ends with an inaccessible guard page
+ */
+#define FRAGMENT_ALIGNMENT	16
+#define FRAGMENT_REDZONE_SIZE	32
 
-INTERVAL_TREE_DEFINE(struct interval_tree_node, rb,
-		     uintptr_t, __subtree_last,
-		     START, LAST, __attribute__((used)), interval_tree)
+/*
+ * Smallest number of pointers worth handing over to a separate relocation thread
+ */
+#define RELOCATION_MIN_POINTERS_PER_THREAD	2048
 
 struct root_addr_node {
 	uintptr_t root_addr;
@@ -100,6 +117,9 @@ static const char *unflatten_status_messages[UNFLATTEN_STATUS_MAX] = {
 	"Memory allocation failed",
 	"Interval extraction failed",
 	"Memory was already fixed and is loaded at the same address as previously",
+	"Pointer, fragment or function symbol tables are corrupted",
+	"Failed to take snapshot of loaded memory",
+	"No snapshot of loaded memory was taken",
 };
 
 /********************************
@@ -116,32 +136,74 @@ private:
 		LOG_DEBUG,
 	} loglevel;
 	size_t readin;
+	size_t relocation_threads;
 
 	struct FLCONTROL {
 		struct flatten_header HDR;
 
-		struct rb_root_cached imap_root;
 		void* mem;
+		bool mem_allocated;
 		bool is_continous_mode;
 
+		/* Point into mem, or into decoded_tables for compact encoding */
+		const size_t* ptr_table;
+		const size_t* fptr_table;
+		const size_t* fragment_table;
+		size_t* decoded_tables;
+
+		struct fragment_node* fragments;	/* Sorted by start and by mptr */
+		uint32_t* fragment_buckets;	/* First fragment ending at or after each bucket */
+		unsigned int fragment_bucket_shift;
+		uint32_t* fragment_order;	/* Fragments sorted by mptr, NULL in the arena */
+		void* fragment_arena;
+		size_t fragment_arena_size;
+
 		ssize_t last_accessed_root;
 		std::vector<struct root_addr_node> root_addr;
 	} FLCTRL;
 
 	std::map<std::string, std::pair<size_t, size_t>> root_addr_map;
-	std::map<uintptr_t,std::string> fptrmap;
+	// Pointers sorted by target offset, built by the first replace_variable call
+	struct reverse_ptr {
+		size_t target;
+		size_t site;	/* Index in ptr_table */
+	};
+	std::vector<struct reverse_ptr> reverse_index;
+	std::vector<size_t> replaced_ptrs;
+	std::vector<bool> ptr_replaced;
+	bool reverse_index_ready;
+
+	// Unique function symbols and the symbol index of each function pointer
+	std::vector<std::string> fptr_symbols;
+	std::vector<uint32_t> fptr_symbol_index;
 	std::unordered_set<void *> already_freed;
 
+	/*
+	 * Snapshot of loaded memory. Page aligned part of memory is remapped as a private
+	 *  copy of memfd holding the snapshot, so restore only drops the pages modified
+	 *  since then. Partial pages at both ends of continuous memory are kept in
+	 *  snapshot_edges. Separately allocated fragments are copied one after another
+	 *  into fragments
+	 */
+	struct SNAPSHOT {
+		bool taken;
+		void* pages;
+		size_t pages_size;
+		std::vector<char> edges;
+		std::vector<char> fragments;
+		std::vector<struct root_addr_node> root_addr;
+		std::map<std::string, std::pair<size_t, size_t>> root_addr_map;
+		ssize_t last_accessed_root;
+		std::unordered_set<void *> freed;
+	} SNAP;
+
 	struct timeval timeS;
 
 	/***************************
 	 * UTILITIES / MISC
 	 **************************/
 	inline void* flatten_memory_start() const {
-		return (char*) FLCTRL.mem + \
-				FLCTRL.HDR.ptr_count * sizeof(size_t) +  \
-				FLCTRL.HDR.fptr_count * sizeof(size_t) + \
-				FLCTRL.HDR.mcount * 2 * sizeof(size_t);
+		return (char*) FLCTRL.mem + FLCTRL.HDR.tables_size;
 	}
 
 	void time_mark_start() {
@@ -210,11 +272,9 @@ private:
 		if (root_addr == (size_t) -1)
 			return NULL;
 
-		if (interval_tree_iter_first(&FLCTRL.imap_root, 0, ULONG_MAX)) {
+		if (FLCTRL.fragments != NULL && FLCTRL.HDR.mcount > 0) {
 			/* We have allocated each memory fragment individually */
-			struct interval_tree_node *node = interval_tree_iter_first(
-					&FLCTRL.imap_root,
-					root_addr, root_addr + 8);
+			const struct fragment_node *node = fragment_at(root_addr);
 			if (node == NULL)
 				return (void *) UNFLATTEN_INVALID_ROOT_POINTER;
 
@@ -302,17 +362,16 @@ private:
 		UNFLATTEN_OPEN_MMAP,
 		UNFLATTEN_OPEN_READ_COPY,
 		UNFLATTEN_OPEN_MMAP_WRITE,
+		UNFLATTEN_OPEN_MMAP_PRIVATE,
+		UNFLATTEN_OPEN_BUFFER,
 	} open_mode;
 	int opened_file_fd;
 	struct {
-		FILE* opened_file_file;
-
-		struct {
-			void* opened_mmap_addr;
-			size_t opened_mmap_size;
-		};
+		void* opened_mmap_addr;
+		size_t opened_mmap_size;
 	};
-	int current_mmap_offset;
+	bool buffer_owned;
+	size_t current_offset;
 
 	/**
 	 * @brief Main logic behind opening flatten image. Currently we support 3 different
@@ -321,6 +380,10 @@ private:
 	 *     - OPEN_MMAP_WRITE -> mmap input file into current VA as MAP_SHARED (changes
 	 *         to mapped memory affects the underlying file)
 	 *     - OPEN_READ_COPY -> load full flatten image as a copy into our VA
+	 *     - OPEN_MMAP_PRIVATE -> mmap input file at any address as MAP_PRIVATE. Used when
+	 *         image content is going to be copied out anyway (fragment mode), so
+	 *         there's no need to read the whole file into local buffer first
+	 *     - OPEN_BUFFER -> image is already in memory provided by the caller (see open_buffer)
 	 *   Furthermore, we handle 3 FCNTL file-lock states:
 	 *     - O_UNLCK -> no one is using flatten image - we can do whatever we want with it
 	 *     - O_RDLCK -> flatten image is locked for READ - we cannot edit it
@@ -343,20 +406,18 @@ private:
 	 *
 	 *   TL;DR: This function attempts to open input file in the fastest possible mode.
 	 *
-	 * @param f handler to file opened with fopen
+	 * @param fd descriptor of opened image file
 	 * @param support_write_lock flag indicating whether we want to support OPEN_MMAP_WRITE mode
-	 * @param support_mmap whether we want to support any OPEN_MMAP* mode
+	 * @param support_mmap whether we want to support OPEN_MMAP and OPEN_MMAP_WRITE modes
+	 * @param support_private_mmap whether we want to support OPEN_MMAP_PRIVATE mode
 	 */
-	UnflattenStatus open_file(FILE* f, bool support_write_lock = true, bool support_mmap = true) {
-		int fd = fileno(f);
+	UnflattenStatus open_file(int fd, bool support_write_lock = true, bool support_mmap = true, bool support_private_mmap = false) {
 		opened_file_fd = fd;
-		opened_file_file = f;
-		current_mmap_offset = 0;
+		current_offset = 0;
 		UnflattenStatus status;
 		open_mode = UNFLATTEN_OPEN_READ_COPY;
 
 		opened_mmap_size = lseek(fd, 0, SEEK_END);
-		lseek(fd, 0, SEEK_SET);
 
 		int ret = 0;
 		struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0,};
@@ -367,10 +428,10 @@ private:
 			ret = fcntl(fd, F_SETLK, &lock);
 			if(ret >= 0) {
 				// Acquired exclusive write access
-				status = read_file(&FLCTRL.HDR,sizeof(struct flatten_header),1);
+				status = read_header();
 				if (status)
 					return status;
-				fseek(f, 0, SEEK_SET);
+				current_offset = 0;
 				if(!FLCTRL.HDR.last_load_addr){
 					// rewrite image, mmap it and release lock
 					opened_mmap_addr = mmap(NULL, opened_mmap_size,
@@ -396,10 +457,10 @@ private:
 		}
 
 		// At this point we've got read_lock, check header and try to mmap file
-		status = read_file(&FLCTRL.HDR,sizeof(struct flatten_header),1);
+		status = read_header();
 		if (status)
 			return status;
-		fseek(f, 0, SEEK_SET);
+		current_offset = 0;
 		void* mmap_addr = (void*) FLCTRL.HDR.last_load_addr;
 		if(mmap_addr != NULL && support_mmap) {
 			opened_mmap_addr = mmap(mmap_addr, opened_mmap_size,
@@ -413,6 +474,18 @@ private:
 			} else
 				debug("Failed to open input file in mmap mode - %s\n", strerror(errno));
 		}
+
+		if(support_private_mmap) {
+			opened_mmap_addr = mmap(NULL, opened_mmap_size,
+					PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if(opened_mmap_addr != MAP_FAILED) {
+				info("Opened input file in private mmap mode @ %p (size: %p)\n",
+					opened_mmap_addr, opened_mmap_size);
+				open_mode = UNFLATTEN_OPEN_MMAP_PRIVATE;
+				return UNFLATTEN_OK;
+			} else
+				debug("Failed to open input file in private mmap mode - %s\n", strerror(errno));
+		}
 #endif
 		// Mmap failed. The only thing left is to load whole image into memory
 		info("Opened file in copy mode\n");
@@ -420,6 +493,92 @@ private:
 		return UNFLATTEN_OK;
 	}
 
+	/**
+	 * @brief Use image stored in memory. Borrowed buffer is never written to, so in
+	 *   continuous mode its memory area is copied out before relocation. Owned buffer
+	 *   is relocated in place and released with free() by close_file
+	 *
+	 * @param buf pointer to the flatten image
+	 * @param size size of the buffer
+	 * @param owned whether the buffer was allocated with malloc and is passed to us
+	 */
+	void open_buffer(const void* buf, size_t size, bool owned) {
+		opened_file_fd = -1;
+		opened_mmap_addr = (void*)buf;
+		opened_mmap_size = size;
+		buffer_owned = owned;
+		current_offset = 0;
+		open_mode = UNFLATTEN_OPEN_BUFFER;
+	}
+
+	UnflattenStatus read_stream(int fd, void* dst, size_t size) {
+		for (size_t done = 0; done < size; ) {
+			ssize_t rd = read(fd, (char*)dst + done, size - done);
+			if (rd < 0 && errno == EINTR)
+				continue;
+			if (rd <= 0)
+				return UNFLATTEN_TRUNCATED_FILE;
+			done += rd;
+		}
+		return UNFLATTEN_OK;
+	}
+
+	/**
+	 * @brief Read image from non-seekable descriptor (pipe, socket or kflat device
+	 *   in stream mode) in a single pass. Header tells the size of the whole image,
+	 *   so the rest of it is read with large sequential reads straight into one
+	 *   buffer, which is then used as an owned OPEN_BUFFER. Nothing past the end of
+	 *   the image is consumed, so consecutive images can be loaded from one stream
+	 *
+	 * @param fd descriptor to read the image from
+	 */
+	UnflattenStatus open_stream(int fd) {
+		struct flatten_header header;
+		size_t header_size = FLATTEN_HEADER_V2_SIZE;
+		UnflattenStatus status;
+
+		status = read_stream(fd, &header, FLATTEN_HEADER_V2_SIZE);
+		if (status)
+			return status;
+		if (header.magic != KFLAT_IMG_MAGIC)
+			return UNFLATTEN_INVALID_MAGIC;
+
+		if (header.version == KFLAT_IMG_VERSION_V2) {
+			fill_header_v2(&header);
+		} else if (header.version == KFLAT_IMG_VERSION) {
+			header_size = sizeof(struct flatten_header);
+			status = read_stream(fd, (char*)&header + FLATTEN_HEADER_V2_SIZE, header_size - FLATTEN_HEADER_V2_SIZE);
+			if (status)
+				return status;
+		} else {
+			return UNFLATTEN_UNSUPPORTED_MAGIC;
+		}
+
+		// Image is read in one go, so don't trust its size before checking the whole layout.
+		//  There's nothing after the sections of image in the stream
+		size_t sections_size;
+		status = check_header_sections(&header, &sections_size);
+		if (status)
+			return status;
+		if (header.image_size < header_size || header.image_size - header_size != sections_size)
+			return UNFLATTEN_DIFFERENT_IMAGE_SIZE;
+
+		char* image = (char*)malloc(header.image_size);
+		if (image == NULL)
+			return UNFLATTEN_ALLOCATION_FAILED;
+
+		memcpy(image, &header, header_size);
+		status = read_stream(fd, image + header_size, header.image_size - header_size);
+		if (status) {
+			free(image);
+			return status;
+		}
+
+		info("Read %zu bytes of image from stream\n", header.image_size);
+		open_buffer(image, header.image_size, true);
+		return UNFLATTEN_OK;
+	}
+
 	UnflattenStatus close_file() {
 		struct flock lock = { 0,  };
 		lock.l_type = F_UNLCK;
@@ -431,6 +590,7 @@ private:
 		switch(open_mode) {
 			case UNFLATTEN_OPEN_MMAP:
 			case UNFLATTEN_OPEN_MMAP_WRITE:
+			case UNFLATTEN_OPEN_MMAP_PRIVATE:
 				debug("Releasing shared memory @ %p (sz:%zu)\n",
 					opened_mmap_addr, opened_mmap_size);
 				munmap(opened_mmap_addr, opened_mmap_size);
@@ -441,35 +601,47 @@ private:
 				fcntl(opened_file_fd, F_SETLK, &lock);
 			break;
 
+			case UNFLATTEN_OPEN_BUFFER:
+				if (buffer_owned)
+					free(opened_mmap_addr);
+				buffer_owned = false;
+			break;
+
 			default:
 				return UNFLATTEN_FILE_LOCKED;
 		}
 
 		opened_file_fd = -1;
-		opened_file_file = NULL;
 
 		return UNFLATTEN_OK;
 	}
 
 	UnflattenStatus read_file(void* dst, size_t size, size_t n) {
-		size_t rd, total_size;
+		size_t total_size = size * n;
 
 		switch(open_mode) {
 			case UNFLATTEN_OPEN_MMAP:
-			case UNFLATTEN_OPEN_MMAP_WRITE: {
-				total_size = size * n;
-				if (total_size + current_mmap_offset > opened_mmap_size)
+			case UNFLATTEN_OPEN_MMAP_WRITE:
+			case UNFLATTEN_OPEN_MMAP_PRIVATE:
+			case UNFLATTEN_OPEN_BUFFER: {
+				if (total_size + current_offset > opened_mmap_size)
 					return UNFLATTEN_TRUNCATED_FILE;
 
-				memcpy(dst, (char*)opened_mmap_addr + current_mmap_offset, total_size);
-				current_mmap_offset += total_size;
+				memcpy(dst, (char*)opened_mmap_addr + current_offset, total_size);
+				current_offset += total_size;
 			}
 			break;
 
 			case UNFLATTEN_OPEN_READ_COPY: {
-				rd = fread(dst, size, n, opened_file_file);
-				if (rd != n)
-					return UNFLATTEN_TRUNCATED_FILE;
+				for (size_t done = 0; done < total_size; ) {
+					ssize_t rd = pread(opened_file_fd, (char*)dst + done, total_size - done, current_offset + done);
+					if (rd < 0 && errno == EINTR)
+						continue;
+					if (rd <= 0)
+						return UNFLATTEN_TRUNCATED_FILE;
+					done += rd;
+				}
+				current_offset += total_size;
 			}
 			break;
 
@@ -482,6 +654,34 @@ private:
 	}
 
 
+	/**
+	 * @brief Read image header. Header of v2 images lacks tables_size, which
+	 *   is then derived from the number of raw table entries
+	 *
+	 */
+	UnflattenStatus read_header(void) {
+		UnflattenStatus status;
+
+		status = read_file(&FLCTRL.HDR, FLATTEN_HEADER_V2_SIZE, 1);
+		if (status)
+			return status;
+
+		if (FLCTRL.HDR.version == KFLAT_IMG_VERSION_V2) {
+			fill_header_v2(&FLCTRL.HDR);
+			return UNFLATTEN_OK;
+		}
+		return read_file(&FLCTRL.HDR.tables_size, sizeof(struct flatten_header) - FLATTEN_HEADER_V2_SIZE, 1);
+	}
+
+	/**
+	 * @brief Fill the fields that are missing in the header of v2 image
+	 *
+	 */
+	static void fill_header_v2(struct flatten_header* hdr) {
+		hdr->table_encoding = FLATTEN_TABLES_RAW;
+		hdr->tables_size = (hdr->ptr_count + hdr->fptr_count + hdr->mcount * 2) * sizeof(size_t);
+	}
+
 	/***************************
 	 * UNFLATTEN MEMORY
 	 **************************/
@@ -489,31 +689,63 @@ private:
 		if (FLCTRL.HDR.magic != KFLAT_IMG_MAGIC)
 			return UNFLATTEN_INVALID_MAGIC;
 
-		if (FLCTRL.HDR.version != KFLAT_IMG_VERSION)
+		if (FLCTRL.HDR.version != KFLAT_IMG_VERSION && FLCTRL.HDR.version != KFLAT_IMG_VERSION_V2)
 			return UNFLATTEN_UNSUPPORTED_MAGIC;
 
 		if (FLCTRL.HDR.image_size > opened_mmap_size)
 			return UNFLATTEN_DIFFERENT_IMAGE_SIZE;
 
+		size_t total_size;
+		UnflattenStatus status = check_header_sections(&FLCTRL.HDR, &total_size);
+		if (status)
+			return status;
+
+		if (total_size > FLCTRL.HDR.image_size)
+			return UNFLATTEN_MEMORY_SIZE_BIGGER_THAN_IMAGE;
+
+		return UNFLATTEN_OK;
+	}
+
+	/**
+	 * @brief Validate sizes of image sections stored in the header
+	 *
+	 * @param total_size place where the size of all sections following the header is stored
+	 */
+	UnflattenStatus check_header_sections(const struct flatten_header* hdr, size_t* total_size) const {
 		bool overflow = false;
-		overflow |= check_mul_overflow(FLCTRL.HDR.ptr_count, sizeof(size_t));
-		overflow |= check_mul_overflow(FLCTRL.HDR.fptr_count, sizeof(size_t));
-		overflow |= check_mul_overflow(FLCTRL.HDR.root_addr_count, sizeof(size_t));
-		overflow |= check_mul_overflow(FLCTRL.HDR.mcount, 16);
-
-		size_t total_size = 0;
-		overflow |= add_overflow(total_size, FLCTRL.HDR.ptr_count * sizeof(size_t), &total_size);
-		overflow |= add_overflow(total_size, FLCTRL.HDR.fptr_count * sizeof(size_t), &total_size);
-		overflow |= add_overflow(total_size, FLCTRL.HDR.root_addr_count * sizeof(size_t), &total_size);
-		overflow |= add_overflow(total_size, FLCTRL.HDR.root_addr_extended_size, &total_size);
-		overflow |= add_overflow(total_size, FLCTRL.HDR.fptrmapsz, &total_size);
-		overflow |= add_overflow(total_size, FLCTRL.HDR.mcount * 16, &total_size);
-		overflow |= add_overflow(total_size, FLCTRL.HDR.memory_size, &total_size);
+		overflow |= check_mul_overflow(hdr->ptr_count, sizeof(size_t));
+		overflow |= check_mul_overflow(hdr->fptr_count, sizeof(size_t));
+		overflow |= check_mul_overflow(hdr->root_addr_count, sizeof(size_t));
+		overflow |= check_mul_overflow(hdr->mcount, 16);
+
+		size_t raw_tables_size = 0;
+		overflow |= add_overflow(raw_tables_size, hdr->ptr_count * sizeof(size_t), &raw_tables_size);
+		overflow |= add_overflow(raw_tables_size, hdr->fptr_count * sizeof(size_t), &raw_tables_size);
+		overflow |= add_overflow(raw_tables_size, hdr->mcount * 16, &raw_tables_size);
 		if (overflow)
 			return UNFLATTEN_OVERFLOW;
 
-		if (total_size > FLCTRL.HDR.image_size)
-			return UNFLATTEN_MEMORY_SIZE_BIGGER_THAN_IMAGE;
+		switch (hdr->table_encoding) {
+			case FLATTEN_TABLES_RAW:
+				if (hdr->tables_size != raw_tables_size)
+					return UNFLATTEN_INVALID_TABLES;
+				break;
+			case FLATTEN_TABLES_COMPACT:
+				if (hdr->tables_size < FLATTEN_TABLES_PADDING || hdr->tables_size % sizeof(size_t))
+					return UNFLATTEN_INVALID_TABLES;
+				break;
+			default:
+				return UNFLATTEN_UNSUPPORTED_MAGIC;
+		}
+
+		*total_size = 0;
+		overflow |= add_overflow(*total_size, hdr->tables_size, total_size);
+		overflow |= add_overflow(*total_size, hdr->root_addr_count * sizeof(size_t), total_size);
+		overflow |= add_overflow(*total_size, hdr->root_addr_extended_size, total_size);
+		overflow |= add_overflow(*total_size, hdr->fptrmapsz, total_size);
+		overflow |= add_overflow(*total_size, hdr->memory_size, total_size);
+		if (overflow)
+			return UNFLATTEN_OVERFLOW;
 
 		return UNFLATTEN_OK;
 	}
@@ -566,40 +798,198 @@ private:
 	}
 
 	inline size_t get_memsz() {
-		return FLCTRL.HDR.memory_size + \
-			FLCTRL.HDR.ptr_count * sizeof(size_t) + \
-			FLCTRL.HDR.fptr_count * sizeof(size_t) + \
-			FLCTRL.HDR.mcount * 2 * sizeof(size_t);
+		return FLCTRL.HDR.memory_size + FLCTRL.HDR.tables_size;
+	}
+
+	/*
+	 * Decoders of compact tables return the position right after decoded values
+	 *  or NULL when tables ended before all of them were decoded
+	 */
+	static const unsigned char* decode_offsets(const unsigned char* p, const unsigned char* end, size_t* out, size_t count) {
+		size_t offset = 0;
+
+		for (size_t i = 0; i < count; ++i) {
+			uint64_t value;
+			if (p >= end)
+				return NULL;
+			p = flatten_varint_decode(p, &value);
+			offset += flatten_zigzag_decode(value);
+			out[i] = offset;
+		}
+		return p;
+	}
+
+	static const unsigned char* decode_fragments(const unsigned char* p, const unsigned char* end, size_t* out, size_t count) {
+		size_t index = 0;
+
+		for (size_t i = 0; i < count; ++i) {
+			uint64_t value;
+			if (p >= end)
+				return NULL;
+			p = flatten_varint_decode(p, &value);
+			index += flatten_zigzag_decode(value);
+			out[2 * i] = index;
+
+			if (p >= end)
+				return NULL;
+			p = flatten_varint_decode(p, &value);
+			out[2 * i + 1] = value;
+		}
+		return p;
+	}
+
+	/**
+	 * @brief Set up pointer, function pointer and fragment tables. Raw tables are
+	 *   used in place, while compact ones are decoded into a local array
+	 *
+	 */
+	inline UnflattenStatus parse_tables(void) {
+		size_t* tables = (size_t*)FLCTRL.mem;
+
+		if (FLCTRL.HDR.table_encoding == FLATTEN_TABLES_COMPACT) {
+			size_t count = FLCTRL.HDR.ptr_count + FLCTRL.HDR.fptr_count + FLCTRL.HDR.mcount * 2;
+			const unsigned char* p = (const unsigned char*)FLCTRL.mem;
+			const unsigned char* end = p + FLCTRL.HDR.tables_size - FLATTEN_TABLES_PADDING;
+
+			// Every value takes at least one byte
+			if (count > FLCTRL.HDR.tables_size)
+				return UNFLATTEN_INVALID_TABLES;
+
+			tables = FLCTRL.decoded_tables = new(std::nothrow) size_t[count ? count : 1];
+			if (tables == NULL)
+				return UNFLATTEN_ALLOCATION_FAILED;
+
+			p = decode_offsets(p, end, tables, FLCTRL.HDR.ptr_count);
+			if (p)
+				p = decode_offsets(p, end, tables + FLCTRL.HDR.ptr_count, FLCTRL.HDR.fptr_count);
+			if (p)
+				p = decode_fragments(p, end, tables + FLCTRL.HDR.ptr_count + FLCTRL.HDR.fptr_count, FLCTRL.HDR.mcount);
+			if (p == NULL || p > end)
+				return UNFLATTEN_INVALID_TABLES;
+		}
+
+		FLCTRL.ptr_table = tables;
+		FLCTRL.fptr_table = tables + FLCTRL.HDR.ptr_count;
+		FLCTRL.fragment_table = FLCTRL.fptr_table + FLCTRL.HDR.fptr_count;
+		return UNFLATTEN_OK;
 	}
 
 	inline UnflattenStatus parse_mem(void) {
 		size_t memsz = get_memsz();
 
-		switch (open_mode) {
-			case UNFLATTEN_OPEN_READ_COPY:
-				FLCTRL.mem = new(std::nothrow) char[memsz];
-				if (!FLCTRL.mem)
-					return UNFLATTEN_ALLOCATION_FAILED;
+		// Borrowed buffer can't be relocated in place
+		bool copy = open_mode == UNFLATTEN_OPEN_READ_COPY ||
+			(open_mode == UNFLATTEN_OPEN_BUFFER && !buffer_owned && FLCTRL.is_continous_mode);
 
-				read_file(FLCTRL.mem, 1, memsz);
-				break;
-			case UNFLATTEN_OPEN_MMAP:
-			case UNFLATTEN_OPEN_MMAP_WRITE:
-				if (current_mmap_offset + memsz > opened_mmap_size)
-					return UNFLATTEN_TRUNCATED_FILE;
+		if (copy) {
+			FLCTRL.mem = new(std::nothrow) char[memsz];
+			if (!FLCTRL.mem)
+				return UNFLATTEN_ALLOCATION_FAILED;
+			FLCTRL.mem_allocated = true;
 
-				FLCTRL.mem = (char*)opened_mmap_addr + current_mmap_offset;
-				current_mmap_offset += memsz;
-				break;
+			UnflattenStatus status = read_file(FLCTRL.mem, 1, memsz);
+			if (status)
+				return status;
+		} else {
+			if (current_offset + memsz > opened_mmap_size)
+				return UNFLATTEN_TRUNCATED_FILE;
+
+			FLCTRL.mem = (char*)opened_mmap_addr + current_offset;
+			current_offset += memsz;
 		}
 
-		return UNFLATTEN_OK;
+		return parse_tables();
 	}
 
 	inline void release_mem(void) {
-		if(open_mode == UNFLATTEN_OPEN_READ_COPY)
+		if (FLCTRL.mem_allocated)
 			delete[] (char*)FLCTRL.mem;
+		delete[] FLCTRL.decoded_tables;
 		FLCTRL.mem = NULL;
+		FLCTRL.mem_allocated = false;
+		FLCTRL.decoded_tables = NULL;
+		FLCTRL.ptr_table = FLCTRL.fptr_table = FLCTRL.fragment_table = NULL;
+	}
+
+	/*
+	 * Function pointer map consists of unique symbol names followed by
+	 *  the index of symbol for each entry of function pointer table:
+	 *  [count] ([len][name])... [index:uint32_t]...
+	 */
+	UnflattenStatus parse_fptr_symbols(const char* mem, size_t size) {
+		size_t offset = sizeof(size_t);
+		size_t count;
+
+		if (size < sizeof(size_t))
+			return UNFLATTEN_INVALID_TABLES;
+		memcpy(&count, mem, sizeof(size_t));
+
+		for (size_t i = 0; i < count; ++i) {
+			size_t len;
+
+			if (size - offset < sizeof(size_t))
+				return UNFLATTEN_INVALID_TABLES;
+			memcpy(&len, mem + offset, sizeof(size_t));
+			offset += sizeof(size_t);
+
+			if (size - offset < len)
+				return UNFLATTEN_INVALID_TABLES;
+			fptr_symbols.emplace_back(mem + offset, len);
+			offset += len;
+		}
+
+		if ((size - offset) / sizeof(uint32_t) != FLCTRL.HDR.fptr_count ||
+				(size - offset) % sizeof(uint32_t))
+			return UNFLATTEN_INVALID_TABLES;
+
+		fptr_symbol_index.resize(FLCTRL.HDR.fptr_count);
+		memcpy(fptr_symbol_index.data(), mem + offset, size - offset);
+		for (uint32_t index : fptr_symbol_index)
+			if (index >= count)
+				return UNFLATTEN_INVALID_TABLES;
+
+		return UNFLATTEN_OK;
+	}
+
+	/*
+	 * Images v2 store full ([offset][len][name]) entry for each function pointer
+	 */
+	UnflattenStatus parse_fptrmap_v2(const char* mem, size_t size) {
+		std::unordered_map<std::string, uint32_t> index_by_name;
+		std::unordered_map<size_t, uint32_t> index_by_offset;
+		size_t offset = sizeof(size_t);
+		size_t count;
+
+		if (size < sizeof(size_t))
+			return UNFLATTEN_INVALID_TABLES;
+		memcpy(&count, mem, sizeof(size_t));
+
+		for (size_t i = 0; i < count; ++i) {
+			size_t addr, len;
+
+			if (size - offset < 2 * sizeof(size_t))
+				return UNFLATTEN_INVALID_TABLES;
+			memcpy(&addr, mem + offset, sizeof(size_t));
+			memcpy(&len, mem + offset + sizeof(size_t), sizeof(size_t));
+			offset += 2 * sizeof(size_t);
+
+			if (size - offset < len)
+				return UNFLATTEN_INVALID_TABLES;
+			auto it = index_by_name.emplace(std::string(mem + offset, len), fptr_symbols.size());
+			if (it.second)
+				fptr_symbols.push_back(it.first->first);
+			index_by_offset.emplace(addr, it.first->second);
+			offset += len;
+		}
+
+		fptr_symbol_index.assign(FLCTRL.HDR.fptr_count, UINT32_MAX);
+		for (size_t fi = 0; fi < FLCTRL.HDR.fptr_count; ++fi) {
+			auto it = index_by_offset.find(FLCTRL.fptr_table[fi]);
+			if (it != index_by_offset.end())
+				fptr_symbol_index[fi] = it->second;
+		}
+
+		return UNFLATTEN_OK;
 	}
 
 	inline UnflattenStatus parse_fptrmap(void) {
@@ -618,53 +1008,226 @@ private:
 			if (status)
 				return status;
 		} else {
-			if (current_mmap_offset + FLCTRL.HDR.fptrmapsz > opened_mmap_size)
+			if (current_offset + FLCTRL.HDR.fptrmapsz > opened_mmap_size)
 				return UNFLATTEN_TRUNCATED_FILE;
 
-			orig_fptrmapmem = fptrmapmem = (char*)opened_mmap_addr + current_mmap_offset;
-			current_mmap_offset += FLCTRL.HDR.fptrmapsz;
+			orig_fptrmapmem = fptrmapmem = (char*)opened_mmap_addr + current_offset;
+			current_offset += FLCTRL.HDR.fptrmapsz;
 		}
 
-		size_t fptrnum = *(size_t*)fptrmapmem;
-		fptrmapmem += sizeof(size_t);
+		fptr_symbols.clear();
+		fptr_symbol_index.clear();
+		if (FLCTRL.HDR.version == KFLAT_IMG_VERSION_V2)
+			status = parse_fptrmap_v2(fptrmapmem, FLCTRL.HDR.fptrmapsz);
+		else
+			status = parse_fptr_symbols(fptrmapmem, FLCTRL.HDR.fptrmapsz);
+
+		if(open_mode == UNFLATTEN_OPEN_READ_COPY)
+			delete[] orig_fptrmapmem;
+
+		return status;
+	}
+
+	/**
+	 * @brief Split flattened memory into fragments. Each fragment is copied into
+	 *   a separate heap allocation, unless use_arena is set - then all of them
+	 *   are copied into one anonymous mapping
+	 *
+	 */
+	inline UnflattenStatus create_fragments(bool use_arena) {
+		const size_t *minfoptr = FLCTRL.fragment_table;
+		char* memptr = (char*)flatten_memory_start();
+		size_t page_size = sysconf(_SC_PAGESIZE);
+		size_t arena_size = 0;
+		size_t prev_end = 0;
+
+		if (FLCTRL.HDR.mcount > UINT32_MAX)
+			return UNFLATTEN_OVERFLOW;
 
-		for (size_t kvi = 0; kvi < fptrnum; ++kvi) {
-			uintptr_t addr = *(uintptr_t*)fptrmapmem;
-			fptrmapmem += sizeof(uintptr_t);
+		// Validate fragments and calculate the size of target mapping
+		for (size_t i = 0; i < FLCTRL.HDR.mcount; ++i) {
+			size_t index = minfoptr[2 * i];
+			size_t size = minfoptr[2 * i + 1];
+			if (index + size < index)
+				return UNFLATTEN_OVERFLOW;
 
-			size_t sz = *(size_t*)fptrmapmem;
-			fptrmapmem += sizeof(size_t);
+			if (index + size > FLCTRL.HDR.memory_size)
+				return UNFLATTEN_MEMORY_FRAGMENT_DOES_NOT_FIT;
 
-			std::string sym((const char*)fptrmapmem, sz);
-			fptrmapmem += sz;
-			fptrmap.insert(std::pair<uintptr_t, std::string>(addr, sym));
+			// Lookups rely on fragments being sorted and disjoint
+			if (index < prev_end)
+				return UNFLATTEN_INVALID_TABLES;
+			prev_end = index + size;
+
+			arena_size = (arena_size + FRAGMENT_ALIGNMENT - 1) & ~(size_t)(FRAGMENT_ALIGNMENT - 1);
+			if (add_overflow(arena_size, size + FRAGMENT_REDZONE_SIZE, &arena_size))
+				return UNFLATTEN_OVERFLOW;
 		}
+		arena_size = (arena_size + page_size - 1) & ~(page_size - 1);
+		if (add_overflow(arena_size, page_size, &arena_size))
+			return UNFLATTEN_OVERFLOW;
 
-		if(open_mode == UNFLATTEN_OPEN_READ_COPY)
-			delete[] orig_fptrmapmem;
+		// Zeroed, so that release_fragments can tell which fragments were allocated
+		FLCTRL.fragments = new(std::nothrow) struct fragment_node[FLCTRL.HDR.mcount]();
+		if (FLCTRL.fragments == NULL)
+			return UNFLATTEN_ALLOCATION_FAILED;
+
+		// Pick the bucket size, so that there's at most one bucket per fragment
+		unsigned int shift = 0;
+		while ((FLCTRL.HDR.memory_size >> shift) > FLCTRL.HDR.mcount)
+			shift++;
+		size_t bucket_count = (FLCTRL.HDR.memory_size >> shift) + 2;
+		FLCTRL.fragment_bucket_shift = shift;
+		FLCTRL.fragment_buckets = new(std::nothrow) uint32_t[bucket_count];
+		if (FLCTRL.fragment_buckets == NULL)
+			return UNFLATTEN_ALLOCATION_FAILED;
+
+		if (use_arena) {
+			FLCTRL.fragment_arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (FLCTRL.fragment_arena == MAP_FAILED) {
+				FLCTRL.fragment_arena = NULL;
+				return UNFLATTEN_ALLOCATION_FAILED;
+			}
+			FLCTRL.fragment_arena_size = arena_size;
+			mprotect((char*)FLCTRL.fragment_arena + arena_size - page_size, page_size, PROT_NONE);
+		} else {
+			FLCTRL.fragment_order = new(std::nothrow) uint32_t[FLCTRL.HDR.mcount];
+			if (FLCTRL.fragment_order == NULL)
+				return UNFLATTEN_ALLOCATION_FAILED;
+		}
 
+		size_t offset = 0;
+		size_t bucket = 0;
+		for (size_t i = 0; i < FLCTRL.HDR.mcount; ++i) {
+			size_t index = *minfoptr++;
+			size_t size = *minfoptr++;
+			struct fragment_node *node = &FLCTRL.fragments[i];
+
+			node->start = index;
+			node->size = size;
+			if (use_arena) {
+				offset = (offset + FRAGMENT_ALIGNMENT - 1) & ~(size_t)(FRAGMENT_ALIGNMENT - 1);
+				node->mptr = (char*)FLCTRL.fragment_arena + offset;
+				offset += size;
+				POISON_MEMORY_REGION((char*)FLCTRL.fragment_arena + offset, FRAGMENT_REDZONE_SIZE);
+				offset += FRAGMENT_REDZONE_SIZE;
+			} else {
+				node->mptr = new(std::nothrow) char[size];
+				if (node->mptr == NULL)
+					return UNFLATTEN_ALLOCATION_FAILED;
+				FLCTRL.fragment_order[i] = i;
+			}
+			memcpy(node->mptr, memptr + index, size);
+
+			// Fragment i is the first one to reach all the buckets up to its last byte
+			if (size > 0)
+				for (; bucket < bucket_count && (bucket << shift) < index + size; ++bucket)
+					FLCTRL.fragment_buckets[bucket] = i;
+		}
+		for (; bucket < bucket_count; ++bucket)
+			FLCTRL.fragment_buckets[bucket] = FLCTRL.HDR.mcount;
+
+		if (!use_arena)
+			sort_fragment_order();
 		return UNFLATTEN_OK;
 	}
 
 	/**
-	 * @brief Fix all the pointers in flattened memory area
+	 * @brief Sort separately allocated fragments by their address, so that they
+	 *   can be looked up by pointers into the loaded memory
 	 *
 	 */
-	inline UnflattenStatus fix_flatten_mem(bool continuous_mapping) {
-		if(open_mode == UNFLATTEN_OPEN_MMAP) {
-			// Memory was already fixed and is loaded at the same address as previously
-			return UNFLATTEN_ALREADY_FIXED;
+	void sort_fragment_order(void) {
+		struct fragment_node* fragments = FLCTRL.fragments;
+
+		std::sort(FLCTRL.fragment_order, FLCTRL.fragment_order + FLCTRL.HDR.mcount,
+			[fragments](uint32_t a, uint32_t b) {
+				return (uintptr_t)fragments[a].mptr < (uintptr_t)fragments[b].mptr;
+			});
+	}
+
+	/**
+	 * @brief Get i-th fragment in the order of addresses
+	 *
+	 */
+	inline struct fragment_node* fragment_by_address(size_t i) const {
+		return &FLCTRL.fragments[FLCTRL.fragment_order ? FLCTRL.fragment_order[i] : i];
+	}
+
+	/**
+	 * @brief Find the fragment holding given offset of flattened memory. The bucket
+	 *   of offset limits binary search to fragments overlapping that bucket, which
+	 *   usually leaves one or two candidates. Fragments are never modified after
+	 *   create_fragments, so lookups can be done concurrently
+	 *
+	 */
+	inline const struct fragment_node* fragment_at(size_t offset) const {
+		if (offset >= FLCTRL.HDR.memory_size)
+			return NULL;
+
+		size_t bucket = offset >> FLCTRL.fragment_bucket_shift;
+		size_t first = FLCTRL.fragment_buckets[bucket];
+		size_t last = std::min((size_t)FLCTRL.fragment_buckets[bucket + 1], (size_t)FLCTRL.HDR.mcount - 1);
+		if (first >= FLCTRL.HDR.mcount)
+			return NULL;
+
+		// Look for the last fragment starting at or before offset
+		const struct fragment_node* base = &FLCTRL.fragments[first];
+		size_t count = last - first + 1;
+		while (count > 1) {
+			size_t half = count / 2;
+			base = (base[half].start <= offset) ? base + half : base;
+			count -= half;
 		}
 
-		for (size_t i = 0; i < FLCTRL.HDR.ptr_count; ++i) {
-			void* mem = flatten_memory_start();
+		if (offset - base->start >= base->size)
+			return NULL;
+		return base;
+	}
+
+	inline void release_fragments(void) {
+		if (FLCTRL.fragment_arena) {
+			// Shadow memory outlives the mapping, so clear it before the range gets reused
+			UNPOISON_MEMORY_REGION(FLCTRL.fragment_arena, FLCTRL.fragment_arena_size - sysconf(_SC_PAGESIZE));
+			munmap(FLCTRL.fragment_arena, FLCTRL.fragment_arena_size);
+		} else if (FLCTRL.fragments) {
+			for (size_t i = 0; i < FLCTRL.HDR.mcount; ++i) {
+				void* mptr = FLCTRL.fragments[i].mptr;
+				if (already_freed.find(mptr) == already_freed.end())
+					delete[] (char*)mptr;
+			}
+		}
+		delete[] FLCTRL.fragments;
+		delete[] FLCTRL.fragment_buckets;
+		delete[] FLCTRL.fragment_order;
+
+		FLCTRL.fragments = NULL;
+		FLCTRL.fragment_buckets = NULL;
+		FLCTRL.fragment_order = NULL;
+		FLCTRL.fragment_bucket_shift = 0;
+		FLCTRL.fragment_arena = NULL;
+		FLCTRL.fragment_arena_size = 0;
+	}
+
+	/**
+	 * @brief Fix pointers from the range [begin, end) of ptr_table. Fragment index
+	 *   is only read, so disjoint ranges can be fixed concurrently
+	 *
+	 * @param failed place where the index of invalid pointer is stored on error
+	 */
+	UnflattenStatus fix_pointers(size_t begin, size_t end, bool continuous_mapping, size_t* failed) {
+		void* mem = flatten_memory_start();
+
+		for (size_t i = begin; i < end; ++i) {
 			size_t tmp;
+			*failed = i;
 			/*
 			 * Extract fix location from image by accessing i-th element from ptr_array (which is at the start of 'mem' region).
 			 *  Under each fix location there's an offset (measured from FLCTRL.HDR.last_mem_addr) which specifies where that
 			 *  pointer should point to.
 			 */
-			size_t fix_loc = *((size_t*)FLCTRL.mem + i);
+			size_t fix_loc = FLCTRL.ptr_table[i];
 			if (fix_loc + sizeof(size_t) > FLCTRL.HDR.memory_size || add_overflow(fix_loc, sizeof(size_t), &tmp))
 				return UNFLATTEN_INVALID_FIX_LOCATION;
 			uintptr_t ptr = *(uintptr_t*)((char*)mem + fix_loc);
@@ -679,19 +1242,18 @@ private:
 			if (continuous_mapping) {
 				*((void**)((unsigned char*)mem + fix_loc)) = (unsigned char*)mem + ptr;
 			} else {
-				struct interval_tree_node *node = interval_tree_iter_first(&FLCTRL.imap_root, fix_loc, fix_loc + 8);
+				const struct fragment_node *node = fragment_at(fix_loc);
 				if (node == NULL)
 					return UNFLATTEN_INVALID_ADDRESS_POINTEE;
 
 				size_t node_offset = fix_loc - node->start;
-				struct interval_tree_node *ptr_node = interval_tree_iter_first(&FLCTRL.imap_root, ptr, ptr + 8);
+				const struct fragment_node *ptr_node = fragment_at(ptr);
 				if (ptr_node == NULL)
 					return UNFLATTEN_INVALID_ADDRESS_POINTEE;
 
 				/* Make the fix */
 				size_t ptr_node_offset = ptr - ptr_node->start;
-				size_t mptr_size = node->last - node->start + 1;
-				if (node_offset > mptr_size - 8)
+				if (node->size < 8 || node_offset > node->size - 8)
 					return UNFLATTEN_INVALID_OFFSET;
 
 				*((void**)((char*)node->mptr + node_offset)) = (char*)ptr_node->mptr + ptr_node_offset;
@@ -699,6 +1261,95 @@ private:
 				debug("%lx <- %lx (%hhx)\n", fix_loc, ptr, *(unsigned char*)((char*)ptr_node->mptr + ptr_node_offset));
 			}
 		}
+		return UNFLATTEN_OK;
+	}
+
+	struct relocation_job {
+		UnflattenEngine* engine;
+		pthread_t thread;
+		bool started;
+		bool continuous_mapping;
+		size_t begin;
+		size_t end;
+		size_t failed;
+		UnflattenStatus status;
+	};
+
+	static void* relocation_worker(void* arg) {
+		struct relocation_job* job = (struct relocation_job*)arg;
+		job->status = job->engine->fix_pointers(job->begin, job->end, job->continuous_mapping, &job->failed);
+		return NULL;
+	}
+
+	/**
+	 * @brief Split ptr_table evenly between relocation threads. Each pointer is
+	 *   stored at a distinct location, so threads never write to the same memory.
+	 *   Reported error is the one of the first invalid pointer, just like in
+	 *   the sequential case
+	 *
+	 */
+	UnflattenStatus fix_pointers_parallel(size_t threads, bool continuous_mapping) {
+		std::vector<struct relocation_job> jobs(threads);
+		size_t chunk = (FLCTRL.HDR.ptr_count + threads - 1) / threads;
+		UnflattenStatus status = UNFLATTEN_OK;
+		size_t failed = SIZE_MAX;
+
+		for (size_t t = 0; t < threads; ++t) {
+			struct relocation_job* job = &jobs[t];
+			job->engine = this;
+			job->continuous_mapping = continuous_mapping;
+			job->begin = std::min(t * chunk, (size_t)FLCTRL.HDR.ptr_count);
+			job->end = std::min(job->begin + chunk, (size_t)FLCTRL.HDR.ptr_count);
+			job->status = UNFLATTEN_OK;
+			job->started = false;
+
+			// The calling thread takes the first range
+			if (t > 0)
+				job->started = pthread_create(&job->thread, NULL, relocation_worker, job) == 0;
+		}
+
+		for (size_t t = 0; t < threads; ++t) {
+			struct relocation_job* job = &jobs[t];
+			if (job->started)
+				pthread_join(job->thread, NULL);
+			else
+				relocation_worker(job);
+
+			if (job->status != UNFLATTEN_OK && job->failed < failed) {
+				failed = job->failed;
+				status = job->status;
+			}
+		}
+		return status;
+	}
+
+	/**
+	 * @brief Fix all the pointers in flattened memory area
+	 *
+	 */
+	inline UnflattenStatus fix_flatten_mem(bool continuous_mapping) {
+		UnflattenStatus status;
+		size_t threads = relocation_threads;
+		size_t failed;
+
+		if(open_mode == UNFLATTEN_OPEN_MMAP) {
+			// Memory was already fixed and is loaded at the same address as previously
+			return UNFLATTEN_ALREADY_FIXED;
+		}
+
+		if (threads == 0) {
+			long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			threads = cpus > 0 ? cpus : 1;
+		}
+		// Don't bother starting threads for small images
+		threads = std::min(threads, (size_t)FLCTRL.HDR.ptr_count / RELOCATION_MIN_POINTERS_PER_THREAD);
+
+		if (threads > 1)
+			status = fix_pointers_parallel(threads, continuous_mapping);
+		else
+			status = fix_pointers(0, FLCTRL.HDR.ptr_count, continuous_mapping, &failed);
+		if (status)
+			return status;
 
 		// After fixing image, update its base address and change to read-lock
 		if(open_mode == UNFLATTEN_OPEN_MMAP_WRITE) {
@@ -731,11 +1382,26 @@ private:
 
 public:
 	UnflattenEngine(int _level = LOG_NONE) {
-		memset(&FLCTRL.imap_root, 0, sizeof(struct rb_root_cached));
 		memset(&FLCTRL.HDR, 0, sizeof(struct flatten_header));
 		FLCTRL.last_accessed_root = -1;
 		FLCTRL.mem = 0;
+		FLCTRL.mem_allocated = false;
+		FLCTRL.is_continous_mode = false;
+		FLCTRL.ptr_table = FLCTRL.fptr_table = FLCTRL.fragment_table = NULL;
+		FLCTRL.decoded_tables = NULL;
+		FLCTRL.fragments = NULL;
+		FLCTRL.fragment_buckets = NULL;
+		FLCTRL.fragment_bucket_shift = 0;
+		FLCTRL.fragment_order = NULL;
+		FLCTRL.fragment_arena = NULL;
+		FLCTRL.fragment_arena_size = 0;
 		need_unload = false;
+		reverse_index_ready = false;
+		SNAP.taken = false;
+		SNAP.pages = NULL;
+		SNAP.pages_size = 0;
+		buffer_owned = false;
+		relocation_threads = 1;
 		loglevel = (decltype(loglevel))_level;
 	}
 
@@ -744,11 +1410,11 @@ public:
 		if (need_unload)
 			unload();
 
-		status = open_file(f, false);
+		status = open_file(fileno(f), false);
 		if (status)
 			return status;
 
-		status = read_file(&FLCTRL.HDR, sizeof(struct flatten_header), 1);
+		status = read_header();
 		if (status)
 			return status;
 
@@ -802,47 +1468,31 @@ public:
 		if ((!arg) || (!strcmp(arg,"-r")))
 			printf("\n");
 
-		parse_mem();
+		status = parse_mem();
+		if (status)
+			return status;
 
 		if ((!arg) || (!strcmp(arg,"-p"))) {
 			printf("# ptr_count: %zu\n",FLCTRL.HDR.ptr_count);
 			printf("[ ");
-		}
-		for (size_t i = 0; i < FLCTRL.HDR.ptr_count; ++i) {
-			size_t *fix_loc = ((size_t*)FLCTRL.mem + i);
-			if (WITHIN_MEM_BOUNDS(fix_loc, size_t)) {
-				if ((!arg) || (!strcmp(arg,"-p"))) {
-					printf("%zu ", *fix_loc);
-				}
-			}
-		}
-		if ((!arg) || (!strcmp(arg,"-p"))) {
+			for (size_t i = 0; i < FLCTRL.HDR.ptr_count; ++i)
+				printf("%zu ", FLCTRL.ptr_table[i]);
 			printf("]\n\n");
 		}
 
 		if ((!arg) || (!strcmp(arg,"-p"))) {
 			printf("# fptr_count: %zu\n",FLCTRL.HDR.fptr_count);
 			printf("[ ");
-		}
-		for (size_t fi = 0; fi < FLCTRL.HDR.fptr_count; ++fi) {
-			size_t *fptri = ((uintptr_t*)((char*)FLCTRL.mem + FLCTRL.HDR.ptr_count * sizeof(size_t))) + fi;
-			if (WITHIN_MEM_BOUNDS(fptri, size_t)) {
-				if ((!arg) || (!strcmp(arg,"-p"))) {
-					printf("%zu ", *fptri);
-				}
-			}
-		}
-		if ((!arg) || (!strcmp(arg,"-p"))) {
+			for (size_t fi = 0; fi < FLCTRL.HDR.fptr_count; ++fi)
+				printf("%zu ", FLCTRL.fptr_table[fi]);
 			printf("]\n\n");
 		}
 
-		unsigned char* memptr =
-				((unsigned char*)FLCTRL.mem)+FLCTRL.HDR.ptr_count*sizeof(size_t)+FLCTRL.HDR.fptr_count*sizeof(size_t)+
-					FLCTRL.HDR.mcount*2*sizeof(size_t);
+		unsigned char* memptr = (unsigned char*)flatten_memory_start();
 		if ((!arg) || (!strcmp(arg,"-m")) || (!strcmp(arg,"-M"))) {
 			std::set<size_t> fixset;
 			for (size_t i=0; i<FLCTRL.HDR.ptr_count; ++i) {
-				size_t fix_loc = *((size_t*)FLCTRL.mem+i);
+				size_t fix_loc = FLCTRL.ptr_table[i];
 				fixset.insert(fix_loc);
 			}
 			int ptrbyte_count=0;
@@ -898,7 +1548,7 @@ public:
 
 		if ((!arg) || (!strcmp(arg,"-f"))) {
 			printf("# Fragment count: %lu\n",FLCTRL.HDR.mcount);
-			size_t* minfoptr = (size_t*)((char*)FLCTRL.mem + FLCTRL.HDR.ptr_count * sizeof(size_t) + FLCTRL.HDR.fptr_count * sizeof(size_t));
+			const size_t* minfoptr = FLCTRL.fragment_table;
 			for (size_t i = 0; i < FLCTRL.HDR.mcount; ++i) {
 				size_t index = *minfoptr++;
 				size_t size = *minfoptr++;
@@ -909,39 +1559,16 @@ public:
 
 		if ((!arg) || (!strcmp(arg,"-a"))) {
 			printf("# Function pointer map size: %zu\n",FLCTRL.HDR.fptrmapsz);
-			// Compare fptrmapsz with sizeof(size_t) because we later dereference and read size_t fptrnum
-			if (FLCTRL.HDR.fptr_count > 0 && FLCTRL.HDR.fptrmapsz >= sizeof(size_t)) {
-				std::unique_ptr<char[]> fptrmapmem(new(std::nothrow) char[FLCTRL.HDR.fptrmapsz]);
-				size_t offset = 0;
-
-				if (fptrmapmem == nullptr)
-					return UNFLATTEN_ALLOCATION_FAILED;
+			status = parse_fptrmap();
+			if (status)
+				return status;
 
-				status = read_file(fptrmapmem.get(), 1, FLCTRL.HDR.fptrmapsz);
-				if (status)
-					return status;
-				size_t fptrnum = *((size_t*)fptrmapmem.get());
-				printf("# Function pointer count: %zu\n",fptrnum);
-				offset += sizeof(size_t);
-
-				for (size_t kvi=0; kvi < fptrnum; ++kvi) {
-					if (offset + sizeof(uintptr_t) >= FLCTRL.HDR.fptrmapsz)
-						break;
-					uintptr_t addr = *((uintptr_t *)(fptrmapmem.get() + offset));
-					offset += sizeof(uintptr_t);
-
-					if (offset + sizeof(size_t) >= FLCTRL.HDR.fptrmapsz)
-						break;
-
-					size_t sz = *((size_t *)(fptrmapmem.get() + offset));
-					offset += sizeof(size_t);
-
-					if (offset + sz >= FLCTRL.HDR.fptrmapsz)
-						break;
-					std::string sym((const char *)(fptrmapmem.get() + offset), sz);
-					offset += sz;
-					printf("  [%s]: %08lx\n",sym.c_str(),addr);
-				}
+			printf("# Function symbol count: %zu\n", fptr_symbols.size());
+			printf("# Function pointer count: %zu\n", fptr_symbol_index.size());
+			for (size_t fi = 0; fi < fptr_symbol_index.size(); ++fi) {
+				if (fptr_symbol_index[fi] == UINT32_MAX)
+					continue;
+				printf("  [%s]: %08lx\n", fptr_symbols[fptr_symbol_index[fi]].c_str(), FLCTRL.fptr_table[fi]);
 			}
 		}
 
@@ -949,28 +1576,55 @@ public:
 		return UNFLATTEN_OK;
 	}
 
-	UnflattenStatus load(FILE* f, get_function_address_t gfa = NULL, bool continuous_mapping = false) {
+	UnflattenStatus load(int fd, get_function_address_t gfa = NULL, bool continuous_mapping = false,
+			bool fragment_arena = false) {
 		UnflattenStatus status;
 
 		if(need_unload)
 			unload();
 		readin = 0;
 
-		// When continous_mapping is disabled we have to always operate on
-		//  local copy of flatten imaged, because memory chunks are not portable
-		status = open_file(f, continuous_mapping, continuous_mapping);
+		// When continous_mapping is disabled memory chunks are copied out of the
+		//  image, so it's enough to map it privately without any relocation
+		if (lseek(fd, 0, SEEK_CUR) < 0 && errno == ESPIPE)
+			status = open_stream(fd);
+		else
+			status = open_file(fd, continuous_mapping, continuous_mapping, !continuous_mapping);
 		if (status)
 			return status;
 		need_unload = true;
 
+		return load_image(gfa, continuous_mapping, fragment_arena);
+	}
+
+	UnflattenStatus load_from_memory(const void* buf, size_t size, get_function_address_t gfa = NULL,
+			bool continuous_mapping = false, bool take_ownership = false, bool fragment_arena = false) {
+		if(need_unload)
+			unload();
+		readin = 0;
+
+		open_buffer(buf, size, take_ownership);
+		need_unload = true;
+
+		return load_image(gfa, continuous_mapping, fragment_arena);
+	}
+
+	UnflattenStatus load_image(get_function_address_t gfa, bool continuous_mapping, bool fragment_arena) {
+		UnflattenStatus status;
+
 		time_mark_start();
 		// Parse header info and load flattened memory
-		status = read_file(&FLCTRL.HDR, sizeof(struct flatten_header), 1);
+		status = read_header();
 		if (status)
 			return status;
 		status = check_header();
 		if (status)
 			return status;
+
+		if(FLCTRL.HDR.mcount == 0)
+			continuous_mapping = true;
+		FLCTRL.is_continous_mode = continuous_mapping;
+
 		status = parse_root_ptrs();
 		if (status)
 			return status;
@@ -985,38 +1639,13 @@ public:
 		info(" #Unflattening done\n");
 		info(" #Image read time: %lfs\n", time_elapsed());
 
-		if(FLCTRL.HDR.mcount == 0)
-			continuous_mapping = true;
-		FLCTRL.is_continous_mode = continuous_mapping;
-
 		// Convert continous memory into chunked area
 		if(!continuous_mapping) {
 			time_mark_start();
-			size_t *minfoptr = (size_t*)((char*)FLCTRL.mem + FLCTRL.HDR.ptr_count * sizeof(size_t) + FLCTRL.HDR.fptr_count * sizeof(size_t));
-			void *memptr = flatten_memory_start();
 			info(" * memory size: %lu\n", FLCTRL.HDR.memory_size);
-
-			for (size_t i = 0; i < FLCTRL.HDR.mcount; ++i) {
-				size_t index = *minfoptr++;
-				size_t size = *minfoptr++;
-				if (index + size < index)
-					return UNFLATTEN_OVERFLOW;
-
-				if (index + size > FLCTRL.HDR.memory_size)
-					return UNFLATTEN_MEMORY_FRAGMENT_DOES_NOT_FIT;
-
-				struct interval_tree_node *node = new(std::nothrow) struct interval_tree_node;
-				// struct interval_tree_node *node = (struct interval_tree_node*)calloc(1, sizeof(struct interval_tree_node));
-				node->start = index;
-				node->last = index + size - 1;
-				void* fragment = (void *) new(std::nothrow) char[size];
-				if (fragment == NULL)
-					return UNFLATTEN_ALLOCATION_FAILED;
-
-				memcpy(fragment, (char*)memptr + index, size);
-				node->mptr = fragment;
-				interval_tree_insert(node, &FLCTRL.imap_root);
-			}
+			status = create_fragments(fragment_arena);
+			if (status)
+				return status;
 			info(" #Creating chunked memory time: %lfs\n", time_elapsed());
 		}
 
@@ -1029,18 +1658,24 @@ public:
 		// Fix function pointers
 		if (FLCTRL.HDR.fptr_count > 0 && gfa) {
 			void* mem = flatten_memory_start();
-			for (size_t fi = 0; fi < FLCTRL.HDR.fptr_count; ++fi) {
-				size_t fptri = ((uintptr_t*)((char*)FLCTRL.mem + FLCTRL.HDR.ptr_count * sizeof(size_t)))[fi];
-				if (fptrmap.find(fptri) == fptrmap.end())
+
+			// Resolve each symbol once, no matter how many pointers refer to it
+			std::vector<uintptr_t> fptr_addrs(fptr_symbols.size());
+			for (size_t si = 0; si < fptr_symbols.size(); ++si)
+				fptr_addrs[si] = (*gfa)(fptr_symbols[si].c_str());
+
+			for (size_t fi = 0; fi < fptr_symbol_index.size(); ++fi) {
+				size_t fptri = FLCTRL.fptr_table[fi];
+				if (fptr_symbol_index[fi] == UINT32_MAX)
 					continue;
 
 				// Fix function pointer
-				uintptr_t nfptr = (*gfa)(fptrmap[fptri].c_str());
+				uintptr_t nfptr = fptr_addrs[fptr_symbol_index[fi]];
 
 				if(continuous_mapping) {
 					*((void**)((char*)mem + fptri)) = (void*)nfptr;
 				} else {
-					struct interval_tree_node *node = interval_tree_iter_first(&FLCTRL.imap_root, fptri, fptri + 8);
+					const struct fragment_node *node = fragment_at(fptri);
 					if (node == NULL)
 						return UNFLATTEN_INVALID_ADDRESS_POINTEE;
 
@@ -1074,20 +1709,13 @@ public:
 	}
 
 	void unload(void) {
-		struct interval_tree_node* node, *tmp;
+		release_snapshot();
 		release_mem();
-		fptrmap.clear();
-
-		rbtree_postorder_for_each_entry_safe(node, tmp, &FLCTRL.imap_root.rb_root, rb) {
-			// Don't call `interval_tree_remove` here - it might trigger rebalance and
-			//  invalidate iterator. The tree is going to be removed completely so it's
-			//  sufficient to just clear imap_root at the end
-			if (already_freed.find(node->mptr) == already_freed.end())
-				delete (char *) node->mptr;
-
-			delete node;
-		}
-		memset(&FLCTRL.imap_root, 0, sizeof(struct rb_root_cached));
+		release_fragments();
+		fptr_symbols.clear();
+		fptr_symbol_index.clear();
+		already_freed.clear();
+		invalidate_pointer_index();
 
 		FLCTRL.root_addr.clear();
 		root_addr_map.clear();
@@ -1097,7 +1725,333 @@ public:
 	}
 
 	void mark_freed(void *mptr) {
-		already_freed.insert(mptr);
+		if (FLCTRL.fragment_arena == NULL) {
+			already_freed.insert(mptr);
+			return;
+		}
+
+		// Fragments in the arena are never released one by one, but with ASAN we
+		//  can still catch accesses to the memory that external code considers freed
+		struct fragment_node* node = find_fragment(mptr);
+		if (node != NULL && already_freed.insert(mptr).second)
+			POISON_MEMORY_REGION(mptr, node->size);
+	}
+
+	struct fragment_node* find_fragment(void* mptr) {
+		size_t lo = 0, hi = FLCTRL.HDR.mcount;
+
+		if (FLCTRL.fragments == NULL)
+			return NULL;
+
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if ((uintptr_t)fragment_by_address(mid)->mptr < (uintptr_t)mptr)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == FLCTRL.HDR.mcount || fragment_by_address(lo)->mptr != mptr)
+			return NULL;
+		return fragment_by_address(lo);
+	}
+
+	void set_relocation_threads(size_t count) {
+		relocation_threads = count;
+	}
+
+	/**
+	 * @brief Get the memory holding unflattened objects
+	 *
+	 */
+	void get_loaded_memory(char** start, size_t* size) {
+		if (FLCTRL.is_continous_mode) {
+			*start = (char*)flatten_memory_start();
+			*size = FLCTRL.HDR.memory_size;
+		} else {
+			*start = (char*)FLCTRL.fragment_arena;
+			*size = FLCTRL.fragment_arena_size - sysconf(_SC_PAGESIZE);
+		}
+	}
+
+	/**
+	 * @brief Poison redzones after each fragment and fragments marked as freed.
+	 *   Needed after arena pages are replaced by the snapshot mapping
+	 *
+	 */
+	void poison_fragments(void) {
+		if (FLCTRL.is_continous_mode)
+			return;
+
+		for (size_t i = 0; i < FLCTRL.HDR.mcount; ++i) {
+			struct fragment_node* node = &FLCTRL.fragments[i];
+			POISON_MEMORY_REGION((char*)node->mptr + node->size, FRAGMENT_REDZONE_SIZE);
+		}
+		for (void* mptr : already_freed)
+			POISON_MEMORY_REGION(mptr, find_fragment(mptr)->size);
+	}
+
+	void release_snapshot(void) {
+		// Don't leave memfd pages behind in memory that is going to be reused by malloc
+		if (SNAP.pages != NULL && FLCTRL.is_continous_mode)
+			mmap(SNAP.pages, SNAP.pages_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+
+		SNAP.taken = false;
+		SNAP.pages = NULL;
+		SNAP.pages_size = 0;
+		SNAP.edges.clear();
+		SNAP.fragments.clear();
+		SNAP.root_addr.clear();
+		SNAP.root_addr_map.clear();
+		SNAP.freed.clear();
+	}
+
+	UnflattenStatus snapshot(void) {
+		size_t page_size = sysconf(_SC_PAGESIZE);
+		char *start, *end, *pages, *pages_end;
+		size_t size;
+
+		if (!need_unload || FLCTRL.mem == NULL)
+			return UNFLATTEN_UNINITIALIZED_FLCTRL;
+
+		if (!FLCTRL.is_continous_mode && FLCTRL.fragment_arena == NULL) {
+			snapshot_fragments();
+			return UNFLATTEN_OK;
+		}
+
+		get_loaded_memory(&start, &size);
+		end = start + size;
+		pages = std::min((char*)(((uintptr_t)start + page_size - 1) & ~(page_size - 1)), end);
+		pages_end = std::max((char*)((uintptr_t)end & ~(page_size - 1)), pages);
+
+		if (pages_end > pages) {
+			size_t pages_size = pages_end - pages;
+
+			int fd = memfd_create("unflatten-snapshot", MFD_CLOEXEC);
+			if (fd < 0) {
+				info("Failed to create memfd for snapshot - %s\n", strerror(errno));
+				return UNFLATTEN_SNAPSHOT_FAILED;
+			}
+			if (ftruncate(fd, pages_size) < 0) {
+				close(fd);
+				return UNFLATTEN_SNAPSHOT_FAILED;
+			}
+
+			char* copy = (char*)mmap(NULL, pages_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (copy == MAP_FAILED) {
+				close(fd);
+				return UNFLATTEN_SNAPSHOT_FAILED;
+			}
+
+			// Copy fragments one by one to skip poisoned redzones
+			if (FLCTRL.is_continous_mode) {
+				memcpy(copy, pages, pages_size);
+			} else {
+				for (size_t i = 0; i < FLCTRL.HDR.mcount; ++i) {
+					struct fragment_node* node = &FLCTRL.fragments[i];
+					if (already_freed.find(node->mptr) == already_freed.end())
+						memcpy(copy + ((char*)node->mptr - pages), node->mptr, node->size);
+				}
+			}
+			munmap(copy, pages_size);
+
+			// The mapping holds its own reference to memfd
+			void* addr = mmap(pages, pages_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+			close(fd);
+			if (addr == MAP_FAILED) {
+				// Memory can't be trusted any longer
+				info("Failed to map snapshot - %s\n", strerror(errno));
+				release_snapshot();
+				unload();
+				return UNFLATTEN_SNAPSHOT_FAILED;
+			}
+			poison_fragments();
+
+			SNAP.pages = pages;
+			SNAP.pages_size = pages_size;
+		}
+
+		SNAP.edges.assign(start, pages);
+		SNAP.edges.insert(SNAP.edges.end(), pages_end, end);
+		snapshot_state();
+		return UNFLATTEN_OK;
+	}
+
+	void snapshot_state(void) {
+		SNAP.root_addr = FLCTRL.root_addr;
+		SNAP.root_addr_map = root_addr_map;
+		SNAP.last_accessed_root = FLCTRL.last_accessed_root;
+		SNAP.freed = already_freed;
+		SNAP.taken = true;
+	}
+
+	/**
+	 * @brief Copy the contents of separately allocated fragments. Fragments freed
+	 *   before the snapshot are forgotten, so that their addresses, which malloc
+	 *   can hand out again, are never mistaken for live fragments
+	 *
+	 */
+	void snapshot_fragments(void) {
+		size_t total = 0;
+
+		for (size_t i = 0; i < FLCTRL.HDR.mcount; ++i) {
+			struct fragment_node* node = &FLCTRL.fragments[i];
+			if (node->mptr != NULL && already_freed.erase(node->mptr) > 0)
+				node->mptr = NULL;
+			else if (node->mptr != NULL)
+				total += node->size;
+		}
+		sort_fragment_order();
+
+		SNAP.fragments.clear();
+		SNAP.fragments.reserve(total);
+		for (size_t i = 0; i < FLCTRL.HDR.mcount; ++i) {
+			struct fragment_node* node = &FLCTRL.fragments[i];
+			if (node->mptr != NULL)
+				SNAP.fragments.insert(SNAP.fragments.end(), (char*)node->mptr, (char*)node->mptr + node->size);
+		}
+		snapshot_state();
+	}
+
+	struct moved_fragment {
+		uintptr_t old_mptr;
+		const struct fragment_node* node;
+	};
+
+	/**
+	 * @brief Translate address pointing into a fragment allocated again by restore
+	 *
+	 * @param moved fragments sorted by their old address
+	 */
+	static uintptr_t moved_address(uintptr_t addr, const std::vector<struct moved_fragment>& moved) {
+		auto it = std::upper_bound(moved.begin(), moved.end(), addr,
+			[](uintptr_t addr, const struct moved_fragment& entry) {
+				return addr < entry.old_mptr;
+			});
+		if (it == moved.begin())
+			return addr;
+
+		--it;
+		if (addr - it->old_mptr >= it->node->size)
+			return addr;
+		return (uintptr_t)it->node->mptr + (addr - it->old_mptr);
+	}
+
+	/**
+	 * @brief Copy fragments back from the snapshot. Fragments freed by external code
+	 *   after the snapshot was taken are allocated again and pointers into them
+	 *   are moved to the new copies, both in the snapshot and in root pointers
+	 *
+	 */
+	UnflattenStatus restore_fragments(void) {
+		std::vector<struct moved_fragment> moved;
+
+		for (size_t i = 0; i < FLCTRL.HDR.mcount; ++i) {
+			struct fragment_node* node = &FLCTRL.fragments[i];
+			if (node->mptr == NULL || already_freed.find(node->mptr) == already_freed.end())
+				continue;
+
+			char* mem = new(std::nothrow) char[node->size];
+			if (mem == NULL) {
+				// Pointers into fragments allocated so far weren't moved yet
+				unload();
+				return UNFLATTEN_ALLOCATION_FAILED;
+			}
+			moved.push_back({(uintptr_t)node->mptr, node});
+			node->mptr = mem;
+		}
+		already_freed.clear();
+
+		if (!moved.empty()) {
+			std::vector<size_t> snap_offset(FLCTRL.HDR.mcount);
+			size_t offset = 0;
+			for (size_t i = 0; i < FLCTRL.HDR.mcount; ++i) {
+				snap_offset[i] = offset;
+				if (FLCTRL.fragments[i].mptr != NULL)
+					offset += FLCTRL.fragments[i].size;
+			}
+
+			std::sort(moved.begin(), moved.end(),
+				[](const struct moved_fragment& a, const struct moved_fragment& b) {
+					return a.old_mptr < b.old_mptr;
+				});
+			for (size_t i = 0; i < FLCTRL.HDR.ptr_count; ++i) {
+				size_t fix_loc = FLCTRL.ptr_table[i];
+				const struct fragment_node *node = fragment_at(fix_loc);
+				if (node == NULL || node->mptr == NULL)
+					continue;
+
+				uintptr_t ptr;
+				char* site = SNAP.fragments.data() + snap_offset[node - FLCTRL.fragments] + (fix_loc - node->start);
+				memcpy(&ptr, site, sizeof(ptr));
+				ptr = moved_address(ptr, moved);
+				memcpy(site, &ptr, sizeof(ptr));
+			}
+			for (auto& root : SNAP.root_addr)
+				root.root_addr = moved_address(root.root_addr, moved);
+			for (auto& [name, entry] : SNAP.root_addr_map)
+				entry.first = moved_address(entry.first, moved);
+
+			sort_fragment_order();
+		}
+
+		const char* data = SNAP.fragments.data();
+		for (size_t i = 0; i < FLCTRL.HDR.mcount; ++i) {
+			struct fragment_node* node = &FLCTRL.fragments[i];
+			if (node->mptr == NULL)
+				continue;
+			memcpy(node->mptr, data, node->size);
+			data += node->size;
+		}
+		return UNFLATTEN_OK;
+	}
+
+	UnflattenStatus restore(void) {
+		char *start;
+		size_t size;
+
+		if (!SNAP.taken)
+			return UNFLATTEN_NO_SNAPSHOT;
+
+		if (!FLCTRL.is_continous_mode && FLCTRL.fragment_arena == NULL) {
+			UnflattenStatus status = restore_fragments();
+			if (status)
+				return status;
+		} else {
+			// Private pages modified since the snapshot are dropped and read again from memfd
+			if (SNAP.pages != NULL && madvise(SNAP.pages, SNAP.pages_size, MADV_DONTNEED) < 0) {
+				info("Failed to restore snapshot - %s\n", strerror(errno));
+				return UNFLATTEN_SNAPSHOT_FAILED;
+			}
+
+			get_loaded_memory(&start, &size);
+			size_t head_size = SNAP.pages != NULL ? (char*)SNAP.pages - start : SNAP.edges.size();
+			memcpy(start, SNAP.edges.data(), head_size);
+			memcpy(start + size - (SNAP.edges.size() - head_size), SNAP.edges.data() + head_size,
+				SNAP.edges.size() - head_size);
+
+			// Only fragments in the arena are poisoned by mark_freed
+			if (FLCTRL.fragment_arena != NULL)
+				for (void* mptr : already_freed)
+					if (SNAP.freed.find(mptr) == SNAP.freed.end())
+						UNPOISON_MEMORY_REGION(mptr, find_fragment(mptr)->size);
+			already_freed = SNAP.freed;
+		}
+
+		FLCTRL.root_addr = SNAP.root_addr;
+		root_addr_map = SNAP.root_addr_map;
+		FLCTRL.last_accessed_root = SNAP.last_accessed_root;
+
+		// Pointers are back to their snapshot values, rebuild index when needed
+		invalidate_pointer_index();
+		return UNFLATTEN_OK;
+	}
+
+	void invalidate_pointer_index(void) {
+		reverse_index.clear();
+		replaced_ptrs.clear();
+		ptr_replaced.clear();
+		reverse_index_ready = false;
 	}
 
 	void* get_next_root() {
@@ -1121,6 +2075,98 @@ public:
 			unload();
 	}
 
+	/**
+	 * @brief Redirect i-th pointer of ptr_table to new_mem if it points into
+	 *   [old_mem, old_mem + size)
+	 *
+	 * @return ssize_t 1 if pointer was replaced, 0 if not or negative error
+	 */
+	ssize_t replace_pointer(size_t i, void* old_mem, void* new_mem, size_t size) {
+		void* mem = flatten_memory_start();
+		size_t fix_loc = FLCTRL.ptr_table[i];
+		uintptr_t ptr = (uintptr_t)( *(void**)((char*)mem + fix_loc) ) - FLCTRL.HDR.last_mem_addr;
+
+		if(FLCTRL.is_continous_mode) {
+			void* target = (unsigned char*)mem + ptr;
+			if(target >= old_mem && target <= (unsigned char*)old_mem + size - 8) {
+				*(void**)((unsigned char*)mem + fix_loc) = (unsigned char*)new_mem + ((unsigned char*)target - (unsigned char*)old_mem);
+				return 1;
+			}
+		} else {
+
+			const struct fragment_node *node = fragment_at(fix_loc);
+			if (node == NULL)
+				return -UNFLATTEN_INTERVAL_EXTRACTION_FAILED;
+			size_t node_offset = fix_loc-node->start;
+			// Fragments freed before a snapshot are no longer tracked
+			if (node->mptr == NULL)
+				return 0;
+
+			const struct fragment_node *ptr_node = fragment_at(ptr);
+			if (ptr_node == NULL)
+				return -UNFLATTEN_INTERVAL_EXTRACTION_FAILED;
+			size_t ptr_node_offset = ptr-ptr_node->start;
+
+			void* target = (unsigned char*)ptr_node->mptr + ptr_node_offset;
+			if(target >= old_mem && target <= (unsigned char*)old_mem + size - 8) {
+				*((void**)((char*)node->mptr + node_offset)) = (unsigned char*)new_mem + ((unsigned char*)target - (unsigned char*)old_mem);
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	/**
+	 * @brief Build the index of pointers sorted by the offset of their target
+	 *   in flattened memory. Pointers redirected later on by replace_variable
+	 *   are tracked separately in replaced_ptrs
+	 *
+	 */
+	void build_reverse_index(void) {
+		void* mem = flatten_memory_start();
+
+		reverse_index.resize(FLCTRL.HDR.ptr_count);
+		for (size_t i = 0; i < FLCTRL.HDR.ptr_count; ++i) {
+			uintptr_t value = *(uintptr_t*)((char*)mem + FLCTRL.ptr_table[i]);
+			reverse_index[i].target = value - FLCTRL.HDR.last_mem_addr;
+			reverse_index[i].site = i;
+		}
+		std::sort(reverse_index.begin(), reverse_index.end(),
+			[](const struct reverse_ptr& a, const struct reverse_ptr& b) {
+				return a.target < b.target;
+			});
+
+		ptr_replaced.assign(FLCTRL.HDR.ptr_count, false);
+		reverse_index_ready = true;
+	}
+
+	/**
+	 * @brief Translate an address from the loaded image into the offset in flattened
+	 *   memory. Addresses outside of fragments are rounded up to the next fragment
+	 *
+	 */
+	size_t offset_of(uintptr_t addr) {
+		uintptr_t base = FLCTRL.HDR.last_mem_addr;
+
+		if (FLCTRL.is_continous_mode)
+			return addr > base ? addr - base : 0;
+
+		// Find the last fragment placed at or before addr
+		size_t lo = 0, hi = FLCTRL.HDR.mcount;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if ((uintptr_t)fragment_by_address(mid)->mptr <= addr)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == 0)
+			return 0;
+
+		const struct fragment_node* node = fragment_by_address(lo - 1);
+		return node->start + std::min((size_t)(addr - (uintptr_t)node->mptr), node->size);
+	}
+
 	ssize_t replace_variable(void* old_mem, void* new_mem, size_t size) {
 		ssize_t fixed = 0;
 		if(old_mem == NULL || new_mem == NULL || size == 0) {
@@ -1135,37 +2181,46 @@ public:
 		if (FLCTRL.mem == NULL)
 			return -UNFLATTEN_UNINITIALIZED_FLCTRL;
 
-		for (size_t i = 0; i < FLCTRL.HDR.ptr_count; ++i) {
-			void* mem = flatten_memory_start();
-			size_t fix_loc = *((size_t*)FLCTRL.mem + i);
-			uintptr_t ptr = (uintptr_t)( *(void**)((char*)mem + fix_loc) ) - FLCTRL.HDR.last_mem_addr;
-
-			if(FLCTRL.is_continous_mode) {
-				void* target = (unsigned char*)mem + ptr;
-				if(target >= old_mem && target <= (unsigned char*)old_mem + size - 8) {
-					*(void**)((unsigned char*)mem + fix_loc) = (unsigned char*)new_mem + ((unsigned char*)target - (unsigned char*)old_mem);
-					fixed++;
-				}
-			} else {
-
-				struct interval_tree_node *node = interval_tree_iter_first(&FLCTRL.imap_root, fix_loc, fix_loc + 8);
-				if (node == NULL)
-					return -UNFLATTEN_INTERVAL_EXTRACTION_FAILED;
-				size_t node_offset = fix_loc-node->start;
-
-				struct interval_tree_node *ptr_node = interval_tree_iter_first(&FLCTRL.imap_root, ptr, ptr + 8);
-				if (ptr_node == NULL)
-					return -UNFLATTEN_INTERVAL_EXTRACTION_FAILED;
-				size_t ptr_node_offset = ptr-ptr_node->start;
+		if (!reverse_index_ready)
+			build_reverse_index();
+
+		/*
+		 * Only pointers with target offset between the offsets of old_mem and its last
+		 *  pointer sized slot can point into the variable. The range is rounded outwards,
+		 *  candidates are checked exactly by replace_pointer
+		 */
+		size_t replaced_before = replaced_ptrs.size();
+		if (size >= sizeof(void*)) {
+			size_t first = offset_of((uintptr_t)old_mem);
+			size_t last = offset_of((uintptr_t)old_mem + size - sizeof(void*));
+
+			auto it = std::lower_bound(reverse_index.begin(), reverse_index.end(), first,
+				[](const struct reverse_ptr& entry, size_t target) {
+					return entry.target < target;
+				});
+			for (; it != reverse_index.end() && it->target <= last; ++it) {
+				if (ptr_replaced[it->site])
+					continue;
 
-				void* target = (unsigned char*)ptr_node->mptr + ptr_node_offset;
-				if(target >= old_mem && target <= (unsigned char*)old_mem + size - 8) {
-					*((void**)((char*)node->mptr + node_offset)) = (unsigned char*)new_mem + ((unsigned char*)target - (unsigned char*)old_mem);
+				ssize_t ret = replace_pointer(it->site, old_mem, new_mem, size);
+				if (ret < 0)
+					return ret;
+				if (ret > 0) {
+					ptr_replaced[it->site] = true;
+					replaced_ptrs.push_back(it->site);
 					fixed++;
 				}
 			}
 		}
 
+		// Pointers replaced by the previous calls might point into old_mem now
+		for (size_t i = 0; i < replaced_before; ++i) {
+			ssize_t ret = replace_pointer(replaced_ptrs[i], old_mem, new_mem, size);
+			if (ret < 0)
+				return ret;
+			fixed += ret;
+		}
+
 		// Replace variable in root and named_root pointers
 		for (size_t i = 0; i < FLCTRL.HDR.root_addr_count; i++) {
 			uintptr_t root_mem = FLCTRL.root_addr[i].root_addr;
@@ -1199,11 +2254,28 @@ Unflatten::~Unflatten() {
 	delete engine;
 }
 
-UnflattenStatus Unflatten::load(FILE* file, get_function_address_t gfa, bool continuous_mapping) {
+UnflattenStatus Unflatten::load(FILE* file, get_function_address_t gfa, bool continuous_mapping,
+		bool fragment_arena) {
 	if (!engine)
 		return UNFLATTEN_ALLOCATION_FAILED;
 
-	return engine->load(file, gfa, continuous_mapping);
+	return engine->load(fileno(file), gfa, continuous_mapping, fragment_arena);
+}
+
+UnflattenStatus Unflatten::load_from_fd(int fd, get_function_address_t gfa, bool continuous_mapping,
+		bool fragment_arena) {
+	if (!engine)
+		return UNFLATTEN_ALLOCATION_FAILED;
+
+	return engine->load(fd, gfa, continuous_mapping, fragment_arena);
+}
+
+UnflattenStatus Unflatten::load_from_memory(const void* buf, size_t size, get_function_address_t gfa,
+		bool continuous_mapping, bool take_ownership, bool fragment_arena) {
+	if (!engine)
+		return UNFLATTEN_ALLOCATION_FAILED;
+
+	return engine->load_from_memory(buf, size, gfa, continuous_mapping, take_ownership, fragment_arena);
 }
 
 UnflattenStatus Unflatten::info(FILE* file, const char* arg) {
@@ -1220,6 +2292,27 @@ void Unflatten::mark_freed(void *mptr) {
 	return engine->mark_freed(mptr);
 }
 
+void Unflatten::set_relocation_threads(size_t count) {
+	if (!engine)
+		return;
+
+	engine->set_relocation_threads(count);
+}
+
+UnflattenStatus Unflatten::snapshot() {
+	if (!engine)
+		return UNFLATTEN_ALLOCATION_FAILED;
+
+	return engine->snapshot();
+}
+
+UnflattenStatus Unflatten::restore() {
+	if (!engine)
+		return UNFLATTEN_ALLOCATION_FAILED;
+
+	return engine->restore();
+}
+
 void Unflatten::unload() {
 	if (!engine)
 		return;
@@ -1255,6 +2348,13 @@ ssize_t Unflatten::replace_variable(void* old_mem, void* new_mem, size_t size) {
 	return engine->replace_variable(old_mem, new_mem, size);
 }
 
+void Unflatten::invalidate_pointer_index() {
+	if (!engine)
+		return;
+
+	engine->invalidate_pointer_index();
+}
+
 const char *Unflatten::explain_status(int8_t status) {
 	if (status < UNFLATTEN_OK)
 		status = -status;
@@ -1277,7 +2377,7 @@ void unflatten_deinit(CUnflatten flatten) {
 }
 
 UnflattenStatus unflatten_load(CUnflatten flatten, FILE* file, get_function_address_t gfa) {
-	return ((UnflattenEngine*)flatten)->load(file, gfa);
+	return ((UnflattenEngine*)flatten)->load(fileno(file), gfa);
 }
 
 UnflattenStatus unflatten_imginfo(CUnflatten flatten, FILE* file) {
@@ -1285,7 +2385,31 @@ UnflattenStatus unflatten_imginfo(CUnflatten flatten, FILE* file) {
 }
 
 UnflattenStatus unflatten_load_continuous(CUnflatten flatten, FILE* file, get_function_address_t gfa) {
-	return ((UnflattenEngine*)flatten)->load(file, gfa, true);
+	return ((UnflattenEngine*)flatten)->load(fileno(file), gfa, true);
+}
+
+UnflattenStatus unflatten_load_from_fd(CUnflatten flatten, int fd, get_function_address_t gfa, int flags) {
+	return ((UnflattenEngine*)flatten)->load(fd, gfa, flags & UNFLATTEN_LOAD_CONTINUOUS,
+		flags & UNFLATTEN_LOAD_FRAGMENT_ARENA);
+}
+
+UnflattenStatus unflatten_load_from_memory(CUnflatten flatten, const void* buf, size_t size,
+		get_function_address_t gfa, int flags) {
+	return ((UnflattenEngine*)flatten)->load_from_memory(buf, size, gfa,
+		flags & UNFLATTEN_LOAD_CONTINUOUS, flags & UNFLATTEN_LOAD_TAKE_BUFFER,
+		flags & UNFLATTEN_LOAD_FRAGMENT_ARENA);
+}
+
+void unflatten_set_relocation_threads(CUnflatten flatten, size_t count) {
+	((UnflattenEngine*)flatten)->set_relocation_threads(count);
+}
+
+UnflattenStatus unflatten_snapshot(CUnflatten flatten) {
+	return ((UnflattenEngine*)flatten)->snapshot();
+}
+
+UnflattenStatus unflatten_restore(CUnflatten flatten) {
+	return ((UnflattenEngine*)flatten)->restore();
 }
 
 void unflatten_unload(CUnflatten flatten) {
@@ -1324,6 +2448,10 @@ ssize_t unflatten_replace_variable(CUnflatten flatten, void* old_mem, void* new_
 	return ((UnflattenEngine*)flatten)->replace_variable(old_mem, new_mem, size);
 }
 
+void unflatten_invalidate_pointer_index(CUnflatten flatten) {
+	((UnflattenEngine*)flatten)->invalidate_pointer_index();
+}
+
 const char *unflatten_explain_status(int8_t status) {
 	return Unflatten::explain_status(status);
 }
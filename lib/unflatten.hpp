@@ -17,6 +17,21 @@ typedef void* CUnflatten;
 typedef void* CUnflattenHeader;
 typedef uintptr_t (*get_function_address_t)(const char* fsym);
 
+/*
+ * Flags of unflatten_load_from_fd and unflatten_load_from_memory
+ */
+enum {
+	// Load image as one continuous blob (see unflatten_load_continuous)
+	UNFLATTEN_LOAD_CONTINUOUS = 1 << 0,
+
+	// Buffer was allocated with malloc and is released by the library on unload
+	UNFLATTEN_LOAD_TAKE_BUFFER = 1 << 1,
+
+	// Copy all fragments into one mapping instead of allocating them separately.
+	//  Fragments can't be released with free() then (see unflatten_mark_freed)
+	UNFLATTEN_LOAD_FRAGMENT_ARENA = 1 << 2,
+};
+
 typedef enum {
 	// No error
 	UNFLATTEN_OK = 0,
@@ -86,6 +101,15 @@ typedef enum {
 
 	// Memory was already fixed and is loaded at the same address as previously
 	UNFLATTEN_ALREADY_FIXED,
+
+	// Pointer, fragment or function symbol tables are corrupted
+	UNFLATTEN_INVALID_TABLES,
+
+	// Failed to take snapshot of loaded memory
+	UNFLATTEN_SNAPSHOT_FAILED,
+
+	// No snapshot of loaded memory was taken
+	UNFLATTEN_NO_SNAPSHOT,
 	UNFLATTEN_STATUS_MAX,
 } UnflattenStatus;
 
@@ -126,12 +150,50 @@ public:
 	 * 
 	 * @param file pointer to opened file with kflat image
 	 * @param gfa  optional pointer to function resolving func pointers
-	 * @param continuous_mapping whether to allocate dumped memory as one huge blob
-	 * 			or as many small malloc objects (second variant is slower, but allows
-	 * 			for detection of buffer overflows with ASAN)
+	 * @param continuous_mapping whether to use dumped memory as one huge blob
+	 * 			or split it into separate fragments (second variant is slower, but
+	 * 			fragments are separated by redzones which allows for detection of
+	 * 			buffer overflows with ASAN)
+	 * @param fragment_arena whether to copy fragments into one mapping instead of
+	 * 			allocating each of them on the heap. It's faster for images with
+	 * 			many fragments, but fragments can't be released with free()
 	 * @return        0 on success, otherwise error code
 	 */
-	UnflattenStatus load(FILE* file, get_function_address_t gfa = NULL, bool continuous_mapping = false);
+	UnflattenStatus load(FILE* file, get_function_address_t gfa = NULL, bool continuous_mapping = false,
+		bool fragment_arena = false);
+
+	/**
+	 * @brief load new kflat image from file descriptor. Works as load(), but also
+	 *        accepts non-seekable descriptors (pipes, sockets), from which exactly
+	 *        one image is read sequentially starting at the current position
+	 *
+	 * @param fd   descriptor of opened file or stream with kflat image
+	 * @param gfa  optional pointer to function resolving func pointers
+	 * @param continuous_mapping whether to use dumped memory as one huge blob
+	 * @param fragment_arena whether to copy fragments into one mapping (see load())
+	 * @return        0 on success, otherwise error code
+	 */
+	UnflattenStatus load_from_fd(int fd, get_function_address_t gfa = NULL, bool continuous_mapping = false,
+		bool fragment_arena = false);
+
+	/**
+	 * @brief load new kflat image that is already in memory, for instance in the
+	 *        area mmaped from kflat device. Borrowed buffer is never modified, but
+	 *        it has to stay valid until the image is unloaded. In continuous mode
+	 *        its memory is copied out before pointers are fixed
+	 *
+	 * @param buf  pointer to kflat image
+	 * @param size size of the buffer
+	 * @param gfa  optional pointer to function resolving func pointers
+	 * @param continuous_mapping whether to use dumped memory as one huge blob
+	 * @param take_ownership whether buf was allocated with malloc and should be
+	 * 			released on unload. Owned buffer is fixed in place in continuous
+	 * 			mode. Ownership is taken even if loading fails
+	 * @param fragment_arena whether to copy fragments into one mapping (see load())
+	 * @return        0 on success, otherwise error code
+	 */
+	UnflattenStatus load_from_memory(const void* buf, size_t size, get_function_address_t gfa = NULL,
+		bool continuous_mapping = false, bool take_ownership = false, bool fragment_arena = false);
 
 	/**
 	 * @brief Provides information regarding kflat image file
@@ -142,6 +204,34 @@ public:
 	 */
 	UnflattenStatus info(FILE* file, const char* arg = 0);
 
+	/**
+	 * @brief set the number of threads used to relocate pointers while loading
+	 *        an image. Pointers of large images are split evenly between threads,
+	 *        the loaded memory is the same as with a single thread (default)
+	 *
+	 * @param count number of threads or 0 to use all online CPUs
+	 */
+	void set_relocation_threads(size_t count);
+
+	/**
+	 * @brief save the current state of loaded image, so that it can be brought
+	 *        back with restore(). Taking new snapshot replaces the previous one
+	 *
+	 * @return        0 on success, otherwise error code
+	 */
+	UnflattenStatus snapshot();
+
+	/**
+	 * @brief bring memory and root pointers of loaded image back to the state
+	 *        saved by snapshot(). Only the memory pages modified since then are
+	 *        copied, which makes it cheap to reset the image between fuzzing
+	 *        iterations. Separately allocated fragments are copied as a whole and
+	 *        the ones freed after the snapshot are allocated again at new addresses
+	 *
+	 * @return        0 on success, otherwise error code
+	 */
+	UnflattenStatus restore();
+
 	/**
 	 * @brief free memory occupied by loaded image. Normally, there's no need
 	 *        to invoke this function manually (both destructor and load()) calls
@@ -151,6 +241,8 @@ public:
 
 	/**
 	 * @brief Mark pointer as freed by some external code. This prevents double frees when image is unloaded.
+	 *        Fragments loaded with fragment_arena can't be freed, but when built with ASAN
+	 *        any further access to the marked fragment is reported
 	 * 
 	 * @param mptr already freed pointer
 	 */
@@ -182,7 +274,10 @@ public:
 
 	/**
 	 * @brief Replace all pointers to the provided memory range with a new variable. It can be
-	 * 	used to replace global variable from image with local copy
+	 * 	used to replace global variable from image with local copy. The first call indexes
+	 * 	pointers by their target, so only pointers to the old memory are visited. Pointers
+	 * 	changed by the caller since then are not tracked, unless invalidate_pointer_index()
+	 * 	is called after changing them
 	 *
 	 * @param old_mem 	pointer to old memory
 	 * @param new_mem 	pointer to new memory
@@ -191,6 +286,13 @@ public:
 	 */
 	ssize_t replace_variable(void* old_mem, void* new_mem, size_t size);
 
+	/**
+	 * @brief Drop the index of pointers built by replace_variable, so that the next call
+	 * 	indexes pointers again with their current values. restore() and unload() do it
+	 * 	on their own
+	 */
+	void invalidate_pointer_index();
+
 	/**
 	 * @brief Provide description of a given status code
 	 *
@@ -247,6 +349,67 @@ UnflattenStatus unflatten_load(CUnflatten flatten, FILE* file, get_function_addr
  */
 UnflattenStatus unflatten_load_continuous(CUnflatten flatten, FILE* file, get_function_address_t gfa);
 
+/**
+ * @brief Set the number of threads used to relocate pointers by subsequent
+ *        loads. Pointers of large images are split evenly between threads,
+ *        the loaded memory is the same as with a single thread (default)
+ *
+ * @param flatten library instance
+ * @param count   number of threads or 0 to use all online CPUs
+ */
+void unflatten_set_relocation_threads(CUnflatten flatten, size_t count);
+
+/**
+ * @brief Load new kflat image from file descriptor. Non-seekable descriptors (pipes,
+ *        sockets) are supported too - exactly one image is read from the current
+ *        position in a single pass
+ *
+ * @param flatten library instance
+ * @param fd      descriptor of opened file or stream with kflat image
+ * @param gfa     optional pointer to function resolving func pointers
+ * @param flags   combination of UNFLATTEN_LOAD_CONTINUOUS and UNFLATTEN_LOAD_FRAGMENT_ARENA
+ * @return        0 on success, any other values indicate an error
+ */
+UnflattenStatus unflatten_load_from_fd(CUnflatten flatten, int fd, get_function_address_t gfa, int flags);
+
+/**
+ * @brief Load new kflat image that is already in memory, e.g. in the area mmaped
+ *        from kflat device. Unless UNFLATTEN_LOAD_TAKE_BUFFER is passed, buffer is
+ *        never modified, but has to stay valid until the image is unloaded.
+ *        With UNFLATTEN_LOAD_TAKE_BUFFER buffer has to be allocated with malloc,
+ *        is released on unload (even if loading fails) and in continuous mode
+ *        pointers are fixed in place
+ *
+ * @param flatten library instance
+ * @param buf     pointer to kflat image
+ * @param size    size of the buffer
+ * @param gfa     optional pointer to function resolving func pointers
+ * @param flags   combination of UNFLATTEN_LOAD_CONTINUOUS, UNFLATTEN_LOAD_TAKE_BUFFER
+ *                and UNFLATTEN_LOAD_FRAGMENT_ARENA
+ * @return        0 on success, any other values indicate an error
+ */
+UnflattenStatus unflatten_load_from_memory(CUnflatten flatten, const void* buf, size_t size,
+	get_function_address_t gfa, int flags);
+
+/**
+ * @brief Save the current state of loaded image, so that it can be brought back
+ *        with unflatten_restore. Taking new snapshot replaces the previous one
+ *
+ * @param flatten library instance
+ * @return        0 on success, any other values indicate an error
+ */
+UnflattenStatus unflatten_snapshot(CUnflatten flatten);
+
+/**
+ * @brief Bring memory and root pointers of loaded image back to the state saved
+ *        by unflatten_snapshot. Only the memory pages modified since then are
+ *        copied, which makes it cheap to reset the image between fuzzing iterations
+ *
+ * @param flatten library instance
+ * @return        0 on success, any other values indicate an error
+ */
+UnflattenStatus unflatten_restore(CUnflatten flatten);
+
 /**
  * @brief Unload kflat image. Normally, there's no need for invoking this
  *        function manually - both unflatten_load and unflatten_deinit invokes
@@ -324,7 +487,8 @@ size_t unflatten_header_memory_size(CUnflattenHeader header);
 
 /**
  * @brief Replace all pointers to the provided memory range with new variable. It can be
- * 	used to replace global variable from image with local copy
+ * 	used to replace global variable from image with local copy. Pointers are indexed by
+ * 	the first call, see unflatten_invalidate_pointer_index
  *
  * @param flatten 	library instance
  * @param old_mem 	pointer to old memory
@@ -334,6 +498,15 @@ size_t unflatten_header_memory_size(CUnflattenHeader header);
  */
 ssize_t unflatten_replace_variable(CUnflatten flatten, void* old_mem, void* new_mem, size_t size);
 
+/**
+ * @brief Drop the index of pointers built by unflatten_replace_variable. Call it after
+ * 	pointers in loaded memory were changed by other means, so that the next call indexes
+ * 	them again. unflatten_restore and unflatten_unload do it on their own
+ *
+ * @param flatten 	library instance
+ */
+void unflatten_invalidate_pointer_index(CUnflatten flatten);
+
 /**
  * @brief Provide description of a given status code
  *
@@ -11,6 +11,8 @@ struct unit_addr_valid_test {
 	bool wild_pointer;
 	bool non_readable_mem;
 	bool too_small_mem;
+	bool adjacent_vma_span;
+	bool unmapped_tail;
 
 	bool exec_mem_valid;
 	bool exec_mem_only_rw;
@@ -45,6 +47,15 @@ static int flatten_unit_addr_valid_test(struct flat *flat) {
 	results.non_readable_mem = uflat_test_address_range(flat, non_read_mem, 4096);
 	results.too_small_mem = uflat_test_address_range(flat, valid, 4097);
 
+	// Range spanning two adjacent mappings with different protections
+	char* span = mmap(NULL, 3 * 4096, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if(span == MAP_FAILED)
+		return 1;
+	mprotect(span + 4096, 4096, PROT_READ);
+	munmap(span + 2 * 4096, 4096);
+	results.adjacent_vma_span = uflat_test_address_range(flat, span, 2 * 4096);
+	results.unmapped_tail = uflat_test_address_range(flat, span + 4096, 2 * 4096);
+
 	// Test uflat_test_exec_range function
 	void* test = mmap(NULL, 4096, PROT_READ | PROT_EXEC, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
 	if(test == MAP_FAILED)
@@ -70,6 +81,7 @@ static int flatten_unit_addr_valid_test(struct flat *flat) {
 	munmap(valid, 4096);
 	munmap(test2, 4096);
 	munmap(test, 4096);
+	munmap(span, 2 * 4096);
 	return rv;
 }
 
@@ -85,6 +97,8 @@ static int flatten_unit_addr_valid_validate(void *memory, size_t size, CUnflatte
 	ASSERT(!test->wild_pointer);
 	ASSERT(!test->non_readable_mem);
 	ASSERT(!test->too_small_mem);
+	ASSERT(test->adjacent_vma_span);
+	ASSERT(!test->unmapped_tail);
 
 	ASSERT(test->exec_mem_valid);
 	ASSERT(!test->exec_mem_only_rw);
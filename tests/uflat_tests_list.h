@@ -0,0 +1,113 @@
+/**
+ * @file tests_list.h
+ * @author Samsung R&D Poland - Mobile Security Group (srpol.mb.sec@samsung.com)
+ * @brief Header file collecting the list of all available KFLAT tests
+ *  This file has been auto-generated by tests_list_gen script
+ */
+#include "common.h"
+
+/*
+ * Extern-declaration for all test case structures
+ */
+extern struct kflat_test_case test_case_kflat_circle_test;
+extern struct kflat_test_case test_case_kflat_global_list_for_each_entry_test;
+extern struct kflat_test_case test_case_kflat_list_complex_test;
+extern struct kflat_test_case test_case_kflat_list_for_each_entry_test;
+extern struct kflat_test_case test_case_kflat_list_test;
+extern struct kflat_test_case test_case_kflat_rbtree_example;
+extern struct kflat_test_case test_case_kflat_stringset_test;
+extern struct kflat_test_case test_case_kflat_struct_variant_test;
+extern struct kflat_test_case test_case_kflat_aggregate_struct_shifted_unit_test;
+extern struct kflat_test_case test_case_kflat_bqueue_impl_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_embedded_pointer_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_string_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_struct_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_struct_shifted_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_struct_shifted_self_contained_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_struct_type_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_struct_type_self_contained_unit_test;extern struct kflat_test_case test_case_kflat_fptr_test;
+extern struct kflat_test_case test_case_kflat_empty_fptrmap_test;extern struct kflat_test_case test_case_kflat_fragment_test;
+extern struct kflat_test_case test_case_kflat_large_data_list_test;
+extern struct kflat_test_case test_case_kflat_large_data_stringset_test;
+extern struct kflat_test_case test_case_kflat_large_interval_tree_test;
+extern struct kflat_test_case test_case_kflat_large_list_test;
+extern struct kflat_test_case test_case_kflat_large_stringset_test;
+extern struct kflat_test_case test_case_kflat_overlaplist_test;
+extern struct kflat_test_case test_case_kflat_overlapptr_test;
+extern struct kflat_test_case test_case_kflat_padding_test;
+extern struct kflat_test_case test_case_kflat_pointer_test;
+extern struct kflat_test_case test_case_kflat_record_pointer_test;
+extern struct kflat_test_case test_case_kflat_simple_test;
+extern struct kflat_test_case test_case_kflat_structarray_example;
+extern struct kflat_test_case test_case_kflat_variable_struct_example;
+extern struct kflat_test_case test_case_unit_aligned_pointers_test;
+extern struct kflat_test_case test_case_kflat_aligned_root_pointers_test;
+extern struct kflat_test_case test_case_kflat_flatten_struct_array_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_struct_type_array_self_contained_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_struct_array_specialize_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_struct_pointer_array_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_struct_self_contained_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_struct_storage_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_struct_storage_self_contained_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_struct_type_array_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_type_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_union_unit_test;
+extern struct kflat_test_case test_case_kflat_unflatten_replace_unit_test;
+extern struct kflat_test_case test_case_kflat_unflatten_snapshot_unit_test;
+extern struct kflat_test_case test_case_kflat_flatten_string_ex_unit_test;
+extern struct kflat_test_case test_case_flatten_unit_addr_valid_test;
+
+
+/*
+ * Array storing the list of all available test cases
+ */
+const struct kflat_test_case* test_cases[] = {
+	&test_case_kflat_circle_test,
+	&test_case_kflat_global_list_for_each_entry_test,
+	&test_case_kflat_list_complex_test,
+	&test_case_kflat_list_for_each_entry_test,
+	&test_case_kflat_list_test,
+	&test_case_kflat_rbtree_example,
+	&test_case_kflat_stringset_test,
+	&test_case_kflat_struct_variant_test,
+	&test_case_kflat_aggregate_struct_shifted_unit_test,
+	&test_case_kflat_bqueue_impl_unit_test,
+	&test_case_kflat_flatten_embedded_pointer_unit_test,
+	&test_case_kflat_flatten_string_unit_test,
+	&test_case_kflat_flatten_struct_unit_test,
+	&test_case_kflat_flatten_struct_shifted_unit_test,
+	&test_case_kflat_flatten_struct_shifted_self_contained_unit_test,
+	&test_case_kflat_flatten_struct_type_unit_test,
+	&test_case_kflat_flatten_struct_type_self_contained_unit_test,	&test_case_kflat_fptr_test,
+	&test_case_kflat_empty_fptrmap_test,	&test_case_kflat_fragment_test,
+	&test_case_kflat_large_data_list_test,
+	&test_case_kflat_large_data_stringset_test,
+	&test_case_kflat_large_interval_tree_test,
+	&test_case_kflat_large_list_test,
+	&test_case_kflat_large_stringset_test,
+	&test_case_kflat_overlaplist_test,
+	&test_case_kflat_overlapptr_test,
+	&test_case_kflat_padding_test,
+	&test_case_kflat_pointer_test,
+	&test_case_kflat_record_pointer_test,
+	&test_case_kflat_simple_test,
+	&test_case_kflat_structarray_example,
+	&test_case_kflat_variable_struct_example,
+	&test_case_unit_aligned_pointers_test,
+	&test_case_kflat_aligned_root_pointers_test,
+	&test_case_kflat_flatten_struct_array_unit_test,
+	&test_case_kflat_flatten_struct_type_array_self_contained_unit_test,
+	&test_case_kflat_flatten_struct_array_specialize_unit_test,
+	&test_case_kflat_flatten_struct_pointer_array_unit_test,
+	&test_case_kflat_flatten_struct_self_contained_unit_test,
+	&test_case_kflat_flatten_struct_storage_unit_test,
+	&test_case_kflat_flatten_struct_storage_self_contained_unit_test,
+	&test_case_kflat_flatten_struct_type_array_unit_test,
+	&test_case_kflat_flatten_type_unit_test,
+	&test_case_kflat_flatten_union_unit_test,
+	&test_case_kflat_unflatten_replace_unit_test,
+	&test_case_kflat_unflatten_snapshot_unit_test,
+	&test_case_kflat_flatten_string_ex_unit_test,
+	&test_case_flatten_unit_addr_valid_test,
+
+};
@@ -11,6 +11,10 @@ struct bqueue_impl_result {
 	bool chunks_test;
 	bool single_large_test;
 	bool bounds;
+	bool order_test;
+	bool wrap_test;
+	bool batch_test;
+	bool size_mismatch_test;
 };
 
 /********************************/
@@ -26,6 +30,8 @@ static int kflat_bqueue_impl_unit_test(struct flat *flat) {
 	char mem[6] = {'a', 'b', 'c', 'd', 'e', '\0'};
 	char test[6];
 	char* large_mem, *copy_mem;
+	size_t value, values[4];
+	size_t next, count;
 
 	FLATTEN_SETUP_TEST(flat);
 
@@ -34,14 +40,95 @@ static int kflat_bqueue_impl_unit_test(struct flat *flat) {
 	results.small_test = true;
 
 	for(int i = 0; i < 100; i++)
-		bqueue_push_back(flat, &bq, mem, size);
+		if(bqueue_push_back(flat, &bq, mem, size))
+			results.small_test = false;
 	for(int i = 0; i < 100; i++) {
-		bqueue_pop_front(&bq, test, size);
-		if(memcmp(test, mem, size)) {
+		if(bqueue_pop_front(&bq, test, size) || memcmp(test, mem, size)) {
 			results.small_test = false;
 			break;
 		}
 	}
+	if(bqueue_pop_front_batch(&bq, test, 1) != 0)
+		results.small_test = false;
+	bqueue_destroy(&bq);
+
+	// Elements come out in FIFO order after the ring grows past initial capacity
+	bqueue_init(flat, &bq, 10 * sizeof(size_t));
+	results.order_test = true;
+
+	for(value = 0; value < 1000; value++)
+		if(bqueue_push_back(flat, &bq, &value, sizeof(value)))
+			results.order_test = false;
+	for(size_t i = 0; i < 1000; i++) {
+		if(bqueue_pop_front(&bq, &value, sizeof(value)) || value != i) {
+			results.order_test = false;
+			break;
+		}
+	}
+	bqueue_destroy(&bq);
+
+	// Grow the ring while its content wraps around the end of the buffer
+	bqueue_init(flat, &bq, 8 * sizeof(size_t));
+	results.wrap_test = true;
+	next = 0;
+
+	for(value = 0; value < 6; value++)
+		bqueue_push_back(flat, &bq, &value, sizeof(value));
+	for(int i = 0; i < 4; i++) {
+		if(bqueue_pop_front(&bq, &value, sizeof(value)) || value != next++)
+			results.wrap_test = false;
+	}
+	for(value = 6; value < 40; value++)
+		if(bqueue_push_back(flat, &bq, &value, sizeof(value)))
+			results.wrap_test = false;
+	while(next < 40) {
+		if(bqueue_pop_front(&bq, &value, sizeof(value)) || value != next++) {
+			results.wrap_test = false;
+			break;
+		}
+	}
+	if(bqueue_pop_front_batch(&bq, &value, 1) != 0)
+		results.wrap_test = false;
+	bqueue_destroy(&bq);
+
+	// Batch pop returns at most max_count elements in order
+	bqueue_init(flat, &bq, 4 * sizeof(size_t));
+	results.batch_test = true;
+	next = 0;
+
+	for(value = 0; value < 10; value++)
+		bqueue_push_back(flat, &bq, &value, sizeof(value));
+	while((count = bqueue_pop_front_batch(&bq, values, 4)) > 0) {
+		if(count != (next < 8 ? 4 : 2))
+			results.batch_test = false;
+		for(size_t i = 0; i < count; i++)
+			if(values[i] != next++)
+				results.batch_test = false;
+	}
+	if(next != 10)
+		results.batch_test = false;
+	bqueue_destroy(&bq);
+
+	// Element size is fixed until the queue gets empty
+	bqueue_init(flat, &bq, 100);
+	results.size_mismatch_test = true;
+
+	bqueue_push_back(flat, &bq, mem, size);
+	bqueue_push_back(flat, &bq, mem, size);
+	if(bqueue_push_back(flat, &bq, &value, sizeof(value)) != EINVAL)
+		results.size_mismatch_test = false;
+	if(bqueue_pop_front(&bq, &value, sizeof(value)) != EINVAL)
+		results.size_mismatch_test = false;
+	if(bqueue_pop_front(&bq, values, sizeof(values)) != EINVAL)
+		results.size_mismatch_test = false;
+	if(bqueue_pop_front(&bq, test, size) || bqueue_pop_front(&bq, test, size))
+		results.size_mismatch_test = false;
+	value = 42;
+	if(bqueue_push_back(flat, &bq, &value, sizeof(value)))
+		results.size_mismatch_test = false;
+	value = 0;
+	if(bqueue_pop_front(&bq, &value, sizeof(value)) || value != 42)
+		results.size_mismatch_test = false;
 	bqueue_destroy(&bq);
 
 
@@ -60,22 +147,24 @@ static int kflat_bqueue_impl_unit_test(struct flat *flat) {
 	}
 	bqueue_destroy(&bq);
 
-	// Check data split
+	// Elements larger than the initial buffer
 	results.single_large_test = true;
 	large_mem = flat_zalloc(flat, PAGE_SIZE, 1);
 	copy_mem = flat_zalloc(flat, PAGE_SIZE, 1);
 	for(int i = 0; i < PAGE_SIZE; i++)
-		copy_mem[i] = large_mem[i] = i;
+		large_mem[i] = i;
 
 	bqueue_init(flat, &bq, 100);
-	
-	bqueue_push_back(flat, &bq, large_mem, PAGE_SIZE);
-	bqueue_pop_front( &bq, test, size);
-	for(int i = 0; i < PAGE_SIZE; i++)
-		if(copy_mem[i] != large_mem[i]) {
+
+	if(bqueue_push_back(flat, &bq, large_mem, PAGE_SIZE) || bqueue_push_back(flat, &bq, large_mem, PAGE_SIZE))
+		results.single_large_test = false;
+	if(bqueue_pop_front(&bq, test, size) != EINVAL)
+		results.single_large_test = false;
+	for(int n = 0; n < 2; n++) {
+		memset(copy_mem, 0, PAGE_SIZE);
+		if(bqueue_pop_front(&bq, copy_mem, PAGE_SIZE) || memcmp(copy_mem, large_mem, PAGE_SIZE))
 			results.single_large_test = false;
-			break;
-		}
+	}
 
 	bqueue_destroy(&bq);
 	
@@ -130,6 +219,10 @@ static int kflat_bqueue_impl_unit_validate(void *memory, size_t size, CUnflatten
 	ASSERT(pResults->chunks_test);
 	ASSERT(pResults->bounds);
 	ASSERT(pResults->single_large_test);
+	ASSERT(pResults->order_test);
+	ASSERT(pResults->wrap_test);
+	ASSERT(pResults->batch_test);
+	ASSERT(pResults->size_mismatch_test);
 
 	return KFLAT_TEST_SUCCESS;
 }
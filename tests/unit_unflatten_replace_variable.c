@@ -153,7 +153,9 @@ static int kflat_unflatten_replace_unit_validate(void *memory, size_t size, CUnf
 	ASSERT_EQ(my_global.new, (struct replace_test*) 0x4444);
 	ASSERT_EQ(my_global.another, (struct replace_test*) 0x6666);
 
-	// Now replace the list structure to see if internal pointers to itself were properly replaced as well
+	// Now replace the list structure to see if internal pointers to itself were properly replaced as well.
+	//  Pointers are indexed again, as if they were modified by the caller in the meantime
+	unflatten_invalidate_pointer_index(flatten);
 	result = unflatten_replace_variable(flatten, replace_list, &replace_global_linux_list, sizeof(struct linux_list_head));
 	ASSERT(result > 0);
 	memcpy(&replace_global_linux_list,replace_list,sizeof(struct linux_list_head));
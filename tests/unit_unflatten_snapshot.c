@@ -0,0 +1,146 @@
+/**
+ * @file unit_unflatten_snapshot.c
+ * @author Samsung R&D Poland - Mobile Security Group
+ *
+ */
+
+#include "common.h"
+
+#define SNAP_NODE_COUNT	4
+#define SNAP_DATA_COUNT	1024
+
+struct snap_node {
+	struct snap_node* next;
+	struct snap_node* peer;
+	unsigned long value;
+	const char* name;
+	unsigned long* data;	/* Spans over a few pages of loaded memory */
+};
+
+static const char* snap_names[SNAP_NODE_COUNT] = {
+	"first", "second", "third", "fourth"
+};
+
+/********************************/
+#ifdef __TESTER__
+/********************************/
+
+FUNCTION_DECLARE_FLATTEN_STRUCT(snap_node);
+FUNCTION_DEFINE_FLATTEN_STRUCT(snap_node,
+	AGGREGATE_FLATTEN_STRUCT(snap_node, next);
+	AGGREGATE_FLATTEN_STRUCT(snap_node, peer);
+	AGGREGATE_FLATTEN_STRING(name);
+	AGGREGATE_FLATTEN_TYPE_ARRAY(unsigned long, data, SNAP_DATA_COUNT);
+);
+
+static struct snap_node* snap_head;
+static unsigned long snap_data[SNAP_NODE_COUNT][SNAP_DATA_COUNT];
+
+static int kflat_unflatten_snapshot_unit_test(struct flat *flat) {
+	// Only every other node is dumped, so that each one becomes a separate fragment
+	struct snap_node nodes[2 * SNAP_NODE_COUNT];
+	void* snap_head_addr = &snap_head;
+
+	FLATTEN_SETUP_TEST(flat);
+
+	for(int i = 0; i < SNAP_NODE_COUNT; i++) {
+		nodes[2 * i].next = &nodes[2 * ((i + 1) % SNAP_NODE_COUNT)];
+		nodes[2 * i].peer = &nodes[2 * ((i + 2) % SNAP_NODE_COUNT)];
+		nodes[2 * i].value = i * 100;
+		nodes[2 * i].name = snap_names[i];
+		nodes[2 * i].data = snap_data[i];
+		for(int j = 0; j < SNAP_DATA_COUNT; j++)
+			snap_data[i][j] = i * SNAP_DATA_COUNT + j;
+	}
+	snap_head = &nodes[0];
+
+	FOR_ROOT_POINTER(&nodes[0],
+		FLATTEN_STRUCT(snap_node, &nodes[0]);
+	);
+
+	FOR_ROOT_POINTER(&nodes[2],
+		FLATTEN_STRUCT(snap_node, &nodes[2]);
+	);
+
+	FOR_EXTENDED_ROOT_POINTER(snap_head_addr, "snap_head", sizeof(struct snap_node*),
+		FOREACH_POINTER(struct snap_node*, __snap_head_1, __root_ptr, 1,
+			FLATTEN_STRUCT(snap_node, __snap_head_1);
+		);
+	);
+
+	return FLATTEN_FINISH_TEST(flat);
+}
+
+/********************************/
+#endif /* __TESTER__ */
+#ifdef __VALIDATOR__
+/********************************/
+
+static struct snap_node snap_replacement = {
+	.value = 0xC0FFEE,
+	.name = "replacement",
+};
+
+static int kflat_unflatten_snapshot_check(CUnflatten flatten) {
+	struct snap_node* head = (struct snap_node*)unflatten_root_pointer_seq(flatten, 0);
+	struct snap_node* second = (struct snap_node*)unflatten_root_pointer_seq(flatten, 1);
+	struct snap_node** named = (struct snap_node**)unflatten_root_pointer_named(flatten, "snap_head", NULL);
+	struct snap_node* node = head;
+
+	ASSERT(head != NULL);
+	ASSERT(named != NULL);
+	ASSERT_EQ(*named, head);
+	ASSERT_EQ(head->next, second);
+	for(int i = 0; i < SNAP_NODE_COUNT; i++) {
+		ASSERT_EQ(node->value, i * 100);
+		ASSERT(!strcmp(node->name, snap_names[i]));
+		ASSERT_EQ(node->peer, node->next->next);
+		for(int j = 0; j < SNAP_DATA_COUNT; j++)
+			ASSERT_EQ(node->data[j], i * SNAP_DATA_COUNT + j);
+		node = node->next;
+	}
+	ASSERT_EQ(node, head);
+
+	return KFLAT_TEST_SUCCESS;
+}
+
+static int kflat_unflatten_snapshot_unit_validate(void *memory, size_t size, CUnflatten flatten) {
+	ASSERT_EQ(kflat_unflatten_snapshot_check(flatten), KFLAT_TEST_SUCCESS);
+	ASSERT_EQ(unflatten_snapshot(flatten), UNFLATTEN_OK);
+
+	// Restore has to work repeatedly, also when the fragments were allocated again by the previous one
+	for(int iter = 0; iter < 2; iter++) {
+		struct snap_node* head = (struct snap_node*)unflatten_root_pointer_seq(flatten, 0);
+		struct snap_node* second = (struct snap_node*)unflatten_root_pointer_seq(flatten, 1);
+		struct snap_node* node = head;
+
+		// Overwrite every fragment, so that both pages and edges of memory are modified
+		for(int i = 0; i < SNAP_NODE_COUNT; i++) {
+			struct snap_node* next = node->next;
+			memset(node->data, 0xAA, SNAP_DATA_COUNT * sizeof(unsigned long));
+			node->value = ~0UL;
+			node->name = "modified";
+			node->peer = node;
+			node = next;
+		}
+
+		ASSERT(unflatten_replace_variable(flatten, second, &snap_replacement, sizeof(struct snap_node)) > 0);
+		ASSERT_EQ(head->next, &snap_replacement);
+		ASSERT_EQ(unflatten_root_pointer_seq(flatten, 1), &snap_replacement);
+
+		// Fragment isn't released with free(), as that's not allowed with fragment arena
+		unflatten_mark_freed(flatten, second);
+
+		ASSERT_EQ(unflatten_restore(flatten), UNFLATTEN_OK);
+		ASSERT(unflatten_root_pointer_seq(flatten, 1) != &snap_replacement);
+		ASSERT_EQ(kflat_unflatten_snapshot_check(flatten), KFLAT_TEST_SUCCESS);
+	}
+
+	return KFLAT_TEST_SUCCESS;
+}
+
+/********************************/
+#endif /* __VALIDATOR__ */
+/********************************/
+
+KFLAT_REGISTER_TEST_FLAGS("[UNIT] unflatten_snapshot", kflat_unflatten_snapshot_unit_test, kflat_unflatten_snapshot_unit_validate, KFLAT_TEST_ATOMIC);
@@ -128,13 +128,35 @@ int main(int argc, char** argv, char** envp) {
         .nargs(1);
 
     program.add_argument("-u", "--dump_size")
-        .help("Max dump size of the kflat image - effectively the size of mmaped kflat memory.")
+        .help("Max dump size of the kflat image - effectively the size of mmaped kflat memory. "
+              "Use 0 to skip mmap and stream the image from kflat node instead.")
         .required()
         .default_value<unsigned int>(100 * 1024 * 1024)
         .scan<'i', unsigned int>()
         .metavar("DUMP_SIZE")
         .nargs(1);
 
+    program.add_argument("-m", "--multishot")
+        .help("Capture up to SHOTS images, each saved to OUTPUT.<number>.")
+        .default_value(0)
+        .scan<'i', int>()
+        .metavar("SHOTS")
+        .nargs(1);
+
+    program.add_argument("--slots")
+        .help("Number of image slots in kflat memory used in multi-shot mode (0 - default).")
+        .default_value(0)
+        .scan<'i', int>()
+        .metavar("SLOTS")
+        .nargs(1);
+
+    program.add_argument("--min_interval")
+        .help("In miliseconds. Minimal interval between captures in multi-shot mode.")
+        .default_value(0)
+        .scan<'i', int>()
+        .metavar("INTERVAL")
+        .nargs(1);
+
     program.add_argument("-y", "--verbosity")
         .help("Verbosity level of ExecFlat library.")
         .default_value<std::string>("INFO")
@@ -191,6 +213,17 @@ int main(int argc, char** argv, char** envp) {
         poll_timeout = -1;
     auto dump_size = program.get<unsigned int>("--dump_size");
     auto verbosity = get_v_level(program.get<std::string>("--verbosity"));
+    auto shots = program.get<int>("--multishot");
+    auto slots = program.get<int>("--slots");
+    auto min_interval = program.get<int>("--min_interval");
+    if(shots < 0 || slots < 0 || min_interval < 0) {
+        std::cerr << "Multi-shot options cannot be negative" << std::endl;
+        return 1;
+    }
+    if(shots > 1 && dump_size == 0) {
+        std::cerr << "Multi-shot mode cannot be used with streamed images (dump_size 0)" << std::endl;
+        return 1;
+    }
 
     try {
         /* ===================== AUTO MODE ======================== */
@@ -208,6 +241,7 @@ int main(int argc, char** argv, char** envp) {
             auto target = program.at<argparse::ArgumentParser>("AUTO").get<std::string>("target");
 
             ExecFlat kflat(dump_size, verbosity);
+            kflat.set_multishot(shots, slots, min_interval);
             kflat.run_recipe(interface, target, recipe, output, stop_machine, debug, skip_body, run_now, io_timeout, poll_timeout);
         }
         /* ===================== MANUAL MODE ======================== */
@@ -216,6 +250,7 @@ int main(int argc, char** argv, char** envp) {
             auto recipe = program.at<argparse::ArgumentParser>("MANUAL").get<std::string>("recipe");
 
             ExecFlat kflat(dump_size, verbosity);
+            kflat.set_multishot(shots, slots, min_interval);
             kflat.run_recipe_no_target(recipe, output, stop_machine, debug, skip_body, run_now, poll_timeout);
         }
         /* ===================== LIST MODE ======================== */
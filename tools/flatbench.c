@@ -0,0 +1,667 @@
+/**
+ * @file flatbench.c
+ * @author Samsung R&D Poland - Mobile Security Group (srpol.mb.sec@samsung.com)
+ * @brief Microbenchmarks of the flattening engine built on top of UFLAT
+ *
+ * Each benchmark generates a synthetic object graph of the requested size,
+ * flattens it with regular recipes and writes the image. Results are
+ * reported in JSON format, one record per benchmark and graph size.
+ */
+
+#include <argp.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "uflat.h"
+
+#define BENCH_DEFAULT_MIN_OBJECTS   1000UL
+#define BENCH_DEFAULT_MAX_OBJECTS   1000000UL
+#define BENCH_MAX_OBJECTS           10000000UL
+#define BENCH_GRAPH_EDGES           4
+#define BENCH_WIDE_FPTRS            16
+#define BENCH_STRING_MAX_LEN        48
+
+/* JSON goes to stdout, so keep the progress logs out of it */
+#define bench_log(fmt, ...)     fprintf(stderr, "[flatbench] " fmt "\n", ##__VA_ARGS__)
+
+struct args {
+    unsigned long min_objects;
+    unsigned long max_objects;
+    const char* image_path;
+    const char* json_path;
+    bool selected[16];
+    bool any_selected;
+};
+
+/*******************************************************
+ * HELPERS
+ *******************************************************/
+static unsigned long long bench_rand_state = 0x9E3779B97F4A7C15ULL;
+
+static unsigned long long bench_rand(void) {
+    /* xorshift64 - good enough and reproducible between runs */
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 7;
+    bench_rand_state ^= bench_rand_state << 17;
+    return bench_rand_state;
+}
+
+static unsigned long long time_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*******************************************************
+ * BENCHMARK: linked list
+ *******************************************************/
+struct bench_list {
+    unsigned long id;
+    struct bench_list* next;
+    struct bench_list* prev;
+};
+
+FUNCTION_DECLARE_FLATTEN_STRUCT(bench_list);
+
+FUNCTION_DEFINE_FLATTEN_STRUCT(bench_list,
+    AGGREGATE_FLATTEN_STRUCT(bench_list, next);
+    AGGREGATE_FLATTEN_STRUCT(bench_list, prev);
+);
+
+static void list_destroy(void* data, size_t n);
+
+static void* list_generate(size_t n) {
+    struct bench_list* head = NULL;
+    struct bench_list* tail = NULL;
+
+    for(size_t i = 0; i < n; i++) {
+        struct bench_list* el = calloc(1, sizeof(*el));
+        if(el == NULL) {
+            list_destroy(head, i);
+            return NULL;
+        }
+        el->id = i;
+        el->prev = tail;
+        if(tail)
+            tail->next = el;
+        else
+            head = el;
+        tail = el;
+    }
+    return head;
+}
+
+static int list_flatten(struct uflat* uflat, void* data, size_t n) {
+    struct bench_list* head = data;
+
+    FOR_ROOT_POINTER(head,
+        FLATTEN_STRUCT(bench_list, head);
+    );
+    return uflat->flat.error;
+}
+
+static void list_destroy(void* data, size_t n) {
+    struct bench_list* el = data;
+
+    while(el) {
+        struct bench_list* next = el->next;
+        free(el);
+        el = next;
+    }
+}
+
+/*******************************************************
+ * BENCHMARK: red-black tree
+ *******************************************************/
+struct bench_tree_node {
+    unsigned long key;
+    struct rb_node node;
+};
+
+FUNCTION_DECLARE_FLATTEN_STRUCT_ARRAY_SELF_CONTAINED(bench_tree_node, sizeof(struct bench_tree_node));
+
+FUNCTION_DEFINE_FLATTEN_STRUCT_SELF_CONTAINED(bench_tree_node, sizeof(struct bench_tree_node),
+    AGGREGATE_FLATTEN_STRUCT_EMBEDDED_POINTER_ARRAY_SELF_CONTAINED_SHIFTED(bench_tree_node, sizeof(struct bench_tree_node), node.__rb_parent_color, offsetof(struct bench_tree_node, node.__rb_parent_color),
+                                        ptr_clear_2lsb_bits, flatten_ptr_restore_2lsb_bits, 1, -offsetof(struct bench_tree_node, node));
+    AGGREGATE_FLATTEN_STRUCT_ARRAY_SELF_CONTAINED_SHIFTED(bench_tree_node, sizeof(struct bench_tree_node), node.rb_right, offsetof(struct bench_tree_node, node.rb_right), 1, -offsetof(struct bench_tree_node, node));
+    AGGREGATE_FLATTEN_STRUCT_ARRAY_SELF_CONTAINED_SHIFTED(bench_tree_node, sizeof(struct bench_tree_node), node.rb_left, offsetof(struct bench_tree_node, node.rb_left), 1, -offsetof(struct bench_tree_node, node));
+);
+
+FUNCTION_DEFINE_FLATTEN_STRUCT_SELF_CONTAINED(rb_root, sizeof(struct rb_root),
+    AGGREGATE_FLATTEN_STRUCT_ARRAY_SELF_CONTAINED_SHIFTED(bench_tree_node, sizeof(struct bench_tree_node), rb_node, offsetof(struct rb_root, rb_node), 1, -offsetof(struct bench_tree_node, node));
+);
+
+static void tree_insert(struct rb_root* root, struct bench_tree_node* data) {
+    struct rb_node **new = &root->rb_node, *parent = NULL;
+
+    while(*new) {
+        struct bench_tree_node* this = container_of(*new, struct bench_tree_node, node);
+
+        parent = *new;
+        if(data->key < this->key)
+            new = &(*new)->rb_left;
+        else
+            new = &(*new)->rb_right;
+    }
+
+    rb_link_node(&data->node, parent, new);
+    rb_insert_color(&data->node, root);
+}
+
+static void tree_destroy(void* data, size_t n);
+
+static void* tree_generate(size_t n) {
+    struct rb_root* root = calloc(1, sizeof(*root));
+    if(root == NULL)
+        return NULL;
+
+    for(size_t i = 0; i < n; i++) {
+        struct bench_tree_node* el = calloc(1, sizeof(*el));
+        if(el == NULL) {
+            tree_destroy(root, i);
+            return NULL;
+        }
+        el->key = bench_rand();
+        tree_insert(root, el);
+    }
+    return root;
+}
+
+static int tree_flatten(struct uflat* uflat, void* data, size_t n) {
+    struct rb_root* root = data;
+
+    FOR_ROOT_POINTER(root,
+        FLATTEN_STRUCT_SELF_CONTAINED(rb_root, sizeof(struct rb_root), root);
+    );
+    return uflat->flat.error;
+}
+
+static void tree_destroy(void* data, size_t n) {
+    struct rb_root* root = data;
+    struct rb_node* p = rb_first(root);
+
+    while(p) {
+        struct bench_tree_node* el = container_of(p, struct bench_tree_node, node);
+        p = rb_next(p);
+        rb_erase(&el->node, root);
+        free(el);
+    }
+    free(root);
+}
+
+/*******************************************************
+ * BENCHMARK: array of pointers
+ *******************************************************/
+struct bench_item {
+    unsigned long id;
+    double value;
+};
+
+FUNCTION_DEFINE_FLATTEN_STRUCT(bench_item);
+
+static void ptrarray_destroy(void* data, size_t n);
+
+static void* ptrarray_generate(size_t n) {
+    struct bench_item** arr = calloc(n, sizeof(*arr));
+    if(arr == NULL)
+        return NULL;
+
+    for(size_t i = 0; i < n; i++) {
+        arr[i] = calloc(1, sizeof(struct bench_item));
+        if(arr[i] == NULL) {
+            ptrarray_destroy(arr, i);
+            return NULL;
+        }
+        arr[i]->id = i;
+        arr[i]->value = (double)bench_rand();
+    }
+    return arr;
+}
+
+static int ptrarray_flatten(struct uflat* uflat, void* data, size_t n) {
+    struct bench_item** arr = data;
+
+    FOR_ROOT_POINTER(arr,
+        FLATTEN_TYPE_ARRAY(struct bench_item*, arr, n);
+        FOREACH_POINTER(struct bench_item*, p, arr, n,
+            FLATTEN_STRUCT(bench_item, p);
+        );
+    );
+    return uflat->flat.error;
+}
+
+static void ptrarray_destroy(void* data, size_t n) {
+    struct bench_item** arr = data;
+
+    for(size_t i = 0; i < n; i++)
+        free(arr[i]);
+    free(arr);
+}
+
+/*******************************************************
+ * BENCHMARK: array of structures
+ *******************************************************/
+struct bench_record {
+    unsigned long id;
+    struct bench_record* peer;
+    double value;
+};
+
+FUNCTION_DECLARE_FLATTEN_STRUCT(bench_record);
+
+FUNCTION_DEFINE_FLATTEN_STRUCT(bench_record,
+    AGGREGATE_FLATTEN_STRUCT(bench_record, peer);
+);
+
+static void* structarray_generate(size_t n) {
+    struct bench_record* arr = calloc(n, sizeof(*arr));
+    if(arr == NULL)
+        return NULL;
+
+    /* Peers point back into the array, so most lookups hit elements already reserved */
+    for(size_t i = 0; i < n; i++) {
+        arr[i].id = i;
+        arr[i].peer = &arr[bench_rand() % n];
+        arr[i].value = (double)bench_rand();
+    }
+    return arr;
+}
+
+static int structarray_flatten(struct uflat* uflat, void* data, size_t n) {
+    struct bench_record* arr = data;
+
+    FOR_ROOT_POINTER(arr,
+        FLATTEN_STRUCT_ARRAY(bench_record, arr, n);
+    );
+    return uflat->flat.error;
+}
+
+static void structarray_destroy(void* data, size_t n) {
+    (void)n;
+    free(data);
+}
+
+/*******************************************************
+ * BENCHMARK: strings
+ *******************************************************/
+static void* strings_generate(size_t n) {
+    char** arr = calloc(n, sizeof(*arr));
+    if(arr == NULL)
+        return NULL;
+
+    for(size_t i = 0; i < n; i++) {
+        size_t len = 8 + bench_rand() % (BENCH_STRING_MAX_LEN - 8);
+        arr[i] = malloc(len + 1);
+        if(arr[i] == NULL) {
+            ptrarray_destroy(arr, i);
+            return NULL;
+        }
+        for(size_t j = 0; j < len; j++)
+            arr[i][j] = 'a' + bench_rand() % 26;
+        arr[i][len] = '\0';
+    }
+    return arr;
+}
+
+static int strings_flatten(struct uflat* uflat, void* data, size_t n) {
+    char** arr = data;
+
+    FOR_ROOT_POINTER(arr,
+        FLATTEN_TYPE_ARRAY(char*, arr, n);
+        FOREACH_POINTER(char*, s, arr, n,
+            FLATTEN_STRING(s);
+        );
+    );
+    return uflat->flat.error;
+}
+
+static void strings_destroy(void* data, size_t n) {
+    ptrarray_destroy(data, n);
+}
+
+/*******************************************************
+ * BENCHMARK: cyclic graph
+ *******************************************************/
+struct bench_graph_node {
+    unsigned long id;
+    struct bench_graph_node* edges[BENCH_GRAPH_EDGES];
+};
+
+FUNCTION_DECLARE_FLATTEN_STRUCT(bench_graph_node);
+
+FUNCTION_DEFINE_FLATTEN_STRUCT(bench_graph_node,
+    AGGREGATE_FLATTEN_STRUCT(bench_graph_node, edges[0]);
+    AGGREGATE_FLATTEN_STRUCT(bench_graph_node, edges[1]);
+    AGGREGATE_FLATTEN_STRUCT(bench_graph_node, edges[2]);
+    AGGREGATE_FLATTEN_STRUCT(bench_graph_node, edges[3]);
+);
+
+static void* graph_generate(size_t n) {
+    struct bench_graph_node** nodes = calloc(n, sizeof(*nodes));
+    if(nodes == NULL)
+        return NULL;
+
+    for(size_t i = 0; i < n; i++) {
+        nodes[i] = calloc(1, sizeof(struct bench_graph_node));
+        if(nodes[i] == NULL) {
+            ptrarray_destroy(nodes, i);
+            return NULL;
+        }
+        nodes[i]->id = i;
+    }
+
+    /* The first edge forms a ring, so every node is reachable from the root */
+    for(size_t i = 0; i < n; i++) {
+        nodes[i]->edges[0] = nodes[(i + 1) % n];
+        for(size_t j = 1; j < BENCH_GRAPH_EDGES; j++)
+            nodes[i]->edges[j] = nodes[bench_rand() % n];
+    }
+    return nodes;
+}
+
+static int graph_flatten(struct uflat* uflat, void* data, size_t n) {
+    struct bench_graph_node* root = ((struct bench_graph_node**)data)[0];
+
+    FOR_ROOT_POINTER(root,
+        FLATTEN_STRUCT(bench_graph_node, root);
+    );
+    return uflat->flat.error;
+}
+
+static void graph_destroy(void* data, size_t n) {
+    ptrarray_destroy(data, n);
+}
+
+/*******************************************************
+ * BENCHMARK: wide structures with function pointers
+ *******************************************************/
+typedef void (*bench_fptr_t)(void);
+
+struct bench_wide {
+    unsigned long id;
+    bench_fptr_t ops[BENCH_WIDE_FPTRS];
+    struct bench_wide* next;
+};
+
+FUNCTION_DECLARE_FLATTEN_STRUCT(bench_wide);
+
+FUNCTION_DEFINE_FLATTEN_STRUCT(bench_wide,
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[0]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[1]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[2]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[3]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[4]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[5]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[6]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[7]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[8]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[9]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[10]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[11]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[12]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[13]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[14]);
+    AGGREGATE_FLATTEN_FUNCTION_POINTER(ops[15]);
+    AGGREGATE_FLATTEN_STRUCT(bench_wide, next);
+);
+
+static const bench_fptr_t wide_targets[] = {
+    (bench_fptr_t)flat_zalloc,
+    (bench_fptr_t)flat_free,
+    (bench_fptr_t)flatten_write,
+    (bench_fptr_t)uflat_write,
+    (bench_fptr_t)uflat_set_option,
+    (bench_fptr_t)bench_rand,
+    (bench_fptr_t)time_now_ns,
+    (bench_fptr_t)list_generate,
+};
+
+static void wide_destroy(void* data, size_t n);
+
+static void* wide_generate(size_t n) {
+    struct bench_wide* head = NULL;
+    struct bench_wide** tail = &head;
+
+    for(size_t i = 0; i < n; i++) {
+        struct bench_wide* el = calloc(1, sizeof(*el));
+        if(el == NULL) {
+            wide_destroy(head, i);
+            return NULL;
+        }
+        el->id = i;
+        for(size_t j = 0; j < BENCH_WIDE_FPTRS; j++)
+            el->ops[j] = wide_targets[bench_rand() % (sizeof(wide_targets) / sizeof(wide_targets[0]))];
+        *tail = el;
+        tail = &el->next;
+    }
+    return head;
+}
+
+static int wide_flatten(struct uflat* uflat, void* data, size_t n) {
+    struct bench_wide* head = data;
+
+    FOR_ROOT_POINTER(head,
+        FLATTEN_STRUCT(bench_wide, head);
+    );
+    return uflat->flat.error;
+}
+
+static void wide_destroy(void* data, size_t n) {
+    struct bench_wide* el = data;
+
+    while(el) {
+        struct bench_wide* next = el->next;
+        free(el);
+        el = next;
+    }
+}
+
+/*******************************************************
+ * BENCHMARKS REGISTRY
+ *******************************************************/
+struct bench_case {
+    const char* name;
+    /* Upper bound of image bytes produced per object, used to size the output */
+    size_t image_bytes_per_object;
+    void* (*generate)(size_t n);
+    int (*flatten)(struct uflat* uflat, void* data, size_t n);
+    void (*destroy)(void* data, size_t n);
+};
+
+static const struct bench_case bench_cases[] = {
+    {"list", 128, list_generate, list_flatten, list_destroy},
+    {"rbtree", 160, tree_generate, tree_flatten, tree_destroy},
+    {"ptrarray", 128, ptrarray_generate, ptrarray_flatten, ptrarray_destroy},
+    {"structarray", 96, structarray_generate, structarray_flatten, structarray_destroy},
+    {"strings", 160, strings_generate, strings_flatten, strings_destroy},
+    {"graph", 192, graph_generate, graph_flatten, graph_destroy},
+    {"wide_fptr", 1024, wide_generate, wide_flatten, wide_destroy},
+};
+#define BENCH_CASES_COUNT (sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+struct bench_result {
+    size_t image_size;
+    size_t arena_used;
+    unsigned long long flatten_ns;
+    unsigned long long write_ns;
+};
+
+static int run_bench(const struct args* args, const struct bench_case* bench, size_t n, struct bench_result* result) {
+    int ret;
+    unsigned long long start, flatten_end;
+    void* data;
+
+    data = bench->generate(n);
+    if(data == NULL) {
+        bench_log("failed to generate %zu objects for `%s`", n, bench->name);
+        return -ENOMEM;
+    }
+
+    struct uflat* uflat = uflat_init(args->image_path);
+    if(UFLAT_PTR_ERR(uflat)) {
+        bench_log("failed to initialize UFLAT: %s", strerror(UFLAT_PTR_ERR(uflat)));
+        bench->destroy(data, n);
+        return -EFAULT;
+    }
+
+    ret = uflat_set_option(uflat, UFLAT_OPT_OUTPUT_SIZE, n * bench->image_bytes_per_object + UFLAT_DEFAULT_OUTPUT_SIZE);
+    if(ret) {
+        bench_log("failed to configure UFLAT (%d)", ret);
+        goto exit;
+    }
+
+    start = time_now_ns();
+    ret = bench->flatten(uflat, data, n);
+    flatten_end = time_now_ns();
+    if(ret) {
+        bench_log("flattening `%s` failed with error %d", bench->name, ret);
+        goto exit;
+    }
+
+    ret = uflat_write(uflat);
+    result->write_ns = time_now_ns() - flatten_end;
+    if(ret) {
+        bench_log("writing `%s` image failed with error %d", bench->name, ret);
+        goto exit;
+    }
+
+    result->flatten_ns = flatten_end - start;
+    result->image_size = ((struct flatten_header*)uflat->out_mem)->image_size;
+    /* Engine memory is only released in uflat_fini, so this is the peak usage */
+    result->arena_used = uflat->flat.mused;
+
+exit:
+    uflat_fini(uflat);
+    bench->destroy(data, n);
+    return ret;
+}
+
+static void print_result(FILE* out, bool first, const struct bench_case* bench, size_t n, const struct bench_result* result) {
+    unsigned long long total_ns = result->flatten_ns + result->write_ns;
+
+    fprintf(out,
+            "%s\n    {\"name\": \"%s\", \"objects\": %zu, \"image_size\": %zu, "
+            "\"flatten_ns\": %llu, \"write_ns\": %llu, \"total_ns\": %llu, "
+            "\"ns_per_object\": %.2f, \"bytes_per_second\": %.0f, "
+            "\"peak_arena_bytes\": %zu}",
+            first ? "" : ",", bench->name, n, result->image_size,
+            result->flatten_ns, result->write_ns, total_ns,
+            (double)total_ns / n, total_ns ? result->image_size * 1e9 / total_ns : 0.0,
+            result->arena_used);
+}
+
+/*******************************************************
+ * OPTIONS PARSING
+ *******************************************************/
+const char* argp_program_version = "flatbench 1.0";
+static const char argp_doc[] = "flatbench -- microbenchmarks of the flattening engine (results are printed in JSON format)";
+static const char argp_args_doc[] = "[BENCHMARKS...]";
+static struct argp_option options[] = {
+    {"list", 'l', 0, 0, "List available benchmarks"},
+    {"min", 'n', "N", 0, "Smallest graph size in objects (default 1000)"},
+    {"max", 'x', "N", 0, "Largest graph size in objects (default 1000000, at most 10000000)"},
+    {"image", 'i', "PATH", 0, "Path of the temporary image file (default flatbench.img)"},
+    {"output", 'o', "PATH", 0, "Save JSON results to PATH instead of stdout"},
+    {0},
+};
+
+static error_t parse_opt(int key, char* arg, struct argp_state* state) {
+    struct args* options = (struct args*)state->input;
+    bool matched = false;
+    size_t i;
+
+    switch(key) {
+    case 'l':
+        for(i = 0; i < BENCH_CASES_COUNT; i++)
+            printf("%s\n", bench_cases[i].name);
+        exit(0);
+    case 'n':
+        options->min_objects = strtoul(arg, NULL, 0);
+        break;
+    case 'x':
+        options->max_objects = strtoul(arg, NULL, 0);
+        break;
+    case 'i':
+        options->image_path = arg;
+        break;
+    case 'o':
+        options->json_path = arg;
+        break;
+
+    case ARGP_KEY_ARG:
+        for(i = 0; i < BENCH_CASES_COUNT; i++)
+            if(!strcmp(arg, bench_cases[i].name) || !strcmp(arg, "ALL"))
+                options->selected[i] = options->any_selected = matched = true;
+        if(!matched)
+            argp_error(state, "unknown benchmark `%s`", arg);
+        break;
+
+    case ARGP_KEY_END:
+        if(options->min_objects < 1 || options->min_objects > options->max_objects)
+            argp_error(state, "invalid range of graph sizes");
+        if(options->max_objects > BENCH_MAX_OBJECTS)
+            argp_error(state, "graph size is limited to %lu objects", BENCH_MAX_OBJECTS);
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+static struct argp argp = {options, parse_opt, argp_args_doc, argp_doc};
+
+/*******************************************************
+ * ENTRY POINT
+ *******************************************************/
+int main(int argc, char** argv) {
+    int ret = 0;
+    bool first = true;
+    FILE* out = stdout;
+    struct args opts = {
+        .min_objects = BENCH_DEFAULT_MIN_OBJECTS,
+        .max_objects = BENCH_DEFAULT_MAX_OBJECTS,
+        .image_path = "flatbench.img",
+    };
+
+    if(argp_parse(&argp, argc, argv, 0, 0, &opts) != 0) {
+        bench_log("invalid options provided");
+        return 1;
+    }
+
+    if(opts.json_path) {
+        out = fopen(opts.json_path, "w");
+        if(out == NULL) {
+            bench_log("failed to open %s: %s", opts.json_path, strerror(errno));
+            return 1;
+        }
+    }
+
+    fprintf(out, "{\"benchmarks\": [");
+    for(size_t i = 0; i < BENCH_CASES_COUNT; i++) {
+        if(opts.any_selected && !opts.selected[i])
+            continue;
+
+        for(size_t n = opts.min_objects; n <= opts.max_objects; n *= 10) {
+            struct bench_result result = {0};
+
+            bench_log("running %-10s with %zu objects", bench_cases[i].name, n);
+            if(run_bench(&opts, &bench_cases[i], n, &result)) {
+                ret = 1;
+                continue;
+            }
+            print_result(out, first, &bench_cases[i], n, &result);
+            first = false;
+            fflush(out);
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    if(out != stdout)
+        fclose(out);
+    remove(opts.image_path);
+    return ret;
+}
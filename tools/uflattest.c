@@ -35,6 +35,12 @@ struct args {
     bool continuous;
     bool verbose;
     bool skip_memcpy;
+    bool compact;
+    bool from_memory;
+    bool from_pipe;
+    bool snapshot;
+    bool fragment_arena;
+    unsigned long load_threads;
     const char* output_dir;
 };
 
@@ -189,12 +195,43 @@ enum flat_test_flags get_test_flags(const char* name) {
     return 0;
 }
 
+/*
+ * Load image through a pipe fed by a child process, so that
+ *  it has to be read sequentially in a single pass
+ */
+static int load_from_pipe(CUnflatten flatten, FILE* file, get_function_address_t gfa, int flags) {
+    int fds[2];
+    int ret = pipe(fds);
+    assert(ret == 0);
+
+    pid_t writer = fork();
+    if(writer == 0) {
+        char buf[65536];
+        size_t rd;
+
+        close(fds[0]);
+        while((rd = fread(buf, 1, sizeof(buf), file)) > 0)
+            if(write(fds[1], buf, rd) != (ssize_t)rd)
+                _exit(1);
+        _exit(0);
+    }
+    assert(writer > 0);
+    close(fds[1]);
+
+    ret = unflatten_load_from_fd(flatten, fds[0], gfa, flags);
+    close(fds[0]);
+    waitpid(writer, NULL, 0);
+    return ret;
+}
+
 int run_test(struct args* args, const char* name) {
     int ret;
     FILE* file;
     char out_name[128];
     int test_result = KFLAT_TEST_FAIL;
     struct time_elapsed total_time, flatten_time;
+    void* image = NULL;
+    size_t image_size = 0;
 
     if(args->verbose)
         log_info("=> Testing %s...", name);
@@ -219,6 +256,8 @@ int run_test(struct args* args, const char* name) {
         uflat_set_option(uflat, UFLAT_OPT_VERBOSE, 1);
     if(args->skip_memcpy)
         uflat_set_option(uflat, UFLAT_OPT_SKIP_MEM_COPY, 1);
+    if(args->compact)
+        uflat_set_option(uflat, UFLAT_OPT_COMPACT_TABLES, 1);
 
     flat_test_case_handler_t handler = get_test_handler(name);
     if(handler == NULL) {
@@ -252,6 +291,8 @@ int run_test(struct args* args, const char* name) {
         assert(file != NULL);
 
         CUnflatten flatten = unflatten_init(0);
+        if(args->load_threads > 1)
+            unflatten_set_relocation_threads(flatten, args->load_threads);
 
         if(args->imginfo) {
             ret = unflatten_imginfo(flatten, file);
@@ -262,7 +303,24 @@ int run_test(struct args* args, const char* name) {
             rewind(file);
         }
 
-        if(args->continuous || get_test_flags(name) & KFLAT_TEST_FORCE_CONTINOUS) {
+        bool continuous = args->continuous || get_test_flags(name) & KFLAT_TEST_FORCE_CONTINOUS;
+        int load_flags = (continuous ? UNFLATTEN_LOAD_CONTINUOUS : 0) |
+                         (args->fragment_arena ? UNFLATTEN_LOAD_FRAGMENT_ARENA : 0);
+        if(args->from_memory) {
+            struct stat st;
+            ret = fstat(fileno(file), &st);
+            assert(ret == 0);
+
+            // Read-only mapping makes sure that borrowed buffer is never modified
+            image_size = st.st_size;
+            image = mmap(NULL, image_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+            assert(image != MAP_FAILED);
+            ret = unflatten_load_from_memory(flatten, image, image_size, get_test_gfa(name), load_flags);
+        } else if(args->from_pipe) {
+            ret = load_from_pipe(flatten, file, get_test_gfa(name), load_flags);
+        } else if(args->fragment_arena) {
+            ret = unflatten_load_from_fd(flatten, fileno(file), get_test_gfa(name), load_flags);
+        } else if(continuous) {
             ret = unflatten_load_continuous(flatten, file, get_test_gfa(name));
         } else {
             ret = unflatten_load(flatten, file, get_test_gfa(name));
@@ -278,11 +336,26 @@ int run_test(struct args* args, const char* name) {
             goto unflatten_cleanup;
         }
 
+        if(args->snapshot) {
+            ret = unflatten_snapshot(flatten);
+            if(ret != 0) {
+                log_error("failed to take snapshot of loaded image - %s", unflatten_explain_status(ret));
+                goto unflatten_cleanup;
+            }
+        }
+
         fflush(stdout);
         fflush(stderr);
         pid_t pid = fork();
         if(pid == 0) {
             ret = validator(memory, 0, flatten);
+
+            // Validators may modify the image, so check it again after restore
+            if(args->snapshot && ret == KFLAT_TEST_SUCCESS) {
+                if(unflatten_restore(flatten) != 0)
+                    exit(KFLAT_TEST_FAIL);
+                ret = validator(memory, 0, flatten);
+            }
             exit(ret);
         } else if(pid > 0) {
             int status = 0;
@@ -315,6 +388,8 @@ int run_test(struct args* args, const char* name) {
 
     unflatten_cleanup:
         unflatten_deinit(flatten);
+        if(image != NULL)
+            munmap(image, image_size);
         goto exit;
     }
 
@@ -356,6 +431,12 @@ static struct argp_option options[] = {
     {"continuous", 'c', 0, 0, "Load memory image in continuous fashion during validation"},
     {"verbose", 'v', 0, 0, "More verbose logs"},
     {"single-buffer", 'b', 0, 0, "Don't copy memory to temporary buffer during flattening"},
+    {"compact", 'z', 0, 0, "Write images with compact pointer and fragment tables"},
+    {"load-threads", 'j', "N", 0, "Use N threads to relocate pointers when loading images"},
+    {"from-memory", 'r', 0, 0, "Load saved images from read-only memory mapping instead of file"},
+    {"pipe", 'p', 0, 0, "Load saved images through a pipe instead of file"},
+    {"snapshot", 'S', 0, 0, "Validate images twice, restoring loaded memory from snapshot in between"},
+    {"fragment-arena", 'a', 0, 0, "Copy fragments of loaded images into one mapping"},
     {0},
 };
 
@@ -387,6 +468,26 @@ static error_t parse_opt(int key, char* arg, struct argp_state* state) {
     case 'b':
         options->skip_memcpy = true;
         break;
+    case 'z':
+        options->compact = true;
+        break;
+    case 'r':
+        options->from_memory = true;
+        break;
+    case 'p':
+        options->from_pipe = true;
+        break;
+    case 'S':
+        options->snapshot = true;
+        break;
+    case 'a':
+        options->fragment_arena = true;
+        break;
+    case 'j':
+        options->load_threads = strtoul(arg, NULL, 0);
+        if(options->load_threads < 1)
+            argp_error(state, "load thread count must be at least 1");
+        break;
 
     case ARGP_KEY_ARG:
         if(!strcmp(arg, "ALL"))